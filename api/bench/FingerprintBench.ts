@@ -0,0 +1,400 @@
+"use strict";
+import * as fs from "fs";
+import {Client} from "pg";
+import {AppConfig} from "../config/AppConfig";
+import {FingerprintMatching} from "../models/FingerprintMatching";
+
+/**
+ * Scaling benchmark of fingerprint lookups, run against a local postgres with pg_echoprint loaded:
+ *
+ *   createdb kotori_bench
+ *   npm run bench -- --BENCH_SIZES=10000,100000,1000000 --BENCH_QUERIES=100
+ *
+ * For every size, the fingerprint table of BENCH_DATABASE is (re)created and filled server-side with synthetic
+ * fingerprints: code set sizes are log-normally distributed around the size of a typical song, codes are skewed
+ * towards a small pool of common ones, and a share of the fingerprints forms clusters of near-duplicates.
+ * Every matching function is then run for the same queries (half of them near-duplicates of stored fingerprints)
+ * and p50/p99 latency, the share of near-duplicate queries finding their source first, rows scanned and
+ * buffer hits/reads (from EXPLAIN ANALYZE) are reported per size, which gives a scaling curve.
+ * The "coarse" and "rerank" shapes run exactly the query SongModel uses (FingerprintMatching.candidatesSql),
+ * "index" runs echoprint_index_lookup, if the shared memory index is available for BENCH_DATABASE.
+ */
+
+type Options = {
+    BENCH_DATABASE: string;
+    BENCH_SIZES: number[];
+    BENCH_QUERIES: number;
+    BENCH_SEED: number;
+    BENCH_OUTPUT: string | undefined;
+};
+
+type Query = {
+    hash: number[];
+    timedHash: number[];
+    // id of the fingerprint a near-duplicate query was derived from
+    sourceId: number | null;
+};
+
+type Shape = {
+    name: string;
+    sql: string;
+    parameters: (query: Query) => (number[] | null)[];
+};
+
+type ShapeResult = {
+    size: number;
+    shape: string;
+    p50: number;
+    p99: number;
+    top1: number;
+    rowsScanned: number;
+    sharedHit: number;
+    sharedRead: number;
+};
+
+const decimalNumBase = 10,
+    msPerSec = 1000,
+    nsPerMs = 1e6,
+    percent = 100,
+    p50 = 0.5,
+    p99 = 0.99,
+    // codegen emits 20 bit codes
+    codeSpace = 1 << 20,
+    // upper 32 bits of a timed code hold the code
+    timedCodeShift = 0x100000000,
+    // quantized time offsets of a ~5 minute song
+    maxOffset = 13000,
+    // a share of the codes comes from a small pool, like silence or common beats do
+    popularCodes = 4096,
+    popularShare = 0.1,
+    // unique codes per fingerprint, log-normally distributed
+    medianSize = 800,
+    sizeSigma = 0.5,
+    minSize = 100,
+    maxSize = 6000,
+    // near-duplicate clusters, members keep keepShare of the codes of the first one and add noiseShare random ones
+    clusterShare = 0.1,
+    clusterSize = 5,
+    keepShare = 0.7,
+    noiseShare = 0.1,
+    nearDuplicateQueryShare = 0.5,
+    warmupQueries = 3,
+    explainQueries = 5,
+    indexLookupCount = FingerprintMatching.coarseCandidateCount,
+    indexPollMs = 1000,
+    indexTimeoutMs = 600000;
+
+function readOptions(): Options {
+    const option = (key: string, defaultValue: string): string => {
+        const [value] = process.argv
+            .filter((arg: string) => arg.replace(/^--/, "").split("=")[0] === key)
+            .map((arg: string) => arg.split("=")[1]);
+
+        return value || process.env[key] || defaultValue;
+    };
+
+    return {
+        BENCH_DATABASE: option("BENCH_DATABASE", "kotori_bench"),
+        BENCH_SIZES: option("BENCH_SIZES", "10000,100000,1000000").split(",")
+            .map((size: string) => parseInt(size, decimalNumBase)),
+        BENCH_QUERIES: parseInt(option("BENCH_QUERIES", "100"), decimalNumBase),
+        BENCH_SEED: parseInt(option("BENCH_SEED", "1"), decimalNumBase),
+        BENCH_OUTPUT: option("BENCH_OUTPUT", "") || undefined
+    };
+}
+
+/**
+ * @description Seeded PRNG (mulberry32), so the queries are the same on every run
+ */
+class Random {
+    private state: number;
+
+    constructor(seed: number) {
+        this.state = seed >>> 0;
+    }
+
+    public next(): number {
+        const shift1 = 15, shift2 = 7, shift3 = 14, mult1 = 61, increment = 0x6D2B79F5, range = 4294967296;
+        let t = this.state = (this.state + increment) >>> 0;
+
+        t = Math.imul(t ^ (t >>> shift1), t | 1);
+        t ^= t + Math.imul(t ^ (t >>> shift2), t | mult1);
+        return ((t ^ (t >>> shift3)) >>> 0) / range;
+    }
+
+    public int(max: number): number {
+        return Math.floor(this.next() * max);
+    }
+}
+
+async function hasFunction(client: Client, name: string): Promise<boolean> {
+    const [row] = (await client.query("SELECT to_regproc($1) IS NOT NULL AS found", [name])).rows;
+
+    return row.found;
+}
+
+/**
+ * @description Recreates the fingerprint table with size synthetic fingerprints, generated by postgres itself
+ */
+async function fillTable(client: Client, size: number, seed: number): Promise<void> {
+    const clusters = Math.ceil(size * clusterShare / clusterSize),
+        baseRows = Math.max(size - clusters * (clusterSize - 1), clusters),
+        drawCode = `CASE WHEN random() < ${popularShare}
+                THEN floor(random() * ${popularCodes})
+                ELSE floor(random() * ${codeSpace})
+            END::bigint`;
+
+    await client.query("DROP TABLE IF EXISTS fingerprint");
+    await client.query(`CREATE TABLE fingerprint(
+            id bigserial PRIMARY KEY,
+            hash integer[] NOT NULL,
+            timed_hash bigint[]
+        )`);
+    if (await hasFunction(client, "echoprint_index_invalidate")) {
+        await client.query(`CREATE TRIGGER fingerprint_index_invalidate
+            AFTER INSERT OR DELETE OR UPDATE OR TRUNCATE ON fingerprint
+            FOR EACH STATEMENT EXECUTE PROCEDURE echoprint_index_invalidate()`);
+    }
+    await client.query("SELECT setseed($1)", [1 / (seed + 1)]);
+
+    // "+ 0 * g.i" etc. make the subqueries correlated, so they're evaluated for every row
+    await client.query(`INSERT INTO fingerprint(hash, timed_hash)
+        SELECT fp.hash, fp.timed_hash
+        FROM generate_series(1, $1::int) AS g(i)
+        CROSS JOIN LATERAL (
+            SELECT greatest(${minSize}, least(${maxSize}, exp(
+                ln(${medianSize}) + ${sizeSigma} * sqrt(-2 * ln(1 - random())) * cos(2 * pi() * random())
+            )))::int + 0 * g.i AS size
+        ) s
+        CROSS JOIN LATERAL (
+            SELECT array_agg(t >> 32 ORDER BY t)::int[] AS hash, array_agg(t ORDER BY t) AS timed_hash
+            FROM (
+                SELECT DISTINCT ON (t >> 32) t
+                FROM (
+                    SELECT (${drawCode} << 32) | floor(random() * ${maxOffset})::bigint AS t
+                    FROM generate_series(1, s.size)
+                ) drawn
+                ORDER BY t >> 32, t
+            ) codes
+        ) fp`, [baseRows]);
+
+    await client.query(`INSERT INTO fingerprint(hash, timed_hash)
+        SELECT v.hash, v.timed_hash
+        FROM (SELECT id, timed_hash FROM fingerprint ORDER BY id LIMIT $1::int) seed
+        CROSS JOIN generate_series(2, ${clusterSize}) AS m(i)
+        CROSS JOIN LATERAL (
+            SELECT array_agg(t >> 32 ORDER BY t)::int[] AS hash, array_agg(t ORDER BY t) AS timed_hash
+            FROM (
+                SELECT DISTINCT ON (t >> 32) t
+                FROM (
+                    SELECT t FROM unnest(seed.timed_hash) AS t WHERE random() < ${keepShare} + 0 * m.i
+                    UNION ALL
+                    SELECT (${drawCode} << 32) | floor(random() * ${maxOffset})::bigint
+                    FROM generate_series(1, (array_length(seed.timed_hash, 1) * ${noiseShare})::int + 0 * m.i)
+                ) drawn
+                ORDER BY t >> 32, t
+            ) codes
+        ) v`, [clusters]);
+    await client.query("VACUUM ANALYZE fingerprint");
+}
+
+/**
+ * @description Builds a query from the given timed codes, sorted and unique like the tool sends them
+ */
+function toQuery(timedHash: number[], sourceId: number | null): Query {
+    timedHash.sort((a: number, b: number) => a - b);
+    const hash = timedHash.map((t: number) => Math.floor(t / timedCodeShift))
+        .filter((code: number, i: number, codes: number[]) => i === 0 || code !== codes[i - 1]);
+
+    return {hash, timedHash, sourceId};
+}
+
+async function generateQueries(client: Client, count: number, rnd: Random): Promise<Query[]> {
+    const [{max}] = (await client.query("SELECT max(id)::int AS max FROM fingerprint")).rows,
+        queries: Query[] = [];
+
+    for (let i = 0; i < count; i++) {
+        if (i < count * nearDuplicateQueryShare) {
+            const sourceId = 1 + rnd.int(max),
+                [row] = (await client.query("SELECT timed_hash FROM fingerprint WHERE id = $1", [sourceId])).rows,
+                stored: number[] = row.timed_hash.map((t: string) => parseInt(t, decimalNumBase)),
+                kept = stored.filter(() => rnd.next() < keepShare),
+                noise = Array(Math.round(stored.length * noiseShare)).fill(0)
+                    .map(() => rnd.int(codeSpace) * timedCodeShift + rnd.int(maxOffset));
+
+            queries.push(toQuery(kept.concat(noise), sourceId));
+        } else {
+            const timedHash = Array(medianSize).fill(0)
+                .map(() => rnd.int(codeSpace) * timedCodeShift + rnd.int(maxOffset));
+
+            queries.push(toQuery(timedHash, null));
+        }
+    }
+    return queries;
+}
+
+/**
+ * @description Waits until the shared memory index holds the last inserted fingerprint
+ */
+async function waitForIndex(client: Client): Promise<boolean> {
+    const [last] = (await client.query("SELECT id::int, hash FROM fingerprint ORDER BY id DESC LIMIT 1")).rows,
+        started = Date.now();
+
+    while (Date.now() - started < indexTimeoutMs) {
+        try {
+            const [top] = (await client.query("SELECT id::int FROM echoprint_index_lookup($1::int[], 1)",
+                [last.hash])).rows;
+
+            if (top && top.id === last.id) {
+                return true;
+            }
+        } catch (e) {
+            // not loaded through shared_preload_libraries, or indexing another database
+            return false;
+        }
+        await new Promise((resolve) => setTimeout(resolve, indexPollMs));
+    }
+    return false;
+}
+
+function percentile(sorted: number[], p: number): number {
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+/**
+ * @description Sums up rows scanned and buffers of an EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) plan
+ */
+function planStats(plan: any): {rowsScanned: number, sharedHit: number, sharedRead: number} {
+    const scans = ["Seq Scan", "Index Scan", "Index Only Scan", "Bitmap Heap Scan", "Function Scan"],
+        countRows = (node: any): number => {
+            const own = scans.indexOf(node["Node Type"]) >= 0 ? node["Actual Rows"] * node["Actual Loops"] : 0;
+
+            return (node.Plans || []).reduce((sum: number, child: any) => sum + countRows(child), own);
+        };
+
+    return {
+        rowsScanned: countRows(plan),
+        sharedHit: plan["Shared Hit Blocks"] || 0,
+        sharedRead: plan["Shared Read Blocks"] || 0
+    };
+}
+
+async function runShape(client: Client, size: number, shape: Shape, queries: Query[]): Promise<ShapeResult> {
+    const latencies: number[] = [],
+        stats = {rowsScanned: 0, sharedHit: 0, sharedRead: 0};
+    let found = 0, nearDuplicates = 0;
+
+    for (let query of queries.slice(0, warmupQueries)) {
+        await client.query(shape.sql, shape.parameters(query));
+    }
+    for (let query of queries) {
+        const started = process.hrtime(),
+            rows = (await client.query(shape.sql, shape.parameters(query))).rows,
+            [sec, ns] = process.hrtime(started);
+
+        latencies.push(sec * msPerSec + ns / nsPerMs);
+        if (query.sourceId !== null) {
+            nearDuplicates++;
+            found += rows.length && parseInt(rows[0].id, decimalNumBase) === query.sourceId ? 1 : 0;
+        }
+    }
+    for (let query of queries.slice(0, explainQueries)) {
+        const [row] = (await client.query(`EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) ${shape.sql}`,
+                shape.parameters(query))).rows,
+            queryStats = planStats(row["QUERY PLAN"][0].Plan);
+
+        stats.rowsScanned += queryStats.rowsScanned / explainQueries;
+        stats.sharedHit += queryStats.sharedHit / explainQueries;
+        stats.sharedRead += queryStats.sharedRead / explainQueries;
+    }
+
+    latencies.sort((a: number, b: number) => a - b);
+    return {
+        size,
+        shape: shape.name,
+        p50: percentile(latencies, p50),
+        p99: percentile(latencies, p99),
+        top1: nearDuplicates ? found / nearDuplicates : 0,
+        rowsScanned: Math.round(stats.rowsScanned),
+        sharedHit: Math.round(stats.sharedHit),
+        sharedRead: Math.round(stats.sharedRead)
+    };
+}
+
+function printRow(values: string[]) {
+    const widths = [13, 7, 9, 9, 6, 13, 12, 12];
+
+    console.log(values.map((value: string, i: number) => (" ".repeat(widths[i]) + value).slice(-widths[i])).join(" "));
+}
+
+function printResult(result: ShapeResult) {
+    const precision = 2;
+
+    printRow([
+        String(result.size), result.shape, result.p50.toFixed(precision), result.p99.toFixed(precision),
+        (result.top1 * percent).toFixed(0) + "%", String(result.rowsScanned),
+        String(result.sharedHit), String(result.sharedRead)
+    ]);
+}
+
+async function main() {
+    const options = readOptions(),
+        client = new Client({
+            user: AppConfig.POSTGRES_USER,
+            host: AppConfig.POSTGRES_HOST,
+            database: options.BENCH_DATABASE,
+            password: AppConfig.POSTGRES_PASSWORD,
+            port: AppConfig.POSTGRES_PORT
+        }),
+        results: ShapeResult[] = [],
+        candidatesSql = FingerprintMatching.candidatesSql("$1::int[]", "$2::bigint[]"),
+        shapes: Shape[] = [{
+            name: "coarse",
+            sql: `SELECT id, score FROM (${candidatesSql}) matches WHERE score > ${FingerprintMatching.minScore}`,
+            parameters: (query: Query) => [query.hash, null]
+        }, {
+            name: "rerank",
+            sql: `SELECT id, score FROM (${candidatesSql}) matches WHERE score > ${FingerprintMatching.minScore}`,
+            parameters: (query: Query) => [query.hash, query.timedHash]
+        }],
+        indexShape: Shape = {
+            name: "index",
+            sql: `SELECT id, score FROM echoprint_index_lookup($1::int[], ${indexLookupCount})
+                WHERE score > ${FingerprintMatching.minScore}`,
+            parameters: (query: Query) => [query.hash]
+        };
+
+    await client.connect();
+    if (!(await hasFunction(client, "echoprint_compare"))) {
+        throw new Error(`pg_echoprint is not installed in ${options.BENCH_DATABASE}`);
+    }
+    printRow(["fingerprints", "shape", "p50 ms", "p99 ms", "top1", "rows scanned", "buffer hits", "buffer reads"]);
+
+    for (let size of options.BENCH_SIZES) {
+        const rnd = new Random(options.BENCH_SEED);
+
+        await fillTable(client, size, options.BENCH_SEED);
+        const queries = await generateQueries(client, options.BENCH_QUERIES, rnd),
+            sizeShapes = shapes.slice();
+
+        if (await hasFunction(client, "echoprint_index_lookup") && await waitForIndex(client)) {
+            sizeShapes.push(indexShape);
+        }
+        for (let shape of sizeShapes) {
+            const result = await runShape(client, size, shape, queries);
+
+            printResult(result);
+            results.push(result);
+        }
+    }
+
+    if (options.BENCH_OUTPUT) {
+        fs.writeFileSync(options.BENCH_OUTPUT, JSON.stringify(results, null, 2));
+    }
+    await client.end();
+}
+
+main().catch((e: Error) => {
+    console.error(e);
+    process.exit(1);
+});
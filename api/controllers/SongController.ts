@@ -4,7 +4,9 @@ import {JsonController, Req, Res, Body, Get, Post, Put, UseBefore} from "routing
 import * as HTTP_STATUS_CODE from "http-status-codes";
 import {JWTAuthentication} from "../middleware/JWTAuthentication";
 import {JWTUserData} from "../auth/JWTSingleton";
-import {Fingerprint, SongModel, UpdateTrackData, QueryResponse, InsertTrackData} from "../models/SongModel";
+import {
+    Fingerprint, TimedFingerprint, SongModel, UpdateTrackData, QueryResponse, InsertTrackData
+} from "../models/SongModel";
 import {UserModel} from "../models/UserModel";
 import {JSONResponse} from "../types/JSONResponse";
 
@@ -12,6 +14,7 @@ const apiVersion = "v1";
 
 export type QueryData = {
     fingerprint: Fingerprint;
+    timedFingerprint?: TimedFingerprint;
 };
 
 @JsonController()
@@ -62,7 +65,10 @@ export class SongController {
         const fingerprints = queryDataList.map(queryData => {
                 return queryData.fingerprint;
             }),
-            results: QueryResponse[] = await SongModel.queryAll(fingerprints);
+            timedFingerprints = queryDataList.map(queryData => {
+                return queryData.timedFingerprint || null;
+            }),
+            results: QueryResponse[] = await SongModel.queryAll(fingerprints, timedFingerprints);
 
         return results;
     }
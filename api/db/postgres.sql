@@ -88,6 +88,7 @@ ALTER TABLE public.tag OWNER TO postgres;
 CREATE TABLE public.fingerprint(
 	id bigserial NOT NULL,
 	hash integer[] NOT NULL,
+	timed_hash bigint[],
 	created_at timestamp NOT NULL DEFAULT now(),
 	CONSTRAINT fingerprint_pk PRIMARY KEY (id)
 
@@ -96,6 +97,33 @@ CREATE TABLE public.fingerprint(
 ALTER TABLE public.fingerprint OWNER TO postgres;
 -- ddl-end --
 
+-- object: fingerprint_digest | type: INDEX --
+-- DROP INDEX IF EXISTS public.fingerprint_digest CASCADE;
+CREATE INDEX fingerprint_digest ON public.fingerprint
+	USING btree
+	(
+	  public.echoprint_digest(hash)
+	);
+-- ddl-end --
+
+-- object: fingerprint_index_invalidate | type: TRIGGER --
+-- DROP TRIGGER IF EXISTS fingerprint_index_invalidate ON public.fingerprint CASCADE;
+CREATE TRIGGER fingerprint_index_invalidate
+	AFTER INSERT OR DELETE OR UPDATE
+	ON public.fingerprint
+	FOR EACH ROW
+	EXECUTE PROCEDURE public.echoprint_index_invalidate();
+-- ddl-end --
+
+-- object: fingerprint_index_truncate | type: TRIGGER --
+-- DROP TRIGGER IF EXISTS fingerprint_index_truncate ON public.fingerprint CASCADE;
+CREATE TRIGGER fingerprint_index_truncate
+	AFTER TRUNCATE
+	ON public.fingerprint
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE public.echoprint_index_invalidate();
+-- ddl-end --
+
 -- object: public.user_token | type: TABLE --
 -- DROP TABLE IF EXISTS public.user_token CASCADE;
 CREATE TABLE public.user_token(
@@ -0,0 +1,45 @@
+"use strict";
+
+export class FingerprintMatching {
+    // matches scoring lower are not considered to be the same track
+    public static readonly minScore = 0.05;
+    public static readonly coarseCandidateCount = 15;
+    public static readonly rerankedCandidateCount = 5;
+
+    /**
+     * @description Returns the query selecting the best matching fingerprints (id, hash, score) of a fingerprint.
+     * Candidates are looked up in two stages: a cheap set-overlap score (echoprint_compare) selects the
+     * best candidates, which are then reranked by the alignment of their codes in time (echoprint_rerank),
+     * if timed fingerprints are available for both sides. Both scores are the share of the codes two fingerprints
+     * have in common, the reranked one only counts the codes at the same relative time and is never higher. So
+     * candidates without a timed fingerprint (which keep their coarse score) are ordered and filtered by minScore
+     * along with the reranked ones. Since the reranked scores are a lot sharper, fewer candidates need to be
+     * joined with their meta-data.
+     * Shared by SongModel and the matching benchmark (bench/FingerprintBench.ts), so both measure the same thing.
+     * @param {string} fingerprint SQL expression of the queried fingerprint (int[])
+     * @param {string} timedFingerprint SQL expression of the queried timed fingerprint (bigint[], may be NULL)
+     * @returns {string} SQL query
+     */
+    public static candidatesSql(fingerprint: string, timedFingerprint: string): string {
+        return `SELECT candidates.id,
+                       candidates.hash,
+                       COALESCE(
+                           echoprint_rerank(${timedFingerprint}, candidates.timed_hash),
+                           candidates.score
+                       ) AS score
+                FROM (
+                    SELECT fingerprint.id,
+                           fingerprint.hash,
+                           fingerprint.timed_hash,
+                           echoprint_compare(${fingerprint}, fingerprint.hash::int[]) AS score
+                    FROM fingerprint
+                    ORDER BY score DESC
+                    LIMIT ${this.coarseCandidateCount}
+                ) candidates
+                ORDER BY score DESC
+                LIMIT CASE WHEN ${timedFingerprint} IS NULL
+                    THEN ${this.coarseCandidateCount}
+                    ELSE ${this.rerankedCandidateCount}
+                END`;
+    }
+}
@@ -2,8 +2,11 @@
 import {Utils} from "../utils/Utils";
 import {PGClientSingleton} from "../db/PGClientSingleton";
 import {JWTUserData} from "../auth/JWTSingleton";
+import {FingerprintMatching} from "./FingerprintMatching";
 
 export type Fingerprint = number[];
+// codes along with their time offsets, packed as (code << 32) | offset and sorted ascending
+export type TimedFingerprint = number[];
 type TrackId = number;
 type MetaDataRow = {
     track_id: TrackId;
@@ -63,6 +66,7 @@ export type UpdateTrackData = {
 };
 export type InsertTrackData = {
     fingerprint: Fingerprint;
+    timedFingerprint?: TimedFingerprint;
     tags: TrackTag; // several tag-values of a track, mapped to its tagnames (keys)
 };
 
@@ -108,12 +112,17 @@ export class SongModel {
     }
 
     /**
-     * @description Returns meta-data of specific tracks by its fingerprint
+     * @description Returns meta-data of specific tracks by its fingerprint.
+     * Candidates are looked up in two stages, see FingerprintMatching.candidatesSql.
      * @param {number[][]} fingerprints Fingerprints of tracks, whose meta-data shall be retrieved from db
+     * @param {(TimedFingerprint|null)[]} timedFingerprints Optional timed fingerprints, ordered like fingerprints
      * @returns {Promise<SearchResult[]>} Table-rows consisting of track-meta-data as returned from DBS
      */
-    private static async requestMetaData(fingerprints: number[][]): Promise<SearchResultRow[]> {
-        const sql = `SELECT DISTINCT ON (track.id, tag_type.id)
+    private static async requestMetaData(fingerprints: number[][],
+                                         timedFingerprints: (TimedFingerprint | null)[] = []
+                                        ): Promise<SearchResultRow[]> {
+        const parametersPerFingerprint = 2,
+            sql = `SELECT DISTINCT ON (track.id, tag_type.id)
                 last_value(track.id) OVER (
                     PARTITION BY
                         track.id,
@@ -124,20 +133,18 @@ export class SongModel {
                 tag.value AS tag_value,
                 fps.column1 AS query_idx, matches.hash AS fingerprint, matches.id AS fingerprint_id, matches.score
                 FROM (
-                    VALUES ${Utils.toSqlPlaceholderValuesList(fingerprints.length)}
+                    VALUES ${Utils.toSqlPlaceholderValuesList(fingerprints.length, parametersPerFingerprint)}
                 ) fps JOIN LATERAL (
-                    SELECT fingerprint.id,
-                           fingerprint.hash,
-                           echoprint_compare(fps.column2::int[], fingerprint.hash::int[]) AS score
-                    FROM fingerprint
-                    ORDER BY score DESC
-                    LIMIT 15
-                ) matches ON matches.score>0.05
+                    ${FingerprintMatching.candidatesSql("fps.column2::int[]", "fps.column3::bigint[]")}
+                ) matches ON matches.score>${FingerprintMatching.minScore}
                 INNER JOIN track ON track.id_fingerprint = matches.id
                 INNER JOIN tag ON tag.id_track = track.id
                 INNER JOIN tag_type ON tag.id_tag_type = tag_type.id
-            `;
-        let results = await this.pgClient.query(sql, fingerprints),
+            `,
+            parameters = fingerprints.reduce((parameters, fingerprint, i) => {
+                return parameters.concat([fingerprint, timedFingerprints[i] || null]);
+            }, [] as (number[] | null)[]);
+        let results = await this.pgClient.query(sql, parameters),
             rows: SearchResultRow[] = results.rows;
 
         return rows;
@@ -146,10 +153,12 @@ export class SongModel {
     /**
      * @description Requests all meta-data values of several tracks, specified by its fingerprint
      * @param {number[][]} fingerprints Fingerprints of tracks
+     * @param {(TimedFingerprint|null)[]} timedFingerprints Optional timed fingerprints used for reranking candidates
      * @returns {Promise<FingerprintResult[]>} Meta-data values of tracks, grouped by related fingerprints
      */
-    public static async queryAll(fingerprints: number[][]): Promise<QueryResponse[]> {
-        const searchResults = await this.requestMetaData(fingerprints);
+    public static async queryAll(fingerprints: number[][],
+                                 timedFingerprints: (TimedFingerprint | null)[] = []): Promise<QueryResponse[]> {
+        const searchResults = await this.requestMetaData(fingerprints, timedFingerprints);
         let results = fingerprints.map((fp: Fingerprint) => {
             return {fingerprint: fp, tracks: []} as QueryResponse;
         });
@@ -380,19 +389,23 @@ export class SongModel {
     /**
      * @description Inserts a new track into db and returns id of related record.
      * If no related fingerprint-record exists yet, one will be created.
+     * An identical fingerprint is found by probing the index on its digest, the arrays are only compared for the
+     * (usually single) row with the same digest.
      * @param {Fingerprint} fingerprint Fingerprint related to the new track
      * @param {number} userId ID of the user, who triggers insertion of new track
+     * @param {TimedFingerprint} timedFingerprint Optional timed fingerprint, stored alongside a new fingerprint-record
      * @returns {number} Id of track-record
      */
-    private static async insertTrack(fingerprint: Fingerprint, userId: number): Promise<number> {
+    private static async insertTrack(fingerprint: Fingerprint, userId: number,
+                                     timedFingerprint?: TimedFingerprint): Promise<number> {
         const sql = `
                 WITH fp_select AS (
                     SELECT id
                     FROM fingerprint
-                    WHERE hash = $1
+                    WHERE echoprint_digest(hash) = echoprint_digest($1) AND hash = $1
                 ), fp_insert AS (
-                    INSERT INTO fingerprint(hash)
-                    SELECT $1
+                    INSERT INTO fingerprint(hash, timed_hash)
+                    SELECT $1, $3::bigint[]
                     WHERE NOT EXISTS(
                         SELECT id
                         FROM fp_select
@@ -409,7 +422,7 @@ export class SongModel {
                     FROM fp_id
                     RETURNING track.id AS track_id
             `,
-            [firstResultRow] = (await this.pgClient.query(sql, [fingerprint, userId])).rows,
+            [firstResultRow] = (await this.pgClient.query(sql, [fingerprint, userId, timedFingerprint || null])).rows,
             {track_id: trackId}: {track_id: number} = firstResultRow;
 
         return trackId;
@@ -425,7 +438,8 @@ export class SongModel {
         await this.executeInTransaction(async () => {
             const updateDataList: UpdateTrackData[] = await Promise.all(insertDataList.map(
                 async (trackData: InsertTrackData) => {
-                    const trackId = await this.insertTrack(trackData.fingerprint, jwtUserData.id),
+                    const trackId = await this.insertTrack(trackData.fingerprint, jwtUserData.id,
+                            trackData.timedFingerprint),
                         updateTrackData: UpdateTrackData = {
                             trackId: trackId,
                             tags: trackData.tags
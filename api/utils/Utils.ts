@@ -31,12 +31,15 @@ export class Utils {
 
     /**
      * @description Creates a parameterized values list consisting of a specific number of placeholders
-     * @param {number} placeholderCount Number of placeholders
+     * @param {number} placeholderCount Number of rows with placeholders
+     * @param {number} columnCount Number of placeholders per row
      * @returns {string} Parameterized values list consisting of placeholders as expected from pg-module in query-method
      */
-    public static toSqlPlaceholderValuesList(placeholderCount: number): string {
+    public static toSqlPlaceholderValuesList(placeholderCount: number, columnCount: number = 1): string {
         const sql = Array(placeholderCount).fill(0)
-            .map((_: number, i: number) => "(" + i + ", $" + (i + 1) + ")")
+            .map((_: number, i: number) => "(" + i + Array(columnCount).fill(0)
+                .map((__: number, j: number) => ", $" + (i * columnCount + j + 1))
+                .join("") + ")")
             .join(",");
 
         return sql;
@@ -4,10 +4,14 @@
 //
 
 
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#endif
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -24,6 +28,7 @@
 #include "AudioStreamInput.h"
 #include "Common.h"
 #include "Params.h"
+#include "Trace.h"
 
 using std::string;
 
@@ -38,17 +43,28 @@ namespace FFMPEG {
         }
         return false;
     }
+
+    bool IsStreamable(const char* pFileName) {
+        static const char* streamableExtensions[] = {".mp3", ".aif", ".aiff", ".flac", ".au", ".wav", ".aac"};
+        for (uint i = 0; i < NELEM(streamableExtensions); i++) {
+            if (File::ends_with(pFileName, streamableExtensions[i]))
+                return true;
+        }
+        return false;
+    }
 }
 
 bool AudioStreamInput::IsSupported(const char *path) {
     return true; // Take a crack at anything, by default. The worst thing that will happen is that we fail.
 }
 
-AudioStreamInput::AudioStreamInput() : _pSamples(NULL), _NumberSamples(0), _Offset_s(0), _Seconds(0) {}
+AudioStreamInput::AudioStreamInput() : _pSamples(NULL), _pShortSamples(NULL), _FixedPoint(false), _NumberSamples(0), _Offset_s(0), _Seconds(0), _Piped(false) {}
 
 AudioStreamInput::~AudioStreamInput() {
     if (_pSamples != NULL)
         delete [] _pSamples, _pSamples = NULL;
+    if (_pShortSamples != NULL)
+        delete [] _pShortSamples, _pShortSamples = NULL;
 }
 
 
@@ -58,9 +74,67 @@ bool AudioStreamInput::ProcessFile(const char* filename, int offset_s/*=0*/, int
 
     _Offset_s = offset_s;
     _Seconds = seconds;
+    // If the host already has the contents of the file (Module.input_buffer() returns them), they are fed to
+    // ffmpeg through stdin, so the file isn't read a second time.
+#ifdef __EMSCRIPTEN__
+    _Piped = FFMPEG::IsStreamable(filename) && EM_ASM_INT(return !!Module["input_buffer"]);
+    // ffmpeg runs on the host, so the excerpt goes to its temporary directory (stdout has the samples, stderr the errors)
+    char qualityOutput[1024] = {0};
+    EM_ASM_({
+        Module["quality_files"] = (Module["quality_files"] || 0) + 1;
+        var path = require("path").join(require("os").tmpdir(),
+            "echoprint-quality-" + process.pid + "-" + Module["quality_files"] + ".wav");
+        stringToUTF8(path, $0, $1);
+    }, qualityOutput, sizeof(qualityOutput));
+    _QualityOutput = qualityOutput;
+#elif !defined(_WIN32)
+    char qualityOutput[] = "/tmp/echoprint-quality-XXXXXX";
+    int fd = mkstemp(qualityOutput);
+    if (fd >= 0) {
+        close(fd);
+        _QualityOutput = qualityOutput;
+    }
+#endif
     std::string message = GetCommandLine(filename);
 
-    return DoProcess(message.c_str());
+    bool ok = DoProcess(message.c_str());
+    if (!_QualityOutput.empty())
+        ReadQuality();
+    return ok;
+}
+
+// analyzes the excerpt the decoder wrote (if any), see FfmpegStreamInput::GetCommandLine
+void AudioStreamInput::ReadQuality() {
+    std::vector<unsigned char> wave;
+#ifdef __EMSCRIPTEN__
+    uint length = EM_ASM_INT({
+        var fs = require("fs");
+        var path = Pointer_stringify($0);
+        try {
+            Module["quality_excerpt"] = fs.readFileSync(path);
+            fs.unlinkSync(path);
+        } catch (e) {
+            Module["quality_excerpt"] = null;
+        }
+        return Module["quality_excerpt"] ? Module["quality_excerpt"].length : 0;
+    }, _QualityOutput.c_str());
+    wave.resize(length);
+    EM_ASM_({
+        if ($1) HEAPU8.set(Module["quality_excerpt"], $0);
+        Module["quality_excerpt"] = null;
+    }, wave.data(), length);
+#else
+    FILE* fp = fopen(_QualityOutput.c_str(), "rb");
+    if (fp != NULL) {
+        unsigned char buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            wave.insert(wave.end(), buf, buf + n);
+        fclose(fp);
+    }
+    unlink(_QualityOutput.c_str());
+#endif
+    QualityAnalysis::AnalyzeWave(wave.data(), wave.size(), _Quality);
 }
 
 // reads raw signed 16-bit shorts from a file
@@ -76,38 +150,72 @@ bool AudioStreamInput::ProcessStandardInput(void) {
 }
 
 bool AudioStreamInput::DoProcess(const char *arg) {
+    TraceSpan span("AudioStreamInput::DoProcess");
+#ifdef __EMSCRIPTEN__
     EM_ASM_({
-        Module["stdout_child"] = new Uint8Array(require('child_process').execSync(Pointer_stringify($0)));
-    }, arg);
+        var command = Pointer_stringify($0);
+        // the samples of a long file easily exceed the default limit of newer node versions
+        var options = {shell: true, maxBuffer: 1 << 30};
+        if ($1) options.input = Module["input_buffer"]();
+        var result = require('child_process').spawnSync(command, options);
+        if (result.error || result.status !== 0) {
+            // this doesn't return into ProcessFile, so the excerpt ffmpeg might have started is removed here
+            var qualityOutput = Pointer_stringify($2);
+            try { if (qualityOutput) require('fs').unlinkSync(qualityOutput); } catch (e) { }
+        }
+        if (result.error) throw result.error;
+        if (result.status !== 0) throw new Error("Command failed: " + command + "\n" + result.stderr);
+        Module["stdout_child"] = new Uint8Array(result.stdout);
+    }, arg, _Piped, _QualityOutput.c_str());
+#else
+    // native builds (e.g. the benchmark) read the decoder's output through a pipe
+    FILE* fp = popen(arg, POPEN_MODE);
+    if (fp == NULL)
+        return 0;
+#endif
 
     std::vector<short*> vChunks;
     uint nSamplesPerChunk = (uint) Params::AudioStreamInput::SamplingRate * Params::AudioStreamInput::SecondsPerChunk;
     uint samplesRead = 0;
     do {
         short* pChunk = new short[nSamplesPerChunk];
+#ifdef __EMSCRIPTEN__
         samplesRead = EM_ASM_INT({
             var stdout_chunk_view = Module["stdout_child"].subarray(0, 2 * $0);
             HEAPU8.set(stdout_chunk_view, $1);
             Module["stdout_child"] = Module["stdout_child"].subarray(2 * $0);
             return stdout_chunk_view.length / 2;
         }, nSamplesPerChunk, pChunk);
-        // samplesRead = fread(pChunk, sizeof (short), nSamplesPerChunk, pFile);
+#else
+        samplesRead = fread(pChunk, sizeof (short), nSamplesPerChunk, fp);
+#endif
 
         _NumberSamples += samplesRead;
         vChunks.push_back(pChunk);
     } while (samplesRead > 0);
+#ifndef __EMSCRIPTEN__
+    pclose(fp);
+#endif
 
-    // Convert from shorts to 16-bit floats and copy into sample buffer.
+    // Convert from shorts to 16-bit floats (or keep them as they are) and copy into sample buffer.
     uint sampleCounter = 0;
-    _pSamples = new float[_NumberSamples];
+    if (_FixedPoint)
+        _pShortSamples = new short[_NumberSamples];
+    else
+        _pSamples = new float[_NumberSamples];
     uint samplesLeft = _NumberSamples;
     for (uint i = 0; i < vChunks.size(); i++)
     {
         short* pChunk = vChunks[i];
         uint numSamples = samplesLeft < nSamplesPerChunk ? samplesLeft : nSamplesPerChunk;
 
-        for (uint j = 0; j < numSamples; j++)
-            _pSamples[sampleCounter++] = (float) pChunk[j] / 32768.0f;
+        if (_FixedPoint) {
+            memcpy(_pShortSamples + sampleCounter, pChunk, numSamples * sizeof(short));
+            sampleCounter += numSamples;
+        } else {
+            for (uint j = 0; j < numSamples; j++)
+                _pSamples[sampleCounter++] = (float) pChunk[j] / 32768.0f;
+        }
 
         samplesLeft -= numSamples;
         delete [] pChunk, vChunks[i] = NULL;
@@ -12,6 +12,7 @@
 #include <string>
 #include <math.h>
 #include "File.h"
+#include "QualityAnalysis.h"
 #if defined(_WIN32) && !defined(__MINGW32__)
 #define snprintf _snprintf
 #define DEVNULL "nul"
@@ -30,18 +31,31 @@ public:
     bool DoProcess(const char* arg);
     int getNumSamples() const {return _NumberSamples;}
     const float* getSamples() {return _pSamples;}
+    // keeps the decoded samples as they are, for the fixed point pipeline, instead of converting them to floats
+    void SetFixedPoint(bool fixedPoint) { _FixedPoint = fixedPoint; }
+    const short* getShortSamples() {return _pShortSamples;}
     double getDuration() { return (double)getNumSamples() / Params::AudioStreamInput::SamplingRate; }
     virtual bool IsSupported(const char* pFileName); //Everything ffmpeg can do, by default
     int GetOffset() const { return _Offset_s;}
     int GetSeconds() const { return _Seconds;}
+    // sample rate, bandwidth and clipping, if the decoder wrote an excerpt (the bitrate is up to the caller)
+    const AudioQuality& getQuality() const { return _Quality; }
 protected:
 
     virtual std::string GetCommandLine(const char* filename) = 0;
+    void ReadQuality();
     static bool ends_with(const char *s, const char *ends_with);
     float* _pSamples;
+    short* _pShortSamples;
+    bool _FixedPoint;
     uint _NumberSamples;
     int _Offset_s;
     int _Seconds;
+    // the file is fed to the decoder from Module.input_buffer instead of being read by it
+    bool _Piped;
+    // where the decoder writes an excerpt at the original sample rate for the QualityAnalysis, empty for none
+    std::string _QualityOutput;
+    AudioQuality _Quality;
 
 };
 
@@ -54,6 +68,9 @@ protected:
     virtual std::string GetCommandLine(const char* filename){return "";} // hack
 };
 
+// seconds of audio the QualityAnalysis looks at, enough for an averaged spectrum (~1MB of wav at 44.1kHz stereo)
+#define QUALITY_EXCERPT_SECONDS 5
+
 class FfmpegStreamInput : public AudioStreamInput {
 public:
     std::string GetName(){return "ffmpeg";};
@@ -61,12 +78,21 @@ protected:
     std::string GetCommandLine(const char* filename) {
         // TODO: Windows
         char message[4096] = {0};
+        std::string input = _Piped ? std::string("pipe:0") : "\"" + std::string(filename) + "\"";
+        // A second output gets the first seconds of the decoded audio as is, for the QualityAnalysis. ffmpeg decodes
+        // the input once for all of its outputs, so this only costs writing the excerpt (to an existing temporary
+        // file, hence -y). ffmpeg must not read its stdin, which is the file list with -s.
         if (_Offset_s == 0 && _Seconds == 0)
-            snprintf(message, NELEM(message), "ffmpeg -i \"%s\"  -ac %d -ar %d -f s16le -",
-                    filename, Params::AudioStreamInput::Channels, (uint) Params::AudioStreamInput::SamplingRate);
+            snprintf(message, NELEM(message), "ffmpeg -nostdin -y -v error -i %s  -ac %d -ar %d -f s16le -",
+                    input.c_str(), Params::AudioStreamInput::Channels, (uint) Params::AudioStreamInput::SamplingRate);
         else
-            snprintf(message, NELEM(message), "ffmpeg -i \"%s\"  -ac %d -ar %d -f s16le -t %d -ss %d -",
-                    filename, Params::AudioStreamInput::Channels, (uint) Params::AudioStreamInput::SamplingRate, _Seconds, _Offset_s);
+            snprintf(message, NELEM(message), "ffmpeg -nostdin -y -v error -i %s  -ac %d -ar %d -f s16le -t %d -ss %d -",
+                    input.c_str(), Params::AudioStreamInput::Channels, (uint) Params::AudioStreamInput::SamplingRate, _Seconds, _Offset_s);
+        if (!_QualityOutput.empty()) {
+            size_t used = strlen(message);
+            snprintf(message + used, NELEM(message) - used, " -t %d -c:a pcm_s16le -f wav \"%s\"",
+                    QUALITY_EXCERPT_SECONDS, _QualityOutput.c_str());
+        }
 
         return std::string(message);
     }
@@ -74,6 +100,8 @@ protected:
 
 namespace FFMPEG {
     bool IsAudioFile(const char* pFileName);
+    // Can FFmpeg decode this front to back, i.e. from a pipe? (mp4 & co. may need to seek to their index)
+    bool IsStreamable(const char* pFileName);
 };
 
 class Mpg123StreamInput : public AudioStreamInput {
@@ -23,119 +23,105 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   Modified for echoprint-codegen: encodes and decodes 3 bytes at a time
+   through lookup tables into a buffer of the final size.
+
 */
 
 #include "Base64.h"
-#include <iostream>
 
-static const std::string base64_chars =
+static const char base64_chars[] =
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
 
-static const std::string base64_chars_url =
+static const char base64_chars_url[] =
               "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
               "abcdefghijklmnopqrstuvwxyz"
               "0123456789-_";
 
-
-
-static inline bool is_base64(unsigned char c) {
-  return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
-static inline bool is_base64_url(unsigned char c) {
-  return (isalnum(c) || (c == '-') || (c == '_'));
-}
+// value of a character of base64_chars, -1 for any other
+static const signed char base64_values[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+  -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+  -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
 
 std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len, bool url) {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++) {
-        if (url)
-            ret += base64_chars_url[char_array_4[i]];
-        else
-            ret += base64_chars[char_array_4[i]];
-      }
-      i = 0;
-    }
+  const char* chars = url ? base64_chars_url : base64_chars;
+  std::string ret((in_len + 2) / 3 * 4, '=');
+  if (in_len == 0)
+    return ret;
+  char* out = &ret[0];
+  unsigned int i = 0;
+
+  for (; i + 3 <= in_len; i += 3) {
+    unsigned int v = (bytes_to_encode[i] << 16) | (bytes_to_encode[i + 1] << 8) | bytes_to_encode[i + 2];
+    out[0] = chars[v >> 18];
+    out[1] = chars[(v >> 12) & 0x3f];
+    out[2] = chars[(v >> 6) & 0x3f];
+    out[3] = chars[v & 0x3f];
+    out += 4;
   }
 
-  if (i)
-  {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
-
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
-
-    for (j = 0; (j < i + 1); j++){
-      if (url)
-          ret += base64_chars_url[char_array_4[j]];
-      else
-          ret += base64_chars[char_array_4[j]];
-    }
-    while((i++ < 3))
-        ret += '=';
-
+  // the last 1 or 2 bytes, padded with '='
+  if (i < in_len) {
+    unsigned int v = bytes_to_encode[i] << 16;
+    if (i + 1 < in_len)
+      v |= bytes_to_encode[i + 1] << 8;
+    out[0] = chars[v >> 18];
+    out[1] = chars[(v >> 12) & 0x3f];
+    if (i + 1 < in_len)
+      out[2] = chars[(v >> 6) & 0x3f];
   }
 
   return ret;
-
 }
 
+// stops at the first '=' or character which isn't base64
 std::string base64_decode(std::string const& encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  std::string ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
-    }
+  const unsigned char* in = (const unsigned char*)encoded_string.data();
+  size_t in_len = 0;
+  while (in_len < encoded_string.size() && base64_values[in[in_len]] >= 0)
+    in_len++;
+
+  std::string ret(in_len / 4 * 3 + (in_len % 4 ? in_len % 4 - 1 : 0), '\0');
+  if (ret.empty())
+    return ret;
+  char* out = &ret[0];
+  size_t i = 0;
+
+  for (; i + 4 <= in_len; i += 4) {
+    unsigned int v = (base64_values[in[i]] << 18) | (base64_values[in[i + 1]] << 12)
+                   | (base64_values[in[i + 2]] << 6) | base64_values[in[i + 3]];
+    out[0] = (char)(v >> 16);
+    out[1] = (char)(v >> 8);
+    out[2] = (char)v;
+    out += 3;
   }
 
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
-
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
-
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-    for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
+  // 2 or 3 characters left make 1 or 2 bytes (a single one doesn't make any)
+  if (in_len - i >= 2) {
+    unsigned int v = (base64_values[in[i]] << 18) | (base64_values[in[i + 1]] << 12);
+    if (in_len - i == 3)
+      v |= base64_values[in[i + 2]] << 6;
+    out[0] = (char)(v >> 16);
+    if (in_len - i == 3)
+      out[1] = (char)(v >> 8);
   }
 
   return ret;
 }
-
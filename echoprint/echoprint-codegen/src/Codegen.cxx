@@ -4,9 +4,8 @@
 //
 
 
-#include <sstream>
-#include <iostream>
-#include <iomanip>
+#include <string.h>
+#include <stdexcept>
 #include <memory>
 #include "Codegen.h"
 #include "AudioBufferInput.h"
@@ -17,11 +16,18 @@
 #include "Common.h"
 
 #include "Base64.h"
+#include "Trace.h"
 #include <zlib.h>
 
 using std::string;
 using std::vector;
 
+static int compression_level = Z_DEFAULT_COMPRESSION;
+
+void Codegen::setCompressionLevel(int level) {
+    compression_level = level;
+}
+
 Codegen::Codegen(const float* pcm, unsigned int numSamples, int start_offset) {
     if (Params::AudioStreamInput::MaxSamples < (uint)numSamples)
         throw std::runtime_error("File was too big\n");
@@ -36,10 +42,7 @@ Codegen::Codegen(const float* pcm, unsigned int numSamples, int start_offset) {
     pSubbandAnalysis->Compute();
 
     Fingerprint *pFingerprint = new Fingerprint(pSubbandAnalysis, start_offset);
-    pFingerprint->Compute();
-
-    _CodeString = createCodeString(pFingerprint->getCodes());
-    _NumCodes = pFingerprint->getCodes().size();
+    computeCodes(pFingerprint);
 
     delete pFingerprint;
     delete pSubbandAnalysis;
@@ -47,45 +50,77 @@ Codegen::Codegen(const float* pcm, unsigned int numSamples, int start_offset) {
     delete pAudio;
 }
 
-string Codegen::createCodeString(vector<FPCode> vCodes) {
+Codegen::Codegen(const short* pcm, unsigned int numSamples, int start_offset) {
+    if (Params::AudioStreamInput::MaxSamples < (uint)numSamples)
+        throw std::runtime_error("File was too big\n");
+
+    FixedWhitening *pWhitening = new FixedWhitening(pcm, numSamples);
+    pWhitening->Compute();
+
+    FixedSubbandAnalysis *pSubbandAnalysis = new FixedSubbandAnalysis(pWhitening->getWhitenedSamples(),
+        pWhitening->getNumSamples());
+    pSubbandAnalysis->Compute();
+
+    FixedFingerprint *pFingerprint = new FixedFingerprint(pSubbandAnalysis, start_offset);
+    computeCodes(pFingerprint);
+
+    delete pFingerprint;
+    delete pSubbandAnalysis;
+    delete pWhitening;
+}
+
+void Codegen::computeCodes(Fingerprint *pFingerprint) {
+    pFingerprint->Compute();
+
+    _CodeString = createCodeString(pFingerprint->getCodes());
+    _NumCodes = pFingerprint->getCodes().size();
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// at least 5 hex digits of value (the codes and most times have 20 bits), more only if it needs them
+static char* write_hex(char* out, uint value) {
+    int digits = 5;
+    while (digits < 8 && (value >> (4 * digits)) != 0) digits++;
+    for (int d = digits - 1; d >= 0; d--)
+        *out++ = hex_digits[(value >> (4 * d)) & 0xf];
+    return out;
+}
+
+string Codegen::createCodeString(const vector<FPCode>& vCodes) {
     if (vCodes.size() < 3) {
         return "";
     }
-    std::ostringstream codestream;
-    codestream << std::setfill('0') << std::hex;
+    vector<char> codestream(vCodes.size() * 2 * 8);
+    char* out = &codestream[0];
     for (uint i = 0; i < vCodes.size(); i++)
-        codestream << std::setw(5) << vCodes[i].frame;
+        out = write_hex(out, vCodes[i].frame);
 
-    for (uint i = 0; i < vCodes.size(); i++) {
-        int hash = vCodes[i].code;
-        codestream << std::setw(5) << hash;
-    }
-    return compress(codestream.str());
+    for (uint i = 0; i < vCodes.size(); i++)
+        out = write_hex(out, vCodes[i].code);
+    return compress(&codestream[0], out - &codestream[0]);
 }
 
 
-string Codegen::compress(const string& s) {
-    long max_compressed_length = s.size()*2;
-    unsigned char *compressed = new unsigned char[max_compressed_length];
+string Codegen::compress(const char* data, size_t length) {
+    TraceSpan span("Codegen::compress");
 
-    // zlib the code string
+    // zlib the code string, in a single call into a buffer which deflateBound says is big enough
     z_stream stream;
-    stream.next_in = (Bytef*)(unsigned char*)s.c_str();
-    stream.avail_in = (uInt)s.size();
-    stream.zalloc = (alloc_func)0;
-    stream.zfree = (free_func)0;
-    stream.opaque = (voidpf)0;
-    deflateInit(&stream, Z_DEFAULT_COMPRESSION);
-    do {
-        stream.next_out = compressed;
-        stream.avail_out = max_compressed_length;
-        if(deflate(&stream, Z_FINISH) == Z_STREAM_END) break;
-    } while (stream.avail_out == 0);
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, compression_level) != Z_OK)
+        throw std::runtime_error("Could not compress the codes\n");
+    vector<unsigned char> compressed(deflateBound(&stream, length));
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = &compressed[0];
+    stream.avail_out = (uInt)compressed.size();
+    int result = deflate(&stream, Z_FINISH);
     uint compressed_length = stream.total_out;
     deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+        throw std::runtime_error("Could not compress the codes\n");
 
     // base64 the zlib'd code string
-    string encoded = base64_encode(compressed, compressed_length, false);
-    delete [] compressed;
-    return encoded;
+    return base64_encode(&compressed[0], compressed_length, false);
 }
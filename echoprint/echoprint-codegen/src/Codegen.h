@@ -26,21 +26,27 @@
 #endif
 
 class Fingerprint;
-class SubbandAnalysis;
 struct FPCode;
 
 class CODEGEN_API Codegen {
 public:
     Codegen(const float* pcm, unsigned int numSamples, int start_offset);
+    // the fixed point pipeline, on 16-bit samples (codes differ slightly from those of the floats)
+    Codegen(const short* pcm, unsigned int numSamples, int start_offset);
+    // restores a previously generated (e.g. cached) result
+    Codegen(const std::string& codeString, int numCodes) : _CodeString(codeString), _NumCodes(numCodes) {}
 
-    std::string getCodeString(){return _CodeString;}
+    const std::string& getCodeString(){return _CodeString;}
     int getNumCodes(){return _NumCodes;}
     static double getVersion() { return ECHOPRINT_VERSION; }
+    // zlib level (0-9) of the code strings of all Codegens created afterwards, Z_DEFAULT_COMPRESSION (-1) by
+    // default. Any level can be decoded the same way, lower ones are faster but a little bigger.
+    static void setCompressionLevel(int level);
 private:
-    Fingerprint* computeFingerprint(SubbandAnalysis *pSubbandAnalysis, int start_offset);
-    std::string createCodeString(std::vector<FPCode> vCodes);
+    void computeCodes(Fingerprint *pFingerprint);
+    std::string createCodeString(const std::vector<FPCode>& vCodes);
 
-    std::string compress(const std::string& s);
+    std::string compress(const char* data, size_t length);
     std::string _CodeString;
     int _NumCodes;
 };
@@ -0,0 +1,185 @@
+//
+//  echoprint-codegen
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include "DirectoryScanner.h"
+#include "AudioStreamInput.h"
+
+using std::string;
+using std::vector;
+
+static bool bigger(const ScannedFile& a, const ScannedFile& b) {
+    return a.size != b.size ? a.size > b.size : a.path < b.path;
+}
+
+static bool path_less(const ScannedFile& a, const ScannedFile& b) {
+    return a.path < b.path;
+}
+
+static int64_t modification_time(const struct stat& st) {
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+DirectoryScanner::DirectoryScanner(uint numThreads) :
+    _NumThreads(numThreads > 0 ? numThreads : 1), _Busy(0), _NumDirectories(0) {
+    pthread_mutex_init(&_Lock, NULL);
+    pthread_cond_init(&_Changed, NULL);
+}
+
+DirectoryScanner::~DirectoryScanner() {
+    pthread_cond_destroy(&_Changed);
+    pthread_mutex_destroy(&_Lock);
+}
+
+void DirectoryScanner::Scan(const char* root) {
+    string path(root);
+    while (path.size() > 1 && path[path.size() - 1] == '/')
+        path.erase(path.size() - 1);
+    _Files.clear();
+    _Pending.assign(1, path);
+    _NumDirectories = 0;
+
+    vector<pthread_t> threads(_NumThreads);
+    for (uint t = 0; t < _NumThreads; t++)
+        pthread_create(&threads[t], NULL, threaded_scan, this);
+    for (uint t = 0; t < _NumThreads; t++)
+        pthread_join(threads[t], NULL);
+
+    std::sort(_Files.begin(), _Files.end(), bigger);
+}
+
+void* DirectoryScanner::threaded_scan(void* parm) {
+    DirectoryScanner* scanner = (DirectoryScanner*)parm;
+    vector<ScannedFile> files;
+    vector<string> subdirectories;
+
+    pthread_mutex_lock(&scanner->_Lock);
+    for (;;) {
+        while (scanner->_Pending.empty() && scanner->_Busy > 0)
+            pthread_cond_wait(&scanner->_Changed, &scanner->_Lock);
+        // nothing left, and nobody reading a directory who could find more
+        if (scanner->_Pending.empty())
+            break;
+        // depth first, which keeps the pending list short
+        string path = scanner->_Pending.back();
+        scanner->_Pending.pop_back();
+        scanner->_Busy++;
+        pthread_mutex_unlock(&scanner->_Lock);
+
+        subdirectories.clear();
+        scanner->ScanDirectory(path, files, subdirectories);
+
+        pthread_mutex_lock(&scanner->_Lock);
+        scanner->_Pending.insert(scanner->_Pending.end(), subdirectories.begin(), subdirectories.end());
+        scanner->_NumDirectories++;
+        scanner->_Busy--;
+        pthread_cond_broadcast(&scanner->_Changed);
+    }
+    scanner->_Files.insert(scanner->_Files.end(), files.begin(), files.end());
+    pthread_mutex_unlock(&scanner->_Lock);
+    return NULL;
+}
+
+void DirectoryScanner::ScanDirectory(const string& path, vector<ScannedFile>& files, vector<string>& subdirectories) {
+    // unreadable directories are left out, like the files ffmpeg can't decode
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) return;
+    int fd = dirfd(dir);
+
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        // most file systems tell the type of an entry along with its name, so only audio files need a stat
+        bool directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            directory = S_ISDIR(st.st_mode);
+        }
+        string child = (path == "/" ? path : path + '/') + name;
+        if (directory) {
+            subdirectories.push_back(child);
+            continue;
+        }
+        // links to files are followed, they are fingerprinted under their own path
+        if (!FFMPEG::IsAudioFile(name) || fstatat(fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        ScannedFile file;
+        file.path = child;
+        file.size = st.st_size;
+        file.mtime = modification_time(st);
+        file.inode = st.st_ino;
+        files.push_back(file);
+    }
+    closedir(dir);
+}
+
+ScanManifest::ScanManifest(const char* filename) : _Filename(filename) { }
+
+bool ScanManifest::Load() {
+    _Files.clear();
+    std::ifstream in(_Filename.c_str());
+    if (!in) return false;
+
+    string line;
+    while (getline(in, line)) {
+        unsigned long long size, inode;
+        long long mtime;
+        int pathStart;
+        // %n isn't counted, the path follows a single space (it may start with spaces itself)
+        if (sscanf(line.c_str(), "%llu %lld %llu%n", &size, &mtime, &inode, &pathStart) < 3
+                || pathStart + 1 >= (int)line.size())
+            continue;
+        ScannedFile file;
+        file.path = line.substr(pathStart + 1);
+        file.size = size;
+        file.mtime = mtime;
+        file.inode = inode;
+        _Files.push_back(file);
+    }
+    std::sort(_Files.begin(), _Files.end(), path_less);
+    return true;
+}
+
+bool ScanManifest::Unchanged(const ScannedFile& file) const {
+    vector<ScannedFile>::const_iterator it = std::lower_bound(_Files.begin(), _Files.end(), file, path_less);
+    return it != _Files.end() && it->path == file.path && it->size == file.size && it->mtime == file.mtime
+        && it->inode == file.inode;
+}
+
+bool ScanManifest::Save(const vector<ScannedFile>& files) const {
+    vector<ScannedFile> sorted(files);
+    std::sort(sorted.begin(), sorted.end(), path_less);
+
+    // written next to it and renamed over it, so an interrupted run leaves the last manifest as it was
+    string tmpFilename = _Filename + ".tmp";
+    FILE* out = fopen(tmpFilename.c_str(), "w");
+    if (out == NULL) return false;
+    for (size_t i = 0; i < sorted.size(); i++) {
+        // such a name wouldn't survive a line based file, the file is just seen as new every time
+        if (sorted[i].path.find('\n') != string::npos) continue;
+        fprintf(out, "%llu %lld %llu %s\n", (unsigned long long)sorted[i].size, (long long)sorted[i].mtime,
+            (unsigned long long)sorted[i].inode, sorted[i].path.c_str());
+    }
+    bool ok = fclose(out) == 0;
+    if (ok) ok = rename(tmpFilename.c_str(), _Filename.c_str()) == 0;
+    if (!ok) remove(tmpFilename.c_str());
+    return ok;
+}
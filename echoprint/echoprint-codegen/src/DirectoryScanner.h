@@ -0,0 +1,67 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef DIRECTORYSCANNER_H
+#define DIRECTORYSCANNER_H
+
+#include "Common.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// A file found by a scan, with what tells whether it changed since: size, modification time (ns) and inode.
+// A file copied or written over by rename gets a new inode, even if it kept its size and time.
+struct ScannedFile {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t inode;
+};
+
+// Walks a directory tree with several threads and collects the audio files (FFMPEG::IsAudioFile).
+// Directories are read and the audio files among their entries stat'ed, no file is ever opened. On a network
+// share most of the time goes to waiting for the server, so a thread waiting for one directory doesn't hold
+// up the others. Symbolic links to directories aren't followed, so there are no cycles.
+class DirectoryScanner {
+public:
+    DirectoryScanner(uint numThreads);
+    ~DirectoryScanner();
+    void Scan(const char* root);
+    // biggest first, so when they're handed out in this order the long ones don't end up last
+    const std::vector<ScannedFile>& getFiles() const { return _Files; }
+    uint getNumDirectories() const { return _NumDirectories; }
+
+protected:
+    static void* threaded_scan(void* parm);
+    void ScanDirectory(const std::string& path, std::vector<ScannedFile>& files,
+                       std::vector<std::string>& subdirectories);
+
+    uint _NumThreads;
+    // directories still to be read, and how many threads are reading one (and may find more)
+    std::vector<std::string> _Pending;
+    uint _Busy;
+    uint _NumDirectories;
+    pthread_mutex_t _Lock;
+    pthread_cond_t _Changed;
+    std::vector<ScannedFile> _Files;
+};
+
+// What the last scan of a tree found, so the next one only hands on the new and changed files. Kept as a text
+// file with one "size mtime inode path" line per file, sorted by path, replaced as a whole by Save.
+class ScanManifest {
+public:
+    ScanManifest(const char* filename);
+    // false if there is no manifest (yet), everything is new then
+    bool Load();
+    bool Unchanged(const ScannedFile& file) const;
+    bool Save(const std::vector<ScannedFile>& files) const;
+
+protected:
+    std::string _Filename;
+    std::vector<ScannedFile> _Files;
+};
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "Fingerprint.h"
 #include "Params.h"
+#include "Trace.h"
 #include <string.h>
 
 #ifdef _WIN32
@@ -52,17 +53,10 @@ Fingerprint::Fingerprint(SubbandAnalysis* pSubbandAnalysis, int offset)
     : _pSubbandAnalysis(pSubbandAnalysis), _Offset(offset) { }
 
 
-uint Fingerprint::adaptiveOnsets(int ttarg, matrix_u&out, uint*&onset_counter_for_band) {
+int Fingerprint::computeLevels() {
     //  E is a sgram-like matrix of energies.
-    const float *pE;
-    int bands, frames, i, j, k;
-    int deadtime = 128;
-    double H[SUBBANDS],taus[SUBBANDS], N[SUBBANDS];
-    int contact[SUBBANDS], lcontact[SUBBANDS], tsince[SUBBANDS];
-    double overfact = 1.1;  /* threshold rel. to actual peak */
-    uint onset_counter = 0;
-
-    matrix_f E = _pSubbandAnalysis->getMatrix();
+    int i, j, k;
+    const matrix_f& E = _pSubbandAnalysis->getMatrix();
 
     // Take successive stretches of 8 subband samples and sum their energy under a hann window, then hop by 4 samples (50% window overlap).
     int hop = 4;
@@ -72,69 +66,77 @@ uint Fingerprint::adaptiveOnsets(int ttarg, matrix_u&out, uint*&onset_counter_fo
         ham[i] = .5 - .5*cos( (2.*M_PI/(nsm-1))*i);
 
     int nc =  floor((float)E.size2()/(float)hop)-(floor((float)nsm/(float)hop)-1);
-    matrix_f Eb = matrix_f(nc, 8);
-    for(uint r=0;r<Eb.size1();r++) for(uint c=0;c<Eb.size2();c++) Eb(r,c) = 0.0;
+    _Eb = matrix_f(nc, 8);
+    for(uint r=0;r<_Eb.size1();r++) for(uint c=0;c<_Eb.size2();c++) _Eb(r,c) = 0.0;
 
     for(i=0;i<nc;i++) {
         for(j=0;j<SUBBANDS;j++) {
-            for(k=0;k<nsm;k++)  Eb(i,j) = Eb(i,j) + ( E(j,(i*hop)+k) * ham[k]);
-            Eb(i,j) = sqrtf(Eb(i,j));
+            for(k=0;k<nsm;k++)  _Eb(i,j) = _Eb(i,j) + ( E(j,(i*hop)+k) * ham[k]);
+            _Eb(i,j) = sqrtf(_Eb(i,j));
         }
     }
 
-    frames = Eb.size1();
-    bands = Eb.size2();
-    pE = &Eb.data()[0];
-
-    out = matrix_u(SUBBANDS, frames);
-    onset_counter_for_band = new uint[SUBBANDS];
+    const float *pE = &_Eb.data()[0];
+    for (j = 0; j < SUBBANDS; ++j) {
+        _H[j] = pE[j];
+        _Y0[j] = 0;
+    }
+    return _Eb.size1();
+}
 
+bool Fingerprint::exceedsThreshold(int frame, int band, int tau) {
+    const float *pE = &_Eb.data()[0] + frame*SUBBANDS;
+    double overfact = 1.1;  /* threshold rel. to actual peak */
     double bn[] = {0.1883, 0.4230, 0.3392}; /* preemph filter */   // new
     int nbn = 3;
     double a1 = 0.98;
-    double Y0[SUBBANDS];
 
-    for (j = 0; j < bands; ++j) {
+    double xn = 0;
+    /* calculate the filter -  FIR part */
+    if (frame >= 2*nbn) {
+        for (int k = 0; k < nbn; ++k) {
+            xn += bn[k]*(pE[band-SUBBANDS*k] - pE[band-SUBBANDS*(2*nbn-k)]);
+        }
+    }
+    /* IIR part */
+    xn = xn + a1*_Y0[band];
+    /* remember the last filtered level */
+    _Y0[band] = xn;
+
+    if (xn > _H[band]) {
+        /* update with new threshold */
+        _H[band] = xn * overfact;
+        return true;
+    }
+    /* apply decays */
+    _H[band] = _H[band] * exp(-1.0/(double)tau);
+    return false;
+}
+
+uint Fingerprint::adaptiveOnsets(int ttarg, matrix_u&out, uint*&onset_counter_for_band) {
+    int frames, i, j;
+    int deadtime = 128;
+    int taus[SUBBANDS];
+    int contact[SUBBANDS], lcontact[SUBBANDS], tsince[SUBBANDS];
+    uint onset_counter = 0;
+
+    frames = computeLevels();
+
+    out = matrix_u(SUBBANDS, frames);
+    onset_counter_for_band = new uint[SUBBANDS];
+
+    for (j = 0; j < SUBBANDS; ++j) {
         onset_counter_for_band[j] = 0;
-        N[j] = 0.0;
-        taus[j] = 1.0;
-        H[j] = pE[j];
+        taus[j] = 1;
         contact[j] = 0;
         lcontact[j] = 0;
         tsince[j] = 0;
-        Y0[j] = 0;
     }
 
     for (i = 0; i < frames; ++i) {
         for (j = 0; j < SUBBANDS; ++j) {
 
-            double xn = 0;
-            /* calculate the filter -  FIR part */
-            if (i >= 2*nbn) {
-                for (int k = 0; k < nbn; ++k) {
-                    xn += bn[k]*(pE[j-SUBBANDS*k] - pE[j-SUBBANDS*(2*nbn-k)]);
-                }
-            }
-            /* IIR part */
-            xn = xn + a1*Y0[j];
-            /* remember the last filtered level */
-            Y0[j] = xn;
-
-            contact[j] = (xn > H[j])? 1 : 0;
-
-            if (contact[j] == 1 && lcontact[j] == 0) {
-                /* attach - record the threshold level unless we have one */
-                if(N[j] == 0) {
-                    N[j] = H[j];
-                }
-            }
-            if (contact[j] == 1) {
-                /* update with new threshold */
-                H[j] = xn * overfact;
-            } else {
-                /* apply decays */
-                H[j] = H[j] * exp(-1.0/(double)taus[j]);
-            }
+            contact[j] = exceedsThreshold(i, j, taus[j]) ? 1 : 0;
 
             if (contact[j] == 0 && lcontact[j] == 1) {
                 /* detach */
@@ -154,20 +156,107 @@ uint Fingerprint::adaptiveOnsets(int ttarg, matrix_u&out, uint*&onset_counter_fo
             } else {
                 taus[j] = taus[j] + 1;
             }
-
-            if ( (contact[j] == 0) &&  (tsince[j] > deadtime)) {
-                /* forget the threshold where we recently hit */
-                N[j] = 0;
-            }
             lcontact[j] = contact[j];
         }
-        pE += bands;
     }
 
     return onset_counter;
 }
 
 
+// Q15
+static const int64_t fixed_bn[] = {6170, 13861, 11115};
+static const int64_t fixed_a1 = 32113;
+// fractional bits of the decay of the thresholds, exp(-1/tau)
+#define DECAY_SHIFT 22
+
+FixedFingerprint::FixedFingerprint(FixedSubbandAnalysis* pSubbandAnalysis, int offset)
+    : Fingerprint(NULL, offset), _pFixedSubbandAnalysis(pSubbandAnalysis) {
+    for (int tau = 1; tau < DECAY_TABLE_SIZE; ++tau)
+        _Decay[tau] = lrint(ldexp(exp(-1.0/tau), DECAY_SHIFT));
+    _Decay[0] = 0;
+    for (int t = 0; t < 256; ++t)
+        _Sqrt[t] = (unsigned short)floor(16*sqrt((double)t));
+}
+
+uint64_t FixedFingerprint::isqrt(uint64_t x) const {
+    if (x < 256) return _Sqrt[x] >> 4;
+    // the square root of the top 7 or 8 bits (x >> 2*k) from the table is good for 7 bits,
+    // every Newton step doubles that
+    int n = 0;
+    for (int step = 32; step > 0; step >>= 1) {
+        if ((x >> (n + step)) != 0) n += step;
+    }
+    int k = (n - 6) / 2;
+    uint64_t r = ((uint64_t)_Sqrt[x >> (2*k)] << k) >> 4;
+    r = (r + x/r) >> 1;
+    r = (r + x/r) >> 1;
+    while (r*r > x) r--;
+    while ((r+1)*(r+1) <= x) r++;
+    return r;
+}
+
+int FixedFingerprint::computeLevels() {
+    int i, j, k;
+    const matrix_u64& E = _pFixedSubbandAnalysis->getMatrix();
+
+    // see Fingerprint::computeLevels, the window is in Q8. The sums stay below 2^62 and the levels below 2^27
+    // (2^25 times those of the floating point Fingerprint).
+    int hop = 4;
+    int nsm = 8;
+    uint64_t ham[8];
+    for(int i = 0 ; i != nsm ; i++)
+        ham[i] = lrint(256*(.5 - .5*cos( (2.*M_PI/(nsm-1))*i)));
+
+    int nc = (int)E.size2()/hop - (nsm/hop - 1);
+    if (nc < 0) nc = 0;
+    _Levels.assign(nc*SUBBANDS, 0);
+    for(i=0;i<nc;i++) {
+        for(j=0;j<SUBBANDS;j++) {
+            uint64_t sum = 0;
+            for(k=0;k<nsm;k++) sum += E(j,(i*hop)+k) * ham[k];
+            _Levels[i*SUBBANDS + j] = isqrt(sum) >> 4;
+        }
+    }
+
+    for (j = 0; j < SUBBANDS; ++j) {
+        _H[j] = nc > 0 ? _Levels[j] << 8 : 0;
+        _Y0[j] = 0;
+    }
+    return nc;
+}
+
+bool FixedFingerprint::exceedsThreshold(int frame, int band, int tau) {
+    const int64_t *pE = &_Levels[frame*SUBBANDS];
+    int nbn = 3;
+
+    // the filtered levels and the thresholds are in Q8
+    int64_t fir = 0;
+    if (frame >= 2*nbn) {
+        for (int k = 0; k < nbn; ++k) {
+            fir += fixed_bn[k]*(pE[band-SUBBANDS*k] - pE[band-SUBBANDS*(2*nbn-k)]);
+        }
+    }
+    int64_t xn = (fir*256 + fixed_a1*_Y0[band] + (1 << 14)) >> 15;
+    _Y0[band] = xn;
+
+    if (xn > _H[band]) {
+        _H[band] = xn + xn/10;
+        return true;
+    }
+    // exp(-1/tau) = 1 - 1/tau + 1/(2*tau^2) - ..., past the table the rest is below a unit
+    int64_t decay;
+    if (tau < DECAY_TABLE_SIZE) {
+        decay = _Decay[tau];
+    } else {
+        int64_t t = tau;
+        decay = ((int64_t)1 << DECAY_SHIFT) - (((int64_t)1 << DECAY_SHIFT) + t/2)/t + (((int64_t)1 << (DECAY_SHIFT-1)) + t*t/2)/(t*t);
+    }
+    _H[band] = (_H[band]*decay + (1 << (DECAY_SHIFT-1))) >> DECAY_SHIFT;
+    return false;
+}
+
+
 // dan is going to beat me if i call this "decimated_time_for_frame" like i want to
 uint Fingerprint::quantized_time_for_frame_delta(uint frame_delta) {
     double time_for_frame_delta = (double)frame_delta / ((double)Params::AudioStreamInput::SamplingRate / 32.0);
@@ -181,6 +270,7 @@ uint Fingerprint::quantized_time_for_frame_absolute(uint frame) {
 
 
 void Fingerprint::Compute() {
+    TraceSpan span("Fingerprint::Compute");
     uint actual_codes = 0;
     unsigned char hash_material[5];
     for(uint i=0;i<5;i++) hash_material[i] = 0;
@@ -33,13 +33,44 @@ public:
     uint quantized_time_for_frame_delta(uint frame_delta);
     uint quantized_time_for_frame_absolute(uint frame);
     Fingerprint(SubbandAnalysis* pSubbandAnalysis, int offset);
+    virtual ~Fingerprint() {}
     void Compute();
     uint adaptiveOnsets(int ttarg, matrix_u&out, uint*&onset_counter_for_band) ;
     std::vector<FPCode>& getCodes(){return _Codes;}
 protected:
+    // the levels the onsets are found in, the energy of every band summed over 8 frames of the filter bank (under
+    // a hann window, every 4 frames), returns the number of them
+    virtual int computeLevels();
+    // filters the level of a band and compares it to the band's threshold, which follows the peaks and decays
+    // by exp(-1/tau) otherwise. True as long as the level exceeds it.
+    virtual bool exceedsThreshold(int frame, int band, int tau);
     SubbandAnalysis *_pSubbandAnalysis;
     int _Offset;
     std::vector<FPCode> _Codes;
+private:
+    matrix_f _Eb;
+    double _H[SUBBANDS], _Y0[SUBBANDS];
+};
+
+#define DECAY_TABLE_SIZE 1024
+
+// The onsets of the energies of FixedSubbandAnalysis, in integers: the levels are integer square roots and the
+// filter and the thresholds are in Q8 with Q15 coefficients, the decays in Q22.
+class FixedFingerprint : public Fingerprint {
+public:
+    FixedFingerprint(FixedSubbandAnalysis* pSubbandAnalysis, int offset);
+protected:
+    int computeLevels();
+    bool exceedsThreshold(int frame, int band, int tau);
+    // floor(sqrt(x)), x < 2^62
+    uint64_t isqrt(uint64_t x) const;
+    FixedSubbandAnalysis *_pFixedSubbandAnalysis;
+private:
+    std::vector<int64_t> _Levels;
+    int64_t _H[SUBBANDS], _Y0[SUBBANDS];
+    int64_t _Decay[DECAY_TABLE_SIZE];
+    // 16 * sqrt(t)
+    unsigned short _Sqrt[256];
 };
 
 #endif
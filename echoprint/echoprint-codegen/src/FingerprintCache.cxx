@@ -0,0 +1,563 @@
+//
+//  echoprint-codegen
+//
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "FingerprintCache.h"
+#include "Codegen.h"
+
+using std::string;
+using std::vector;
+
+#define INDEX_MAGIC "EPCIDX02"
+#define RECORD_MAGIC "EPCQ"
+#define MIN_CAPACITY 1024
+// the payload is read in chunks of this size while it's digested
+#define DIGEST_CHUNK_SIZE 65536
+#define ID3V2_HEADER_SIZE 10
+#define ID3V1_SIZE 128
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+enum FileMode { FILE_READ, FILE_UPDATE, FILE_APPEND, FILE_CREATE };
+
+#ifdef __EMSCRIPTEN__
+// The wasm module only sees its in-memory filesystem (and has to keep stdout going through Module["print"]),
+// so the host filesystem is accessed through node's fs module, just like AudioStreamInput does with ffmpeg.
+// There is no flock in node, concurrent writers are tolerated anyway (see FingerprintCache.h).
+static int file_open(const char* path, FileMode mode) {
+    static const char* flags[] = {"r", "r+", "a+", "w+"};
+    return EM_ASM_INT({
+        try { return require('fs').openSync(Pointer_stringify($0), Pointer_stringify($1)); } catch (e) { return -1; }
+    }, path, flags[mode]);
+}
+
+static void file_close(int fd) {
+    EM_ASM_({ try { require('fs').closeSync($0); } catch (e) { } }, fd);
+}
+
+static int64_t file_size(int fd) {
+    return (int64_t)EM_ASM_DOUBLE({
+        try { return require('fs').fstatSync($0).size; } catch (e) { return -1; }
+    }, fd);
+}
+
+static ssize_t file_pread(int fd, void* buf, size_t len, uint64_t offset) {
+    return EM_ASM_INT({
+        try { return require('fs').readSync($0, Buffer.from(HEAPU8.buffer, $1, $2), 0, $2, $3); } catch (e) { return -1; }
+    }, fd, buf, len, (double)offset);
+}
+
+static ssize_t file_pwrite(int fd, const void* buf, size_t len, uint64_t offset) {
+    return EM_ASM_INT({
+        try { return require('fs').writeSync($0, Buffer.from(HEAPU8.buffer, $1, $2), 0, $2, $3); } catch (e) { return -1; }
+    }, fd, buf, len, (double)offset);
+}
+
+static bool file_append(int fd, const void* buf, size_t len) {
+    return EM_ASM_INT({
+        try { return require('fs').writeSync($0, Buffer.from(HEAPU8.buffer, $1, $2), 0, $2) == $2; } catch (e) { return 0; }
+    }, fd, buf, len);
+}
+
+static bool file_truncate(int fd, uint64_t len) {
+    return EM_ASM_INT({
+        try { require('fs').ftruncateSync($0, $1); return 1; } catch (e) { return 0; }
+    }, fd, (double)len);
+}
+
+static bool file_rename(const char* from, const char* to) {
+    return EM_ASM_INT({
+        try { require('fs').renameSync(Pointer_stringify($0), Pointer_stringify($1)); return 1; } catch (e) { return 0; }
+    }, from, to);
+}
+
+static void file_unlink(const char* path) {
+    EM_ASM_({ try { require('fs').unlinkSync(Pointer_stringify($0)); } catch (e) { } }, path);
+}
+
+static void make_directory(const char* path) {
+    EM_ASM_({ try { require('fs').mkdirSync(Pointer_stringify($0)); } catch (e) { } }, path);
+}
+
+// size, modification time (ns) and inode
+static bool file_stat(const char* path, double* st) {
+    return EM_ASM_INT({
+        try {
+            var s = require('fs').statSync(Pointer_stringify($0));
+            HEAPF64[($1 >> 3)] = s.size;
+            HEAPF64[($1 >> 3) + 1] = s.mtimeMs * 1e6;
+            HEAPF64[($1 >> 3) + 2] = s.ino;
+            return 1;
+        } catch (e) { return 0; }
+    }, path, st);
+}
+
+static void lock_file(int fd, bool exclusive) { }
+
+static int process_id() {
+    return EM_ASM_INT({ return process.pid; }, 0);
+}
+#else
+static int file_open(const char* path, FileMode mode) {
+    static const int flags[] = {O_RDONLY, O_RDWR, O_RDWR | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_TRUNC};
+    return open(path, flags[mode], 0644);
+}
+
+static void file_close(int fd) { close(fd); }
+
+static int64_t file_size(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : -1;
+}
+
+static ssize_t file_pread(int fd, void* buf, size_t len, uint64_t offset) { return pread(fd, buf, len, offset); }
+static ssize_t file_pwrite(int fd, const void* buf, size_t len, uint64_t offset) { return pwrite(fd, buf, len, offset); }
+static bool file_append(int fd, const void* buf, size_t len) { return write(fd, buf, len) == (ssize_t)len; }
+static bool file_truncate(int fd, uint64_t len) { return ftruncate(fd, len) == 0; }
+static bool file_rename(const char* from, const char* to) { return rename(from, to) == 0; }
+static void file_unlink(const char* path) { unlink(path); }
+static void make_directory(const char* path) { mkdir(path, 0755); }
+static void lock_file(int fd, bool exclusive) { flock(fd, exclusive ? LOCK_EX : LOCK_UN); }
+
+static bool file_stat(const char* path, double* st) {
+    struct stat s;
+    if (stat(path, &s) != 0) return false;
+    st[0] = s.st_size;
+#ifdef __APPLE__
+    st[1] = s.st_mtimespec.tv_sec * 1e9 + s.st_mtimespec.tv_nsec;
+#else
+    st[1] = s.st_mtim.tv_sec * 1e9 + s.st_mtim.tv_nsec;
+#endif
+    st[2] = s.st_ino;
+    return true;
+}
+
+static int process_id() { return getpid(); }
+#endif
+
+static bool read_fully(int fd, void* buf, size_t len, uint64_t offset) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = file_pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const void* buf, size_t len, uint64_t offset) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = file_pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// temporary files are unique per process, so concurrent compactions never write into the same file
+static string temporary_filename(const string& filename) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", process_id());
+    return filename + suffix;
+}
+
+// 64 bit FNV-1a
+static uint64_t digest(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint32_t syncsafe(const unsigned char* p) {
+    return ((p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) | ((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+// finds the payload of a file of the given size, skipping its ID3 tags
+static void find_payload(int fd, int64_t size, uint64_t& begin, uint64_t& end) {
+    // (possibly several) ID3v2 tags at the start
+    begin = 0;
+    end = size;
+    unsigned char header[ID3V2_HEADER_SIZE];
+    while (end - begin >= ID3V2_HEADER_SIZE && read_fully(fd, header, ID3V2_HEADER_SIZE, begin)
+            && memcmp(header, "ID3", 3) == 0) {
+        // the footer flag adds another 10 bytes
+        uint64_t tagSize = ID3V2_HEADER_SIZE + syncsafe(header + 6) + ((header[5] & 0x10) ? ID3V2_HEADER_SIZE : 0);
+        if (tagSize > end - begin) break;
+        begin += tagSize;
+    }
+    // an ID3v1 tag is always last, an appended ID3v2 tag (which requires a footer) comes right before it
+    unsigned char tail[ID3V1_SIZE];
+    if (end - begin >= ID3V1_SIZE && read_fully(fd, tail, ID3V1_SIZE, end - ID3V1_SIZE) && memcmp(tail, "TAG", 3) == 0)
+        end -= ID3V1_SIZE;
+    if (end - begin >= ID3V2_HEADER_SIZE && read_fully(fd, header, ID3V2_HEADER_SIZE, end - ID3V2_HEADER_SIZE)
+            && memcmp(header, "3DI", 3) == 0) {
+        uint64_t tagSize = 2 * ID3V2_HEADER_SIZE + syncsafe(header + 6);
+        if (tagSize <= end - begin) end -= tagSize;
+    }
+}
+
+bool FingerprintCache::PayloadLength(const char* filename, uint64_t& length) {
+    int fd = file_open(filename, FILE_READ);
+    if (fd < 0) return false;
+    int64_t size = file_size(fd);
+    uint64_t begin, end;
+    if (size >= 0) {
+        find_payload(fd, size, begin, end);
+        length = end - begin;
+    }
+    file_close(fd);
+    return size >= 0;
+}
+
+bool FingerprintCache::ComputeKey(const char* filename, int start_offset, int duration, bool fixedPoint,
+                                  CacheKey& key) {
+    int fd = file_open(filename, FILE_READ);
+    if (fd < 0) return false;
+    int64_t size = file_size(fd);
+    if (size < 0) {
+        file_close(fd);
+        return false;
+    }
+    uint64_t begin, end;
+    find_payload(fd, size, begin, end);
+
+    double version = ECHOPRINT_VERSION;
+    uint64_t length = end - begin;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = digest(h, &version, sizeof(version));
+    h = digest(h, &start_offset, sizeof(start_offset));
+    h = digest(h, &duration, sizeof(duration));
+    h = digest(h, &length, sizeof(length));
+    // keys of the floating point pipeline stay what they were
+    if (fixedPoint) h = digest(h, "fixed", 5);
+
+    // all of it, an in place edit of the audio (e.g. by a normalizer) keeps the length and most of the bytes
+    vector<unsigned char> chunk(DIGEST_CHUNK_SIZE);
+    bool ok = true;
+    for (uint64_t pos = begin; pos < end && ok; pos += DIGEST_CHUNK_SIZE) {
+        size_t len = (size_t)std::min((uint64_t)DIGEST_CHUNK_SIZE, end - pos);
+        ok = read_fully(fd, &chunk[0], len, pos);
+        h = digest(h, chunk.data(), len);
+    }
+    file_close(fd);
+
+    // 0 marks empty buckets
+    key = h ? h : 1;
+    return ok;
+}
+
+bool FingerprintCache::ComputeFileKey(const char* filename, int start_offset, int duration, bool fixedPoint,
+                                      CacheKey& fileKey) {
+    double st[3];
+    if (!file_stat(filename, st)) return false;
+
+    double version = ECHOPRINT_VERSION;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    // kept apart from payload keys
+    h = digest(h, "file", 4);
+    h = digest(h, &version, sizeof(version));
+    h = digest(h, &start_offset, sizeof(start_offset));
+    h = digest(h, &duration, sizeof(duration));
+    if (fixedPoint) h = digest(h, "fixed", 5);
+    h = digest(h, st, sizeof(st));
+    h = digest(h, filename, strlen(filename));
+    fileKey = h ? h : 1;
+    return true;
+}
+
+FingerprintCache::FingerprintCache(const char* directory) : _LogFd(-1), _IndexFd(-1), _LogSize(-1) {
+    make_directory(directory);
+    _LogFilename = string(directory) + "/codes.log";
+    _IndexFilename = string(directory) + "/codes.idx";
+    memset(&_Header, 0, sizeof(_Header));
+
+    _LogFd = file_open(_LogFilename.c_str(), FILE_APPEND);
+    if (_LogFd < 0) return;
+    if (Reopen()) {
+        _LogSize = file_size(_LogFd);
+    } else {
+        if (_Header.version != 0 && _Header.version != ECHOPRINT_VERSION) {
+            // nothing in there can be used anymore
+            Compact();
+        } else {
+            lock_file(_LogFd, true);
+            RebuildIndex(MIN_CAPACITY);
+            lock_file(_LogFd, false);
+        }
+    }
+}
+
+FingerprintCache::~FingerprintCache() {
+    if (_LogFd >= 0) file_close(_LogFd);
+    if (_IndexFd >= 0) file_close(_IndexFd);
+}
+
+// (re)opens the index, which might have been replaced by another process in the meantime
+bool FingerprintCache::Reopen() {
+    if (_IndexFd >= 0) file_close(_IndexFd);
+    _IndexFd = file_open(_IndexFilename.c_str(), FILE_UPDATE);
+    if (_IndexFd < 0) return false;
+
+    if (!read_fully(_IndexFd, &_Header, sizeof(_Header), 0)
+            || memcmp(_Header.magic, INDEX_MAGIC, sizeof(_Header.magic)) != 0
+            || _Header.capacity == 0
+            || file_size(_IndexFd) != (int64_t)(sizeof(_Header) + _Header.capacity * sizeof(CacheBucket))
+            || _Header.version != ECHOPRINT_VERSION) {
+        file_close(_IndexFd);
+        _IndexFd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool FingerprintCache::ReadBucket(uint64_t slot, CacheBucket& bucket) {
+    return read_fully(_IndexFd, &bucket, sizeof(bucket), sizeof(_Header) + slot * sizeof(CacheBucket));
+}
+
+bool FingerprintCache::FindRecord(CacheKey key, uint64_t& offset) {
+    if (!IsOpen()) return false;
+
+    CacheBucket bucket;
+    for (uint64_t i = 0, slot = key % _Header.capacity; i < _Header.capacity; i++) {
+        if (!ReadBucket(slot, bucket) || bucket.key == 0) return false;
+        if (bucket.key == key) {
+            offset = bucket.offset;
+            return true;
+        }
+        if (++slot == _Header.capacity) slot = 0;
+    }
+    return false;
+}
+
+bool FingerprintCache::ReadRecord(uint64_t offset, CacheKey key, uint32_t type, CacheRecordHeader& record) {
+    return read_fully(_LogFd, &record, sizeof(record), offset)
+        && memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) == 0
+        && record.key == key && record.version == ECHOPRINT_VERSION && record.type == type;
+}
+
+bool FingerprintCache::Lookup(CacheKey key, string& codeString, int& numCodes, AudioQuality& quality) {
+    uint64_t offset;
+    CacheRecordHeader record;
+    if (!FindRecord(key, offset) || !ReadRecord(offset, key, RECORD_CODES, record))
+        return false;
+
+    codeString.resize(record.length);
+    if (record.length > 0 && !read_fully(_LogFd, &codeString[0], record.length, offset + sizeof(record)))
+        return false;
+    numCodes = record.numCodes;
+    quality.sampleRate = record.sampleRate;
+    quality.bitrate = record.bitrate;
+    quality.bandwidth = record.bandwidth;
+    quality.clippedSamples = record.clippedSamples;
+    return true;
+}
+
+bool FingerprintCache::LookupPayloadKey(CacheKey fileKey, CacheKey& key) {
+    uint64_t offset;
+    CacheRecordHeader record;
+    return FindRecord(fileKey, offset) && ReadRecord(offset, fileKey, RECORD_FILE, record)
+        && record.length == sizeof(key) && read_fully(_LogFd, &key, sizeof(key), offset + sizeof(record));
+}
+
+bool FingerprintCache::Insert(CacheKey key, const string& codeString, int numCodes, const AudioQuality& quality) {
+    CacheRecordHeader record;
+    memset(&record, 0, sizeof(record));
+    record.type = RECORD_CODES;
+    record.numCodes = numCodes;
+    record.key = key;
+    record.length = codeString.size();
+    record.sampleRate = quality.sampleRate;
+    record.bitrate = quality.bitrate;
+    record.bandwidth = quality.bandwidth;
+    record.clippedSamples = quality.clippedSamples;
+    return AppendRecord(record, codeString.data());
+}
+
+bool FingerprintCache::InsertPayloadKey(CacheKey fileKey, CacheKey key) {
+    CacheRecordHeader record;
+    memset(&record, 0, sizeof(record));
+    record.type = RECORD_FILE;
+    record.key = fileKey;
+    record.length = sizeof(key);
+    return AppendRecord(record, &key);
+}
+
+// appends a record (header and record.length bytes of data) and adds it to the index
+bool FingerprintCache::AppendRecord(CacheRecordHeader& header, const void* data) {
+    if (!IsOpen()) return false;
+
+    // writers are serialized by the lock on the log, readers never wait. The index only changes along with
+    // the log, so it only has to be reopened (it might have been replaced) if another process appended since.
+    lock_file(_LogFd, true);
+    int64_t size = file_size(_LogFd);
+    if (size < 0 || (size != _LogSize && !Reopen())) {
+        lock_file(_LogFd, false);
+        return false;
+    }
+
+    // append the record in one go, so a crash leaves at most a truncated record at the end
+    CacheKey key = header.key;
+    uint64_t offset = ALIGN8((uint64_t)size);
+    vector<char> buf(offset - size + ALIGN8(sizeof(CacheRecordHeader) + header.length), 0);
+    CacheRecordHeader* record = (CacheRecordHeader*)&buf[offset - size];
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = ECHOPRINT_VERSION;
+    *record = header;
+    memcpy(record + 1, data, header.length);
+    bool ok = file_append(_LogFd, buf.data(), buf.size());
+    _Header.records++;
+    _LogSize = ok ? size + buf.size() : -1;
+
+    if (ok && (_Header.count + 1) * 2 > _Header.capacity) {
+        // the rebuild picks up the record just appended
+        ok = RebuildIndex(_Header.capacity * 2);
+    } else if (ok) {
+        CacheBucket bucket;
+        uint64_t slot = key % _Header.capacity;
+        while ((ok = ReadBucket(slot, bucket)) && bucket.key != 0 && bucket.key != key) {
+            if (++slot == _Header.capacity) slot = 0;
+        }
+        if (ok && bucket.key == 0) _Header.count++;
+        bucket.key = key;
+        bucket.offset = offset;
+        ok = ok && write_fully(_IndexFd, &bucket, sizeof(bucket), sizeof(_Header) + slot * sizeof(CacheBucket))
+            && write_fully(_IndexFd, &_Header, sizeof(_Header), 0);
+    }
+    // _Header might not match the index anymore
+    if (!ok) _LogSize = -1;
+    lock_file(_LogFd, false);
+
+    // superseded records pile up if the same audio is fingerprinted again and again
+    if (ok && _Header.records > 2 * _Header.count + MIN_CAPACITY)
+        ok = Compact();
+    return ok;
+}
+
+// Scans the log and hashes every record of the current version, the last one wins.
+// Has to be called with the log locked.
+bool FingerprintCache::RebuildIndex(uint64_t capacity) {
+    vector<CacheBucket> buckets(capacity);
+    CacheIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = ECHOPRINT_VERSION;
+
+    CacheRecordHeader record;
+    uint64_t offset = 0;
+    while (read_fully(_LogFd, &record, sizeof(record), offset)
+            && memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) == 0) {
+        header.records++;
+        if (record.version == ECHOPRINT_VERSION) {
+            if ((header.count + 1) * 2 > capacity)
+                return RebuildIndex(capacity * 2);
+            uint64_t slot = record.key % capacity;
+            while (buckets[slot].key != 0 && buckets[slot].key != record.key) {
+                if (++slot == capacity) slot = 0;
+            }
+            if (buckets[slot].key == 0) header.count++;
+            buckets[slot].key = record.key;
+            buckets[slot].offset = offset;
+        }
+        offset += ALIGN8(sizeof(record) + record.length);
+    }
+    header.capacity = capacity;
+
+    // anything behind the last valid record is what's left of an interrupted append
+    if (file_size(_LogFd) > (int64_t)offset && !file_truncate(_LogFd, offset))
+        return false;
+    _LogSize = offset;
+
+    // replace the index atomically, readers keep using the old one until they reopen it
+    string tmpFilename = temporary_filename(_IndexFilename);
+    int fd = file_open(tmpFilename.c_str(), FILE_CREATE);
+    if (fd < 0) return false;
+    bool ok = write_fully(fd, &header, sizeof(header), 0)
+        && write_fully(fd, buckets.data(), capacity * sizeof(CacheBucket), sizeof(header));
+    file_close(fd);
+    if (!ok || !file_rename(tmpFilename.c_str(), _IndexFilename.c_str())) {
+        file_unlink(tmpFilename.c_str());
+        return false;
+    }
+    return Reopen();
+}
+
+bool FingerprintCache::Compact() {
+    if (_LogFd < 0) return false;
+    lock_file(_LogFd, true);
+
+    // the last record of a key is the one which counts
+    CacheRecordHeader record;
+    std::unordered_map<uint64_t, uint64_t> latest;
+    uint64_t offset = 0;
+    while (read_fully(_LogFd, &record, sizeof(record), offset)
+            && memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) == 0) {
+        if (record.version == ECHOPRINT_VERSION)
+            latest[record.key] = offset;
+        offset += ALIGN8(sizeof(record) + record.length);
+    }
+
+    // copy the live records over in log order
+    vector<uint64_t> live;
+    live.reserve(latest.size());
+    for (std::unordered_map<uint64_t, uint64_t>::iterator it = latest.begin(); it != latest.end(); ++it)
+        live.push_back(it->second);
+    std::sort(live.begin(), live.end());
+
+    string tmpFilename = temporary_filename(_LogFilename);
+    int fd = file_open(tmpFilename.c_str(), FILE_CREATE);
+    bool ok = fd >= 0;
+    vector<char> buf;
+    uint64_t written = 0;
+    for (size_t i = 0; ok && i < live.size(); i++) {
+        ok = read_fully(_LogFd, &record, sizeof(record), live[i]);
+        buf.resize(ALIGN8(sizeof(record) + record.length));
+        ok = ok && read_fully(_LogFd, &buf[0], buf.size(), live[i])
+            && write_fully(fd, buf.data(), buf.size(), written);
+        written += buf.size();
+    }
+    if (fd >= 0) file_close(fd);
+    if (!ok || !file_rename(tmpFilename.c_str(), _LogFilename.c_str())) {
+        file_unlink(tmpFilename.c_str());
+        lock_file(_LogFd, false);
+        return false;
+    }
+
+    // from now on the new log is the one to lock
+    int oldFd = _LogFd;
+    _LogFd = file_open(_LogFilename.c_str(), FILE_APPEND);
+    lock_file(oldFd, false);
+    file_close(oldFd);
+    if (_LogFd < 0) return false;
+
+    lock_file(_LogFd, true);
+    uint64_t capacity = MIN_CAPACITY;
+    while (live.size() * 2 > capacity) capacity *= 2;
+    ok = RebuildIndex(capacity);
+    lock_file(_LogFd, false);
+    return ok;
+}
@@ -0,0 +1,96 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef FINGERPRINTCACHE_H
+#define FINGERPRINTCACHE_H
+
+#include <stdint.h>
+#include <string>
+#include "QualityAnalysis.h"
+
+// Identifies the audio of a file independent of its tags: a digest of the whole payload (everything
+// but ID3v2 at the start/end and ID3v1 at the end), its length, ECHOPRINT_VERSION
+// and the parameters the codes were generated with (the fixed point pipeline has codes of its own).
+// A file key identifies a file instead, by its path, size, modification time and inode, and maps to the
+// key of its payload as of the last time the file was seen. It only takes a stat, so the payload of a file
+// is only read (and digested) if the file changed since.
+typedef uint64_t CacheKey;
+
+// On-disk cache of code strings, so unchanged files (retagging doesn't change the payload)
+// are neither decoded nor fingerprinted again. A cache directory holds two files:
+//   codes.log  append-only records (CacheRecordHeader, which holds the AudioQuality as well, followed by
+//              the code string, 8 byte aligned). Records of file keys hold the payload key instead.
+//   codes.idx  open addressing hash table (CacheIndexHeader followed by CacheBucket[capacity])
+// Both have fixed size, aligned entries in host byte order, so they can be used in place when mapped.
+// A lookup is a single pread of the bucket(s) plus one of the record. The index can always be
+// rebuilt from the log, and every record is validated against its key before it is used,
+// so a lost or stale index entry (e.g. by concurrent writers) only ever costs a cache miss.
+// Records of other versions and superseded records are dropped by Compact().
+struct CacheIndexHeader {
+    char magic[8];
+    double version;
+    uint64_t capacity;
+    uint64_t count;      // used buckets
+    uint64_t records;    // records in the log, including the ones not referenced anymore
+};
+
+struct CacheBucket {
+    uint64_t key;        // 0 marks an empty bucket
+    uint64_t offset;     // of the record within codes.log
+};
+
+// records of older codegens have 0 in what is now the type
+enum CacheRecordType { RECORD_CODES = 0, RECORD_FILE = 1 };
+
+struct CacheRecordHeader {
+    char magic[4];
+    uint32_t numCodes;
+    uint64_t key;
+    double version;
+    uint32_t length;     // of the code string
+    uint32_t sampleRate;
+    uint32_t bitrate;
+    uint32_t bandwidth;
+    uint32_t clippedSamples;
+    uint32_t type;       // RECORD_CODES or RECORD_FILE
+};
+
+class FingerprintCache {
+public:
+    FingerprintCache(const char* directory);
+    ~FingerprintCache();
+    bool IsOpen() const { return _LogFd >= 0 && _IndexFd >= 0; }
+
+    // returns false if the file can't be read
+    static bool ComputeKey(const char* filename, int start_offset, int duration, bool fixedPoint, CacheKey& key);
+    // from a single stat, returns false if there is no such file
+    static bool ComputeFileKey(const char* filename, int start_offset, int duration, bool fixedPoint,
+                               CacheKey& fileKey);
+    // length of the audio payload of a file (see CacheKey), returns false if the file can't be read
+    static bool PayloadLength(const char* filename, uint64_t& length);
+    bool Lookup(CacheKey key, std::string& codeString, int& numCodes, AudioQuality& quality);
+    bool Insert(CacheKey key, const std::string& codeString, int numCodes, const AudioQuality& quality);
+    bool LookupPayloadKey(CacheKey fileKey, CacheKey& key);
+    bool InsertPayloadKey(CacheKey fileKey, CacheKey key);
+    // rewrites the log without stale records and rebuilds the index
+    bool Compact();
+
+private:
+    bool ReadBucket(uint64_t slot, CacheBucket& bucket);
+    bool FindRecord(CacheKey key, uint64_t& offset);
+    bool ReadRecord(uint64_t offset, CacheKey key, uint32_t type, CacheRecordHeader& record);
+    bool AppendRecord(CacheRecordHeader& record, const void* data);
+    bool RebuildIndex(uint64_t capacity);
+    bool Reopen();
+
+    std::string _LogFilename;
+    std::string _IndexFilename;
+    int _LogFd;
+    int _IndexFd;
+    int64_t _LogSize;    // as of the last time _Header was read or written
+    CacheIndexHeader _Header;
+};
+
+#endif
@@ -9,6 +9,7 @@
 #define MATRIXUTILITY_H
 
 #include "Common.h"
+#include <stdint.h>
 #include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/matrix_proxy.hpp>
 
@@ -16,6 +17,7 @@ namespace ublas = boost::numeric::ublas;
 
 typedef ublas::matrix<float> matrix_f;
 typedef ublas::matrix<uint> matrix_u;
+typedef ublas::matrix<uint64_t> matrix_u64;
 
 typedef ublas::matrix_row<matrix_f> matrix_row_f;
 typedef ublas::matrix_row<const ublas::matrix<float> > const_matrix_row_f;
@@ -0,0 +1,133 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <deque>
+#include "Trace.h"
+
+// Building blocks for running the stages of a batch (prefetch, decode, DSP, output) concurrently. The time a
+// stage waits for another one shows up in the trace (see Trace.h), under the name of the waiting thread.
+
+// Blocking FIFO between two stages. Push blocks while the queue is full, so a fast stage can't run away from
+// a slow one, Pop blocks while it's empty and returns false once the queue is closed and drained.
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : _Capacity(capacity > 0 ? capacity : 1), _Closed(false) {
+        pthread_mutex_init(&_Lock, NULL);
+        pthread_cond_init(&_NotEmpty, NULL);
+        pthread_cond_init(&_NotFull, NULL);
+    }
+    ~BoundedQueue() {
+        pthread_cond_destroy(&_NotFull);
+        pthread_cond_destroy(&_NotEmpty);
+        pthread_mutex_destroy(&_Lock);
+    }
+
+    void Push(const T& item) {
+        pthread_mutex_lock(&_Lock);
+        if (_Items.size() >= _Capacity && !_Closed) {
+            TraceSpan span("wait (queue full)");
+            while (_Items.size() >= _Capacity && !_Closed)
+                pthread_cond_wait(&_NotFull, &_Lock);
+        }
+        _Items.push_back(item);
+        pthread_cond_signal(&_NotEmpty);
+        pthread_mutex_unlock(&_Lock);
+    }
+
+    bool Pop(T& item) {
+        pthread_mutex_lock(&_Lock);
+        if (_Items.empty() && !_Closed) {
+            TraceSpan span("wait (queue empty)");
+            while (_Items.empty() && !_Closed)
+                pthread_cond_wait(&_NotEmpty, &_Lock);
+        }
+        bool ok = !_Items.empty();
+        if (ok) {
+            item = _Items.front();
+            _Items.pop_front();
+            pthread_cond_signal(&_NotFull);
+        }
+        pthread_mutex_unlock(&_Lock);
+        return ok;
+    }
+
+    // no more items will be pushed, wakes up everyone waiting
+    void Close() {
+        pthread_mutex_lock(&_Lock);
+        _Closed = true;
+        pthread_cond_broadcast(&_NotEmpty);
+        pthread_cond_broadcast(&_NotFull);
+        pthread_mutex_unlock(&_Lock);
+    }
+
+private:
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    std::deque<T> _Items;
+    size_t _Capacity;
+    bool _Closed;
+    pthread_mutex_t _Lock;
+    pthread_cond_t _NotEmpty;
+    pthread_cond_t _NotFull;
+};
+
+// Limits the amount of something (e.g. bytes of decoded audio) in flight between stages. Acquire blocks until
+// the amount fits, but always lets a single item through, however big it is, so nothing can get stuck.
+class Budget {
+public:
+    Budget(size_t limit) : _Limit(limit), _Used(0) {
+        pthread_mutex_init(&_Lock, NULL);
+        pthread_cond_init(&_Released, NULL);
+    }
+    ~Budget() {
+        pthread_cond_destroy(&_Released);
+        pthread_mutex_destroy(&_Lock);
+    }
+
+    void Acquire(size_t amount) {
+        pthread_mutex_lock(&_Lock);
+        if (_Used > 0 && _Used + amount > _Limit) {
+            TraceSpan span("wait (budget)");
+            while (_Used > 0 && _Used + amount > _Limit)
+                pthread_cond_wait(&_Released, &_Lock);
+        }
+        _Used += amount;
+        pthread_mutex_unlock(&_Lock);
+    }
+
+    // changes an amount acquired before (e.g. an estimate) to what it turned out to be, without waiting
+    void Resize(size_t from, size_t to) {
+        pthread_mutex_lock(&_Lock);
+        _Used = _Used - from + to;
+        if (to < from)
+            pthread_cond_broadcast(&_Released);
+        pthread_mutex_unlock(&_Lock);
+    }
+
+    void Release(size_t amount) {
+        pthread_mutex_lock(&_Lock);
+        _Used -= amount;
+        pthread_cond_broadcast(&_Released);
+        pthread_mutex_unlock(&_Lock);
+    }
+
+private:
+    Budget(const Budget&);
+    Budget& operator=(const Budget&);
+
+    size_t _Limit;
+    size_t _Used;
+    pthread_mutex_t _Lock;
+    pthread_cond_t _Released;
+};
+
+#endif
@@ -0,0 +1,163 @@
+//
+//  echoprint-codegen
+//
+
+
+#include <math.h>
+#include <string.h>
+#include <complex>
+#include "QualityAnalysis.h"
+#include "Trace.h"
+
+using std::vector;
+
+// spectra are averaged over at most this many evenly spaced windows of the excerpt
+#define FFT_SIZE 2048
+#define MAX_WINDOWS 256
+// the averaged spectrum is smoothed over this many bins (~170Hz at 44.1kHz) before looking for the cutoff
+#define SMOOTH_BINS 9
+// content counts if it is above the noise floor by this much, but not more than this far below the peak
+#define FLOOR_MARGIN_DB 10.0
+#define PEAK_RANGE_DB 90.0
+#define LOWEST_FREQUENCY 100.0
+
+typedef std::complex<float> complex_f;
+
+// iterative radix-2 FFT, in place, n has to be a power of 2
+static void fft(vector<complex_f>& x) {
+    uint n = x.size();
+    for (uint i = 1, j = 0; i < n; i++) {
+        uint bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(x[i], x[j]);
+    }
+    for (uint len = 2; len <= n; len <<= 1) {
+        complex_f w = std::polar(1.0f, (float)(-2 * M_PI / len));
+        for (uint i = 0; i < n; i += len) {
+            complex_f wk = 1;
+            for (uint k = 0; k < len / 2; k++) {
+                complex_f u = x[i + k], v = x[i + k + len / 2] * wk;
+                x[i + k] = u + v;
+                x[i + k + len / 2] = u - v;
+                wk *= w;
+            }
+        }
+    }
+}
+
+static uint read_le(const unsigned char* p, uint bytes) {
+    uint value = 0;
+    for (uint i = 0; i < bytes; i++) value |= p[i] << (8 * i);
+    return value;
+}
+
+QualityAnalysis::QualityAnalysis(const short* pSamples, uint numFrames, uint channels, uint sampleRate) :
+    _pSamples(pSamples), _NumFrames(numFrames), _Channels(channels), _SampleRate(sampleRate),
+    _Bandwidth(0), _ClippedSamples(0) { }
+
+void QualityAnalysis::Compute() {
+    TraceSpan span("QualityAnalysis::Compute");
+    if (_Channels == 0 || _SampleRate == 0) return;
+    ComputeBandwidth();
+    ComputeClipping();
+}
+
+// The highest frequency of the averaged spectrum which is clearly above its floor. Lossy encoders low pass
+// (e.g. at 16kHz for 128kbit/s mp3) and leave nothing but the rounding noise of the decoder above that.
+void QualityAnalysis::ComputeBandwidth() {
+    if (_NumFrames < FFT_SIZE) return;
+
+    float window[FFT_SIZE];
+    for (uint i = 0; i < FFT_SIZE; i++)
+        window[i] = .5 - .5 * cos((2. * M_PI / (FFT_SIZE - 1)) * i);
+
+    uint bins = FFT_SIZE / 2;
+    vector<double> power(bins, 0);
+    vector<complex_f> x(FFT_SIZE);
+    uint windows = std::min((uint)MAX_WINDOWS, _NumFrames / FFT_SIZE);
+    for (uint w = 0; w < windows; w++) {
+        const short* p = _pSamples + (size_t)((_NumFrames - FFT_SIZE) / std::max(1u, windows - 1) * w) * _Channels;
+        for (uint i = 0; i < FFT_SIZE; i++) {
+            float sum = 0;
+            for (uint c = 0; c < _Channels; c++) sum += p[i * _Channels + c];
+            x[i] = complex_f(window[i] * sum / (32768.0f * _Channels), 0);
+        }
+        fft(x);
+        for (uint k = 0; k < bins; k++) power[k] += std::norm(x[k]);
+    }
+
+    uint lowest = (uint)ceil(LOWEST_FREQUENCY * FFT_SIZE / _SampleRate);
+    vector<double> level(bins, 0);
+    double peak = -HUGE_VAL, floor = HUGE_VAL;
+    for (uint k = lowest; k < bins; k++) {
+        uint from = k >= SMOOTH_BINS / 2 ? k - SMOOTH_BINS / 2 : 0, to = std::min(bins, k + SMOOTH_BINS / 2 + 1);
+        double sum = 0;
+        for (uint j = from; j < to; j++) sum += power[j];
+        level[k] = 10 * log10(sum / (to - from) / windows + 1e-30);
+        peak = std::max(peak, level[k]);
+        floor = std::min(floor, level[k]);
+    }
+    // silence, or noise all across the spectrum
+    if (peak - floor < 2 * FLOOR_MARGIN_DB) return;
+
+    double threshold = std::max(floor + FLOOR_MARGIN_DB, peak - PEAK_RANGE_DB);
+    for (uint k = bins - 1; k >= lowest; k--) {
+        if (level[k] > threshold) {
+            _Bandwidth = (uint)((k + 1) * (double)_SampleRate / FFT_SIZE);
+            break;
+        }
+    }
+}
+
+// A single sample at full scale may just be a loud master, runs of them are what clipping leaves behind.
+void QualityAnalysis::ComputeClipping() {
+    for (uint c = 0; c < _Channels; c++) {
+        uint run = 0;
+        short last = 0;
+        for (uint i = 0; i < _NumFrames; i++) {
+            short s = _pSamples[i * _Channels + c];
+            if ((s == 32767 || s == -32768) && (run == 0 || s == last)) {
+                run++;
+            } else {
+                if (run > 1) _ClippedSamples += run;
+                run = (s == 32767 || s == -32768) ? 1 : 0;
+            }
+            last = s;
+        }
+        if (run > 1) _ClippedSamples += run;
+    }
+}
+
+bool QualityAnalysis::AnalyzeWave(const unsigned char* data, size_t length, AudioQuality& quality) {
+    if (length < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+        return false;
+
+    uint channels = 0, sampleRate = 0, bitsPerSample = 0;
+    for (size_t pos = 12; pos + 8 <= length; ) {
+        size_t chunkSize = read_le(data + pos + 4, 4);
+        if (memcmp(data + pos, "fmt ", 4) == 0 && pos + 8 + 16 <= length) {
+            channels = read_le(data + pos + 10, 2);
+            sampleRate = read_le(data + pos + 12, 4);
+            bitsPerSample = read_le(data + pos + 22, 2);
+        } else if (memcmp(data + pos, "data", 4) == 0) {
+            // written to a pipe, the size of the data isn't known upfront
+            size_t available = length - pos - 8;
+            if (chunkSize == 0 || chunkSize > available) chunkSize = available;
+            if (channels == 0 || sampleRate == 0 || bitsPerSample != 16)
+                return false;
+
+            // the excerpt is written by ffmpeg in host byte order (little endian), aligned by the chunk headers
+            vector<short> samples(chunkSize / 2);
+            if (!samples.empty()) memcpy(&samples[0], data + pos + 8, samples.size() * 2);
+            QualityAnalysis analysis(samples.data(), samples.size() / channels, channels, sampleRate);
+            analysis.Compute();
+            quality.sampleRate = sampleRate;
+            quality.bandwidth = analysis.getBandwidth();
+            quality.clippedSamples = analysis.getClippedSamples();
+            return true;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    return false;
+}
@@ -0,0 +1,48 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef QUALITYANALYSIS_H
+#define QUALITYANALYSIS_H
+
+#include <stddef.h>
+#include <vector>
+#include "Common.h"
+
+// Cheap indicators of the quality of a file, gathered in the same pass which decodes it for the fingerprint,
+// so duplicates can be ranked without decoding them again. 0 means unknown.
+struct AudioQuality {
+    AudioQuality() : sampleRate(0), bitrate(0), bandwidth(0), clippedSamples(0) {}
+    uint sampleRate;        // Hz, of the decoded stream
+    uint bitrate;           // kbit/s, averaged over the audio payload (tags don't count)
+    uint bandwidth;         // Hz, estimated lowpass cutoff (lossy encoders drop the highs)
+    uint clippedSamples;    // full scale samples next to another full scale one, within the excerpt
+};
+
+// Analyzes an excerpt of the decoded audio at its original sample rate, before it is mixed down and resampled
+// to what the fingerprint needs (which would hide both the highs and the clipping).
+class QualityAnalysis {
+public:
+    // pSamples holds numFrames interleaved frames of channels 16 bit samples
+    QualityAnalysis(const short* pSamples, uint numFrames, uint channels, uint sampleRate);
+    void Compute();
+    uint getBandwidth() const { return _Bandwidth; }
+    uint getClippedSamples() const { return _ClippedSamples; }
+
+    // analyzes the excerpt given as a WAVE file (as ffmpeg writes it), returns false if it can't be parsed
+    static bool AnalyzeWave(const unsigned char* data, size_t length, AudioQuality& quality);
+
+protected:
+    void ComputeBandwidth();
+    void ComputeClipping();
+
+    const short* _pSamples;
+    uint _NumFrames;
+    uint _Channels;
+    uint _SampleRate;
+    uint _Bandwidth;
+    uint _ClippedSamples;
+};
+
+#endif
@@ -0,0 +1,230 @@
+//
+//  echoprint-codegen
+//
+
+
+#include <pthread.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "SimilarityJoin.h"
+
+using std::vector;
+
+// how many records a thread claims at once
+#define PROBE_CHUNK 64
+// codegen emits 20 bit codes (HASH_BITMASK)
+#define DENSE_CODES (1 << 20)
+
+typedef struct {
+    SimilarityJoin* join;
+    vector<SimilarityJoin::Pair> pairs;
+} probe_parm_t;
+
+// A code occurring several times within a fingerprint matches min(m, n) times in echoprint_compare,
+// so every (code, occurrence) becomes a token of its own, which turns the multisets into plain sets.
+// The first occurrence of a 20 bit code (by far the most common case) is looked up in a dense table,
+// everything else in a hash map.
+class TokenTable {
+public:
+    TokenTable() : _Dense(DENSE_CODES, 0) { }
+    uint& operator()(uint code, uint occurrence) {
+        if (occurrence == 0 && code < DENSE_CODES)
+            return _Dense[code];
+        return _Sparse[((unsigned long long)occurrence << 32) | code];
+    }
+    template<typename F> void forEach(F f) {
+        for (uint code = 0; code < DENSE_CODES; code++) {
+            if (_Dense[code]) f(code, 0u, _Dense[code]);
+        }
+        for (std::unordered_map<unsigned long long, uint>::iterator it = _Sparse.begin(); it != _Sparse.end(); ++it)
+            f((uint)(it->first & 0xffffffff), (uint)(it->first >> 32), it->second);
+    }
+private:
+    vector<uint> _Dense;
+    std::unordered_map<unsigned long long, uint> _Sparse;
+};
+
+// the very same computation echoprint_compare does, so the scores are identical
+static inline float jaccard_score(uint num, uint left_elemc, uint right_elemc) {
+    return num / (float)(left_elemc + right_elemc - num);
+}
+
+SimilarityJoin::SimilarityJoin(const vector<vector<uint> >& fingerprints, float threshold)
+    : _Fingerprints(fingerprints), _Threshold(threshold), _NextChunk(0) { }
+
+// smallest size a record may have to reach the threshold with a record of the given size,
+// rounded down so float inaccuracies never prune a valid pair
+uint SimilarityJoin::minSize(uint size) const {
+    return (uint)floor(_Threshold * size);
+}
+
+// two records of size >= s reaching the threshold share at least one token
+// within the first prefixLength(s) tokens of both of them
+uint SimilarityJoin::prefixLength(uint size) const {
+    return std::min(size, size - minSize(size) + 1);
+}
+
+void SimilarityJoin::Compute(int numThreads) {
+    uint n = _Fingerprints.size();
+
+    // Tokens are ranked by their frequency in the whole library, rarest first, which keeps
+    // the prefixes (and therefore the inverted lists) as selective as possible.
+    TokenTable table;
+    for (uint i = 0; i < n; i++) {
+        const vector<uint>& codes = _Fingerprints[i];
+        for (uint j = 0, occurrence = 0; j < codes.size(); j++) {
+            occurrence = (j > 0 && codes[j] == codes[j - 1]) ? occurrence + 1 : 0;
+            table(codes[j], occurrence)++;
+        }
+    }
+    // (frequency, occurrence, code), so ties are broken deterministically
+    vector<std::pair<uint, std::pair<uint, uint> > > ranked;
+    table.forEach([&ranked](uint code, uint occurrence, uint count) {
+        ranked.push_back(std::make_pair(count, std::make_pair(occurrence, code)));
+    });
+    std::sort(ranked.begin(), ranked.end());
+    for (uint rank = 0; rank < ranked.size(); rank++)
+        table(ranked[rank].second.second, ranked[rank].second.first) = rank;
+
+    // process records in order of their size, so size filtering is a simple range
+    _Order.resize(n);
+    for (uint i = 0; i < n; i++) _Order[i] = i;
+    std::stable_sort(_Order.begin(), _Order.end(), [this](uint l, uint r) {
+        return _Fingerprints[l].size() < _Fingerprints[r].size();
+    });
+
+    _Tokens.resize(n);
+    _Index.assign(ranked.size(), vector<uint>());
+    for (uint pos = 0; pos < n; pos++) {
+        const vector<uint>& codes = _Fingerprints[_Order[pos]];
+        vector<uint>& tokens = _Tokens[pos];
+        tokens.resize(codes.size());
+        for (uint j = 0, occurrence = 0; j < codes.size(); j++) {
+            occurrence = (j > 0 && codes[j] == codes[j - 1]) ? occurrence + 1 : 0;
+            tokens[j] = table(codes[j], occurrence);
+        }
+        std::sort(tokens.begin(), tokens.end());
+
+        // positions are appended in ascending order, so every list is sorted by position (and size)
+        uint prefix = prefixLength(tokens.size());
+        for (uint j = 0; j < prefix; j++)
+            _Index[tokens[j]].push_back(pos);
+    }
+
+    // probe all records in parallel, every record only looks at smaller (earlier) ones
+    if (numThreads < 1) numThreads = 1;
+    vector<pthread_t> threads(numThreads);
+    vector<probe_parm_t> parms(numThreads);
+    _NextChunk = 0;
+    for (int t = 0; t < numThreads; t++) {
+        parms[t].join = this;
+        pthread_create(&threads[t], NULL, threaded_probe, &parms[t]);
+    }
+    _Pairs.clear();
+    for (int t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+        _Pairs.insert(_Pairs.end(), parms[t].pairs.begin(), parms[t].pairs.end());
+    }
+    std::sort(_Pairs.begin(), _Pairs.end(), [](const Pair& l, const Pair& r) {
+        return l.left != r.left ? l.left < r.left : l.right < r.right;
+    });
+}
+
+void* SimilarityJoin::threaded_probe(void* parm) {
+    probe_parm_t* p = (probe_parm_t*)parm;
+    SimilarityJoin* join = p->join;
+    uint n = join->_Tokens.size();
+    vector<uint> overlap(n, 0);
+    for (;;) {
+        uint begin = __sync_fetch_and_add(&join->_NextChunk, PROBE_CHUNK);
+        if (begin >= n) break;
+        join->Probe(begin, std::min(begin + PROBE_CHUNK, n), overlap, p->pairs);
+    }
+    return NULL;
+}
+
+// overlap is a per thread scratch buffer (one counter per record), which is all zero again on return
+void SimilarityJoin::Probe(uint begin, uint end, vector<uint>& overlap, vector<Pair>& pairs) {
+    vector<uint> candidates;
+
+    for (uint pos = begin; pos < end; pos++) {
+        const vector<uint>& tokens = _Tokens[pos];
+        uint size = tokens.size();
+        if (size == 0) continue;
+
+        // size filter: the first position whose record is big enough
+        uint smallest = minSize(size);
+        uint first = std::lower_bound(_Order.begin(), _Order.begin() + pos, smallest, [this](uint idx, uint s) {
+            return _Fingerprints[idx].size() < s;
+        }) - _Order.begin();
+
+        // collect candidates sharing a token within the prefix
+        candidates.clear();
+        uint prefix = prefixLength(size);
+        for (uint j = 0; j < prefix; j++) {
+            const vector<uint>& list = _Index[tokens[j]];
+            vector<uint>::const_iterator it = std::lower_bound(list.begin(), list.end(), first);
+            for (; it != list.end() && *it < pos; ++it) {
+                if (overlap[*it]++ == 0)
+                    candidates.push_back(*it);
+            }
+        }
+
+        // verify every candidate with a full merge
+        for (uint c = 0; c < candidates.size(); c++) {
+            uint other = candidates[c];
+            const vector<uint>& otherTokens = _Tokens[other];
+            overlap[other] = 0;
+
+            uint num = 0, i = 0, j = 0;
+            while (i < size && j < otherTokens.size()) {
+                if (tokens[i] == otherTokens[j]) { num++; i++; j++; }
+                else if (tokens[i] < otherTokens[j]) i++;
+                else j++;
+            }
+            float score = jaccard_score(num, size, otherTokens.size());
+            if (score >= _Threshold) {
+                Pair pair;
+                pair.left = std::min(_Order[pos], _Order[other]);
+                pair.right = std::max(_Order[pos], _Order[other]);
+                pair.score = score;
+                pairs.push_back(pair);
+            }
+        }
+    }
+}
+
+static uint find_root(vector<uint>& parent, uint i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+vector<vector<uint> > SimilarityJoin::getClusters() const {
+    uint n = _Fingerprints.size();
+    vector<uint> parent(n);
+    for (uint i = 0; i < n; i++) parent[i] = i;
+    for (uint i = 0; i < _Pairs.size(); i++) {
+        uint l = find_root(parent, _Pairs[i].left);
+        uint r = find_root(parent, _Pairs[i].right);
+        if (l != r) parent[std::max(l, r)] = std::min(l, r);
+    }
+
+    // the root is always the smallest member, so clusters come out ordered by their first member
+    vector<vector<uint> > clusters;
+    vector<int> clusterOf(n, -1);
+    for (uint i = 0; i < n; i++) {
+        uint root = find_root(parent, i);
+        if (root == i) continue;
+        if (clusterOf[root] < 0) {
+            clusterOf[root] = clusters.size();
+            clusters.push_back(vector<uint>(1, root));
+        }
+        clusters[clusterOf[root]].push_back(i);
+    }
+    return clusters;
+}
@@ -0,0 +1,51 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef SIMILARITYJOIN_H
+#define SIMILARITYJOIN_H
+
+#include "Common.h"
+#include <vector>
+
+// Finds all pairs of fingerprints (sorted code arrays) with a jaccard score >= threshold,
+// scored exactly like echoprint_compare does, and groups them into clusters of duplicates.
+//
+// Instead of comparing every pair this uses prefix filtering (AllPairs): codes are reordered
+// by their frequency in the whole library (rarest first), then two sets can only reach the
+// threshold if they share a code within their (short) prefixes. Candidates are looked up
+// in an inverted index over those prefixes, pruned by size and verified with a full merge.
+class SimilarityJoin {
+public:
+    struct Pair {
+        uint left;
+        uint right;
+        float score;
+    };
+
+    SimilarityJoin(const std::vector<std::vector<uint> >& fingerprints, float threshold);
+    void Compute(int numThreads);
+    // all pairs above the threshold, left < right (indices into the given fingerprints)
+    const std::vector<Pair>& getPairs() const { return _Pairs; }
+    // connected components of the pairs with more than one member, members ascending
+    std::vector<std::vector<uint> > getClusters() const;
+
+protected:
+    static void* threaded_probe(void* parm);
+    void Probe(uint begin, uint end, std::vector<uint>& overlap, std::vector<Pair>& pairs);
+    uint prefixLength(uint size) const;
+    uint minSize(uint size) const;
+
+    const std::vector<std::vector<uint> >& _Fingerprints;
+    float _Threshold;
+    // records ordered by size, holding frequency ranks instead of codes (ascending)
+    std::vector<uint> _Order;
+    std::vector<std::vector<uint> > _Tokens;
+    // token -> positions (in _Order) of the records having that token within their prefix
+    std::vector<std::vector<uint> > _Index;
+    std::vector<Pair> _Pairs;
+    volatile uint _NextChunk;
+};
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "SubbandAnalysis.h"
 #include "AudioStreamInput.h"
+#include "Trace.h"
 
 #ifdef _WIN32
 #include "win_funcs.h"
@@ -38,6 +39,7 @@ void SubbandAnalysis::Init() {
 }
 
 void SubbandAnalysis::Compute() {
+    TraceSpan span("SubbandAnalysis::Compute");
     uint t, i, j;
 
     float Z[C_LEN];
@@ -72,3 +74,70 @@ void SubbandAnalysis::Compute() {
     }
 }
 
+
+// fractional bits of the window, the modulation and the samples
+#define C_SHIFT 19
+#define M_SHIFT 14
+#define SAMPLE_SHIFT 15
+// columns are at most this loud for the modulation (after rounding), 16 * Y_MAX * (1 << M_SHIFT) < 2^31
+#define Y_MAX 8191
+
+FixedSubbandAnalysis::FixedSubbandAnalysis(const short* pSamples, uint numSamples) :
+    _pSamples(pSamples), _NumSamples(numSamples) {
+    for (uint i = 0; i < C_LEN; ++i)
+        _Cq[i] = (short)lrintf(ldexpf(SubbandFilterBank::C[i], C_SHIFT));
+    for (uint i = 0; i < M_ROWS; ++i) {
+        for (uint k = 0; k < M_COLS; ++k) {
+            _Mrq[i][k] = (short)lrint(ldexp(cos((2*i + 1)*(k-4)*(M_PI/16.0)), M_SHIFT));
+            _Miq[i][k] = (short)lrint(ldexp(sin((2*i + 1)*(k-4)*(M_PI/16.0)), M_SHIFT));
+        }
+    }
+}
+
+void FixedSubbandAnalysis::Compute() {
+    TraceSpan span("FixedSubbandAnalysis::Compute");
+    uint t, i, j;
+
+    int Y[M_COLS];
+    short Yq[M_COLS];
+
+    _NumFrames = (_NumSamples - C_LEN + 1)/SUBBANDS;
+    assert(_NumFrames > 0);
+
+    _Data = matrix_u64(SUBBANDS, _NumFrames);
+
+    for (t = 0; t < _NumFrames; ++t) {
+        const short* x = _pSamples + t*SUBBANDS;
+        for (i = 0; i < M_COLS; ++i) {
+            Y[i] = x[i] * _Cq[i];
+        }
+        for (j = 1; j < M_ROWS; ++j) {
+            for (i = 0; i < M_COLS; ++i) {
+                Y[i] += x[i + M_COLS*j] * _Cq[i + M_COLS*j];
+            }
+        }
+        // not the largest magnitude, but no smaller and with the same highest bit
+        int peak = 0;
+        for (i = 0; i < M_COLS; ++i) {
+            peak |= Y[i] < 0 ? -Y[i] : Y[i];
+        }
+
+        int shift = 0;
+        while ((peak >> shift) >= Y_MAX) shift++;
+        int rounding = (1 << shift) >> 1;
+        for (i = 0; i < M_COLS; ++i) {
+            Yq[i] = (short)((Y[i] + rounding) >> shift);
+        }
+        // the squares of the unscaled sums have 2*(C_SHIFT + M_SHIFT + SAMPLE_SHIFT) = 96 fractional bits,
+        // the energies keep 50 of them (and are below 2^52, the sums are at most 2^49)
+        for (i = 0; i < M_ROWS; ++i) {
+            int Dr = 0, Di = 0;
+            for (j = 0; j < M_COLS; ++j) {
+                Dr += _Mrq[i][j] * Yq[j];
+                Di -= _Miq[i][j] * Yq[j];
+            }
+            uint64_t energy = (uint64_t)((int64_t)Dr*Dr) + (uint64_t)((int64_t)Di*Di);
+            _Data(i,t) = energy >> (2*(C_SHIFT + M_SHIFT + SAMPLE_SHIFT) - 50 - 2*shift);
+        }
+    }
+}
@@ -44,7 +44,7 @@ public:
     SubbandAnalysis(AudioStreamInput* pAudio);
     SubbandAnalysis(const float* pSamples, uint numSamples);
     virtual ~SubbandAnalysis();
-    void Compute();
+    virtual void Compute();
 public:
     inline uint getNumFrames() const {return _NumFrames;}
     inline uint getNumBands() const {return SUBBANDS;}
@@ -62,4 +62,26 @@ private:
     void Init();
 };
 
+// The filter bank on 16-bit samples, in integers: the window in Q19 (the 8 products summed per column fit into
+// 32 bits), the modulation in Q14 on the columns scaled down to 13 bits when they are louder (block floating point).
+// The energies are 64-bit integers, 2^50 times those of SubbandAnalysis, for FixedFingerprint.
+class FixedSubbandAnalysis {
+public:
+    FixedSubbandAnalysis(const short* pSamples, uint numSamples);
+    void Compute();
+public:
+    inline uint getNumFrames() const {return _NumFrames;}
+    inline uint getNumBands() const {return SUBBANDS;}
+    const matrix_u64& getMatrix() const {return _Data;}
+
+protected:
+    const short* _pSamples;
+    uint _NumSamples;
+    uint _NumFrames;
+    short _Cq[C_LEN];
+    short _Mrq[M_ROWS][M_COLS];
+    short _Miq[M_ROWS][M_COLS];
+    matrix_u64 _Data;
+};
+
 #endif
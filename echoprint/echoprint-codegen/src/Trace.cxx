@@ -0,0 +1,186 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <unistd.h>
+#define THREAD_LOCAL __thread
+#endif
+
+#include "Trace.h"
+
+// spans kept per thread (~1MB), enough for a few thousand files
+#define RING_SIZE 16384
+// of a detail, the end of a path tells more than its start
+#define DETAIL_SIZE 48
+
+struct TraceEvent {
+    const char* name;
+    double start;
+    double duration;
+    char detail[DETAIL_SIZE];
+};
+
+// only ever written by its thread, and read by Write once the thread is done
+struct TraceRing {
+    uint tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    unsigned long long recorded;
+};
+
+bool Trace::_Enabled = false;
+static std::string trace_filename;
+// guards the list of rings, which a thread only touches the first time it records
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceRing*> trace_rings;
+static THREAD_LOCAL TraceRing* thread_ring = NULL;
+#ifdef __EMSCRIPTEN__
+static double trace_origin = 0;
+#endif
+
+static TraceRing* ring() {
+    if (thread_ring == NULL) {
+        TraceRing* r = new TraceRing();
+        r->events.resize(RING_SIZE);
+        r->recorded = 0;
+        pthread_mutex_lock(&trace_lock);
+        r->tid = trace_rings.size() + 1;
+        trace_rings.push_back(r);
+        pthread_mutex_unlock(&trace_lock);
+        thread_ring = r;
+    }
+    return thread_ring;
+}
+
+static void append_escaped(std::string& out, const char* value) {
+    for (const char* p = value; *p; p++) {
+        if ((unsigned char)*p < 32) continue;
+        if (*p == '"' || *p == '\\') out += '\\';
+        out += *p;
+    }
+}
+
+void Trace::Enable(const char* filename) {
+    if (_Enabled) return;
+    trace_filename = filename;
+#ifdef __EMSCRIPTEN__
+    trace_origin = now() * 1e6 - emscripten_get_now() * 1000;
+#endif
+    _Enabled = true;
+    atexit(WriteAtExit);
+}
+
+void Trace::SetThreadName(const char* name) {
+    if (_Enabled) ring()->name = name;
+}
+
+double Trace::Now() {
+#ifdef __EMSCRIPTEN__
+    // gettimeofday only has milliseconds there
+    return trace_origin + emscripten_get_now() * 1000;
+#else
+    return now() * 1e6;
+#endif
+}
+
+void Trace::Record(const char* name, double start, const char* detail) {
+    TraceRing* r = ring();
+    TraceEvent& event = r->events[r->recorded++ % RING_SIZE];
+    event.name = name;
+    event.start = start;
+    event.duration = Now() - start;
+    event.detail[0] = '\0';
+    if (detail != NULL) {
+        size_t length = strlen(detail);
+        strncpy(event.detail, detail + (length >= DETAIL_SIZE ? length - DETAIL_SIZE + 1 : 0), DETAIL_SIZE);
+        event.detail[DETAIL_SIZE - 1] = '\0';
+    }
+}
+
+bool Trace::Write(const char* filename) {
+#ifdef __EMSCRIPTEN__
+    int pid = EM_ASM_INT(return process.pid);
+#else
+    int pid = getpid();
+#endif
+    std::string json = "{\"traceEvents\":[";
+    char buffer[256];
+    const char* separator = "\n";
+    unsigned long long dropped = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    for (size_t t = 0; t < trace_rings.size(); t++) {
+        const TraceRing* r = trace_rings[t];
+        if (!r->name.empty()) {
+            snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"name\":\"", separator, pid, r->tid);
+            json += buffer;
+            append_escaped(json, r->name.c_str());
+            json += "\"}}";
+            separator = ",\n";
+        }
+        unsigned long long kept = r->recorded < RING_SIZE ? r->recorded : RING_SIZE;
+        dropped += r->recorded - kept;
+        for (unsigned long long i = r->recorded - kept; i < r->recorded; i++) {
+            const TraceEvent& event = r->events[i % RING_SIZE];
+            snprintf(buffer, sizeof(buffer), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.1f,"
+                "\"dur\":%.1f", separator, event.name, pid, r->tid, event.start, event.duration);
+            json += buffer;
+            if (event.detail[0] != '\0') {
+                json += ",\"args\":{\"detail\":\"";
+                append_escaped(json, event.detail);
+                json += "\"}";
+            }
+            json += "}";
+            separator = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    snprintf(buffer, sizeof(buffer), "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":%llu}}\n",
+        dropped);
+    json += buffer;
+
+#ifdef __EMSCRIPTEN__
+    // the file system of the module isn't the one of the host, so node writes the file. A host collecting the
+    // traces of several modules (see tool/src/main/trace.ts) takes them right away instead.
+    return EM_ASM_INT({
+        var json = Pointer_stringify($0);
+        if (Module["trace"]) {
+            Module["trace"](json);
+            return 1;
+        }
+        try {
+            require("fs").writeFileSync(Pointer_stringify($1), json);
+            return 1;
+        } catch (e) {
+            return 0;
+        }
+    }, json.c_str(), filename);
+#else
+    FILE* out = fopen(filename, "w");
+    if (out == NULL) return false;
+    bool ok = fwrite(json.data(), 1, json.size(), out) == json.size();
+    return fclose(out) == 0 && ok;
+#endif
+}
+
+void Trace::WriteAtExit() {
+    if (!Write(trace_filename.c_str()))
+        fprintf(stderr, "Could not write trace %s\n", trace_filename.c_str());
+}
@@ -0,0 +1,50 @@
+//
+//  echoprint-codegen
+//
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "Common.h"
+
+// Opt-in timeline of where the time goes: spans of decoding, the DSP stages and the waits between the stages
+// of a batch, per thread, written as Chrome trace-event JSON (chrome://tracing or ui.perfetto.dev) at exit.
+// Every thread records into a ring buffer of its own, so recording takes no lock, and once a thread recorded
+// more than fit its oldest spans are dropped. While tracing is off a span costs the test of a flag.
+class Trace {
+public:
+    // starts recording, the trace is written to filename when the process exits
+    static void Enable(const char* filename);
+    static bool IsEnabled() { return _Enabled; }
+    // names the calling thread in the trace
+    static void SetThreadName(const char* name);
+    // microseconds since the epoch
+    static double Now();
+    // name has to outlive the trace (a literal), detail (e.g. a filename) is copied
+    static void Record(const char* name, double start, const char* detail);
+    // has to be called once the threads which recorded are done
+    static bool Write(const char* filename);
+
+private:
+    static void WriteAtExit();
+    static bool _Enabled;
+};
+
+// Records the time from its construction to the end of its scope
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* detail = NULL) :
+        _Name(name), _Detail(detail), _Start(Trace::IsEnabled() ? Trace::Now() : -1) {}
+    ~TraceSpan() { if (_Start >= 0) Trace::Record(_Name, _Start, _Detail); }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    const char* _Name;
+    const char* _Detail;
+    double _Start;
+};
+
+#endif
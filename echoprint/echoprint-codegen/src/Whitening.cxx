@@ -6,15 +6,28 @@
 
 #include "Whitening.h"
 #include "AudioStreamInput.h"
+#include "Trace.h"
+#include <stdint.h>
 
-Whitening::Whitening(AudioStreamInput* pAudio) {
+void WhiteningFilter::Compute() {
+    TraceSpan span(_TraceName);
+    int blocklen = 10000;
+    int i, newblocklen;
+    for(i=0;i<(int)_NumSamples;i=i+blocklen) {
+        if (i+blocklen >= (int)_NumSamples) {
+            newblocklen = _NumSamples -i - 1;
+        } else { newblocklen = blocklen; }
+        ComputeBlock(i, newblocklen);
+    }
+}
+
+Whitening::Whitening(AudioStreamInput* pAudio) : WhiteningFilter(pAudio->getNumSamples(), "Whitening::Compute") {
     _pSamples = pAudio->getSamples();
-    _NumSamples = pAudio->getNumSamples();
     Init();
 }
 
 Whitening::Whitening(const float* pSamples, uint numSamples) :
-    _pSamples(pSamples), _NumSamples(numSamples) {
+    WhiteningFilter(numSamples, "Whitening::Compute"), _pSamples(pSamples) {
     Init();
 }
 
@@ -27,7 +40,6 @@ Whitening::~Whitening() {
 
 void Whitening::Init() {
     int i;
-    _p = 40;
 
     _R = (float *)malloc((_p+1)*sizeof(float));
     for (i = 0; i <= _p; ++i)  { _R[i] = 0.0; }
@@ -40,17 +52,6 @@ void Whitening::Init() {
     _whitened = (float*) malloc(sizeof(float)*_NumSamples);
 }
 
-void Whitening::Compute() {
-    int blocklen = 10000;
-    int i, newblocklen;
-    for(i=0;i<(int)_NumSamples;i=i+blocklen) {
-        if (i+blocklen >= (int)_NumSamples) {
-            newblocklen = _NumSamples -i - 1;
-        } else { newblocklen = blocklen; }
-        ComputeBlock(i, newblocklen);
-    }
-}
-
 void Whitening::ComputeBlock(int start, int blockSize) {
     int i, j;
     float alpha, E, ki;
@@ -108,4 +109,131 @@ void Whitening::ComputeBlock(int start, int blockSize) {
     }
 }
 
+FixedWhitening::FixedWhitening(const short* pSamples, uint numSamples) :
+    WhiteningFilter(numSamples, "FixedWhitening::Compute"), _pSamples(pSamples), _Shift(0) {
+    _R = (int64_t *)calloc(_p+1, sizeof(int64_t));
+    // 0.001, like Whitening
+    _R[0] = 1073742;
+
+    _Xo = (short *)calloc(_p+1, sizeof(short));
+    _ai = (int64_t *)calloc(_p+1, sizeof(int64_t));
+    _Next = (int64_t *)calloc(_p+1, sizeof(int64_t));
+    _aq = (short *)calloc(_p, sizeof(short));
+    _whitened = (short*) calloc(_NumSamples, sizeof(short));
+}
+
+FixedWhitening::~FixedWhitening() {
+    free(_R);
+    free(_Xo);
+    free(_ai);
+    free(_Next);
+    free(_aq);
+    free(_whitened);
+}
 
+void FixedWhitening::ComputeCoefficients() {
+    int i, j;
+    for (i = 1; i <= _p; ++i) _ai[i] = 0;
+    if (_R[0] <= 0) return;
+
+    // normalize the autocorrelation to Q30 (|_R[i]| <= _R[0])
+    EN_ARRAY(int64_t, r, _p+1);
+    int shift = 0;
+    while ((_R[0] >> shift) >= ((int64_t)1 << 31)) shift++;
+    int lshift = 0;
+    while ((_R[0] << lshift) < ((int64_t)1 << 30)) lshift++;
+    for (i = 0; i <= _p; ++i) r[i] = shift > 0 ? _R[i] >> shift : _R[i] * ((int64_t)1 << lshift);
+
+    // Durbin's recursion, see Whitening::ComputeBlock. The sums of the coefficients are kept below 256 (2^32 in
+    // Q24) so the sums of their products with r fit into 64 bits, like an unstable filter (|ki| >= 1) the order
+    // which exceeds that is left out.
+    int64_t E = r[0];
+    for (i = 1; i <= _p; ++i) {
+        int64_t acc = r[i] << 24;
+        for (j = 1; j < i; ++j) {
+            acc -= _ai[j]*r[i-j];
+        }
+        if (E <= 0) break;
+        int64_t ki = acc / E;
+        if (ki >= (1 << 24) || ki <= -(1 << 24)) break;
+
+        int64_t total = ki < 0 ? -ki : ki;
+        _Next[i] = ki;
+        for (j = 1; j < i; ++j) {
+            _Next[j] = _ai[j] - ((ki*_ai[i-j] + (1 << 23)) >> 24);
+            total += _Next[j] < 0 ? -_Next[j] : _Next[j];
+        }
+        if (total >= ((int64_t)1 << 32)) break;
+        for (j = 1; j <= i; ++j) _ai[j] = _Next[j];
+        E -= (E*((ki*ki) >> 24) + (1 << 23)) >> 24;
+    }
+}
+
+void FixedWhitening::QuantizeCoefficients() {
+    // |output << _Shift| <= 32768 * ((1 << _Shift) + sum |_aq|) has to fit into 32 bits
+    for (_Shift = 14; _Shift >= 0; --_Shift) {
+        int total = 1 << _Shift;
+        bool fits = true;
+        for (int j = 1; j <= _p && fits; ++j) {
+            int64_t q = (_ai[j] + (1 << (23 - _Shift))) >> (24 - _Shift);
+            fits = q >= -32767 && q <= 32767;
+            _aq[_p - j] = (short)q;
+            total += fits ? abs((int)q) : 0;
+        }
+        if (fits && total < 65536) return;
+    }
+    // the recursion keeps the coefficients far smaller than this, leave the block as it is
+    _Shift = 0;
+    for (int j = 0; j < _p; ++j) _aq[j] = 0;
+}
+
+void FixedWhitening::ComputeBlock(int start, int blockSize) {
+    int i, j;
+    const short* x = _pSamples + start;
+
+    // calculate autocorrelation of current block, samples are 1.15 so the sums are 2.30
+
+    for (i = 0; i <= _p; ++i) {
+        int64_t acc = 0;
+        for (j = i; j < (int)blockSize; ++j) {
+            acc += (int)x[j] * x[j-i];
+        }
+        // smoothed update, by 1/8 like Whitening
+        _R[i] += (acc - _R[i]) >> 3;
+    }
+
+    ComputeCoefficients();
+    QuantizeCoefficients();
+
+    // calculate new output, the first _p samples need the last ones of the previous block
+    const int p = _p;
+    const short* aq = _aq;
+    const int shift = _Shift;
+    int rounding = (1 << shift) >> 1;
+    int head = blockSize < p ? blockSize : p;
+    for (i = 0; i < head; ++i) {
+        int acc = (int)x[i] << shift;
+        for (j = i+1; j <= p; ++j) {
+            acc -= aq[p-j]*_Xo[p + i-j];
+        }
+        for (j = 1; j <= i; ++j) {
+            acc -= aq[p-j]*x[i-j];
+        }
+        acc = (acc + rounding) >> shift;
+        _whitened[i+start] = (short)(acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc);
+    }
+    // the rest is a dot product of _aq with the preceding samples, which vectorizes
+    for (; i < (int)blockSize; ++i) {
+        const short* h = x + i - p;
+        int acc = 0;
+        for (j = 0; j < p; ++j) {
+            acc += aq[j]*h[j];
+        }
+        acc = (((int)x[i] << shift) - acc + rounding) >> shift;
+        _whitened[i+start] = (short)(acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc);
+    }
+    // save last few frames of input
+    for (i = 0; i <= p; ++i) {
+        _Xo[i] = x[blockSize-1-p+i];
+    }
+}
@@ -9,33 +9,79 @@
 #include "Common.h"
 #include "Params.h"
 #include "MatrixUtility.h"
+#include <stdint.h>
 
 
 class AudioStreamInput;
 
-class Whitening {
+// What both whitening filters share: they go through the samples in blocks, every block updates the
+// smoothed autocorrelation of the samples, the prediction filter is derived from it by Durbin's recursion
+// and the block is filtered with the new coefficients.
+class WhiteningFilter {
 public:
-    inline Whitening() {};
+    WhiteningFilter(uint numSamples, const char* traceName) : _NumSamples(numSamples), _p(40), _TraceName(traceName) {}
+    virtual ~WhiteningFilter() {}
+    void Compute();
+    virtual void ComputeBlock(int start, int blockSize) = 0;
+
+public:
+    inline uint getNumSamples() const {return _NumSamples;}
+
+protected:
+    uint _NumSamples;
+    int _p;
+private:
+    const char* _TraceName;
+};
+
+class Whitening : public WhiteningFilter {
+public:
+    inline Whitening() : WhiteningFilter(0, "Whitening::Compute") {};
     Whitening(AudioStreamInput* pAudio);
     Whitening(const float* pSamples, uint numSamples);
     virtual ~Whitening();
-    void Compute();
     void ComputeBlock(int start, int blockSize);
 
 public:
     float* getWhitenedSamples() const {return _whitened;}
-    inline uint getNumSamples() const {return _NumSamples;}
 
 protected:
     const float* _pSamples;
     float* _whitened;
-    uint _NumSamples;
     float* _R;
     float *_Xo;
     float *_ai;
-    int _p;
 private:
     void Init();
 };
 
+// The same filter on 16-bit samples, in integers throughout: the autocorrelation is summed exactly and smoothed
+// in 64 bits, Durbin's recursion runs on it normalized to Q30 with Q24 coefficients, and the samples are filtered
+// with the coefficients rounded to 16 bits (as many fractional bits as the 32-bit sums allow).
+class FixedWhitening : public WhiteningFilter {
+public:
+    FixedWhitening(const short* pSamples, uint numSamples);
+    virtual ~FixedWhitening();
+    void ComputeBlock(int start, int blockSize);
+
+public:
+    const short* getWhitenedSamples() const {return _whitened;}
+
+protected:
+    void ComputeCoefficients();
+    void QuantizeCoefficients();
+    const short* _pSamples;
+    short* _whitened;
+    // in units of 2^-30 (the products of two 1.15 samples)
+    int64_t* _R;
+    // Q24
+    int64_t* _ai;
+    int64_t* _Next;
+    // _ai with _Shift fractional bits in reverse order (_aq[k] is the coefficient of the sample _p - k before),
+    // so the filter is a plain dot product with the samples
+    short* _aq;
+    int _Shift;
+    short* _Xo;
+};
+
 #endif
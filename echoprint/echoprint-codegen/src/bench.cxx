@@ -0,0 +1,347 @@
+//
+//  echoprint-codegen
+//
+
+
+// Offline, reproducible benchmark of fingerprint throughput and match quality.
+//
+// Synthesizes a corpus of "songs" (sequences of tones, noise bursts and chirps with sharp onsets),
+// derives variants of each of them (gain change, re-encoding-like filtering plus noise, time offset,
+// truncation and all of these combined), fingerprints everything with Codegen and scores every variant
+// against every original exactly like echoprint_compare does (on sorted, unique codes like the tool sends).
+// Reports files/s, codes/s and precision/recall at several score thresholds.
+//
+// With "fixed" the same corpus (as 16-bit samples) also goes through the fixed point pipeline, which is scored
+// on its own, against the originals fingerprinted by the floating point one (a database built with it), and by
+// how much of the codes of every file both agree on.
+//
+//     echoprint-bench [songs] [seconds] [seed] [float|fixed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "Codegen.h"
+#include "Common.h"
+#include "Params.h"
+#include "Base64.h"
+
+using std::string;
+using std::vector;
+
+#define SAMPLE_RATE ((uint)Params::AudioStreamInput::SamplingRate)
+
+static const float thresholds[] = {0.01f, 0.02f, 0.05f, 0.1f, 0.15f, 0.2f, 0.3f};
+
+enum VariantType { VARIANT_GAIN, VARIANT_FILTERED, VARIANT_OFFSET, VARIANT_TRUNCATED, VARIANT_ALL, VARIANT_TYPES };
+static const char* variantNames[VARIANT_TYPES] = {"gain", "filtered", "offset", "truncated", "all"};
+
+// xorshift64*, so corpora are identical on every platform
+class Random {
+public:
+    Random(uint64_t seed) : _State(seed * 0x9e3779b97f4a7c15ULL + 1) { }
+    uint64_t next() {
+        _State ^= _State >> 12;
+        _State ^= _State << 25;
+        _State ^= _State >> 27;
+        return _State * 0x2545f4914f6cdd1dULL;
+    }
+    // [0, 1)
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+private:
+    uint64_t _State;
+};
+
+typedef struct {
+    int song;
+    int type;       // VariantType, or -1 for an original
+    vector<float> pcm;
+    vector<uint> codes;
+    // of the fixed point pipeline
+    vector<short> fixedPcm;
+    vector<uint> fixedCodes;
+} bench_file_t;
+
+static vector<float> synthesize_song(Random& rnd, uint seconds) {
+    uint n = seconds * SAMPLE_RATE;
+    vector<float> pcm(n, 0.0f);
+
+    for (double t = 0; t < seconds; ) {
+        double duration = rnd.uniform(0.08, 0.5);
+        double kind = rnd.uniform();
+        double amplitude = rnd.uniform(0.1, 0.5);
+        // log uniform between 110 and 1760 Hz
+        double f0 = 110.0 * pow(2.0, rnd.uniform(0, 4));
+        double f1 = 110.0 * pow(2.0, rnd.uniform(0, 4));
+        double lowpass = rnd.uniform(0.05, 0.6);
+        double decay = rnd.uniform(4, 20);
+        double phase = 0, noise = 0;
+
+        uint start = (uint)(t * SAMPLE_RATE);
+        uint end = std::min(n, (uint)((t + duration) * SAMPLE_RATE));
+        for (uint i = start; i < end; i++) {
+            double x = (i - start) / (double)SAMPLE_RATE;
+            // 5ms attack, exponential decay
+            double envelope = std::min(1.0, x / 0.005) * exp(-decay * x);
+            double sample;
+            if (kind < 0.5) {
+                // tone with a few harmonics
+                phase += 2 * M_PI * f0 / SAMPLE_RATE;
+                sample = sin(phase) + 0.5 * sin(2 * phase) + 0.25 * sin(3 * phase);
+            } else if (kind < 0.8) {
+                // linear chirp from f0 to f1
+                phase += 2 * M_PI * (f0 + (f1 - f0) * (x / duration)) / SAMPLE_RATE;
+                sample = sin(phase);
+            } else {
+                // low passed noise burst
+                noise += lowpass * (rnd.uniform(-1, 1) - noise);
+                sample = 3 * noise;
+            }
+            pcm[i] += (float)(amplitude * envelope * sample);
+        }
+        t += duration * rnd.uniform(0.5, 1.0);
+    }
+
+    float peak = 0;
+    for (uint i = 0; i < n; i++) peak = std::max(peak, fabsf(pcm[i]));
+    if (peak > 0) {
+        for (uint i = 0; i < n; i++) pcm[i] *= 0.9f / peak;
+    }
+    return pcm;
+}
+
+// one pole low pass (around 2.5kHz) plus white noise at about -40dB, roughly what a lossy re-encode does
+static void degrade(vector<float>& pcm, Random& rnd) {
+    float state = 0;
+    for (uint i = 0; i < pcm.size(); i++) {
+        state += 0.75f * (pcm[i] - state);
+        pcm[i] = state + (float)rnd.uniform(-0.01, 0.01);
+    }
+}
+
+static vector<float> make_variant(const vector<float>& original, int type, Random& rnd) {
+    vector<float> pcm;
+    // offsets aren't a multiple of the analysis hop size
+    uint offset = (uint)(7.3 * SAMPLE_RATE);
+    switch (type) {
+    case VARIANT_GAIN:
+        pcm = original;
+        for (uint i = 0; i < pcm.size(); i++) pcm[i] *= 0.25f;
+        break;
+    case VARIANT_FILTERED:
+        pcm = original;
+        degrade(pcm, rnd);
+        break;
+    case VARIANT_OFFSET:
+        pcm.assign(original.begin() + std::min(offset, (uint)original.size()), original.end());
+        break;
+    case VARIANT_TRUNCATED:
+        pcm.assign(original.begin(), original.begin() + original.size() / 2);
+        break;
+    case VARIANT_ALL:
+        pcm.assign(original.begin() + std::min(offset, (uint)original.size()), original.end());
+        pcm.resize(pcm.size() * 2 / 3);
+        for (uint i = 0; i < pcm.size(); i++) pcm[i] *= 0.5f;
+        degrade(pcm, rnd);
+        break;
+    }
+    return pcm;
+}
+
+// the codes of a code string, sorted and unique like the tool sends them (see tool/src/main/codegen.ts)
+static vector<uint> decode_codes(const string& codeString) {
+    vector<uint> codes;
+    if (codeString.empty())
+        return codes;
+    string compressed = base64_decode(codeString);
+
+    string hex;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK)
+        return codes;
+    stream.next_in = (Bytef*)compressed.data();
+    stream.avail_in = compressed.size();
+    char buf[65536];
+    int ret;
+    do {
+        stream.next_out = (Bytef*)buf;
+        stream.avail_out = sizeof(buf);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        hex.append(buf, sizeof(buf) - stream.avail_out);
+    } while (ret == Z_OK);
+    inflateEnd(&stream);
+
+    // the first half holds the time offsets, the second half the codes, 5 hex digits each
+    for (size_t i = hex.size() / 2; i + 5 <= hex.size(); i += 5)
+        codes.push_back(strtoul(hex.substr(i, 5).c_str(), NULL, 16));
+    std::sort(codes.begin(), codes.end());
+    codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+    return codes;
+}
+
+// exactly what echoprint_compare (postgres_echoprint) computes
+static float echoprint_compare(const vector<uint>& left, const vector<uint>& right) {
+    int left_elemc = left.size(), right_elemc = right.size();
+    int i = 0, j = 0, num = 0;
+    while (i < left_elemc && j < right_elemc) {
+        if (left[i] == right[j]) {
+            num++; i++; j++;
+        } else if (left[i] < right[j]) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    float jaccard_score = num / (float)(left_elemc + right_elemc - num);
+    return jaccard_score;
+}
+
+// every variant against every original, only its own original is a match
+static void report_matches(const vector<bench_file_t>& files, int numSongs, bool fixedQueries, bool fixedOriginals) {
+    vector<uint> originals;
+    for (uint i = 0; i < files.size(); i++) {
+        if (files[i].type < 0) originals.push_back(i);
+    }
+    uint numThresholds = NELEM(thresholds);
+    vector<uint> truePositives(numThresholds, 0), falsePositives(numThresholds, 0);
+    vector<vector<uint> > typeHits(VARIANT_TYPES, vector<uint>(numThresholds, 0));
+    vector<double> typeScore(VARIANT_TYPES, 0);
+    float maxNegative = 0;
+    uint positives = 0;
+
+    for (uint i = 0; i < files.size(); i++) {
+        if (files[i].type < 0) continue;
+        positives++;
+        for (uint o = 0; o < originals.size(); o++) {
+            const bench_file_t& original = files[originals[o]];
+            float score = echoprint_compare(fixedQueries ? files[i].fixedCodes : files[i].codes,
+                fixedOriginals ? original.fixedCodes : original.codes);
+            bool match = original.song == files[i].song;
+            if (match) typeScore[files[i].type] += score;
+            else maxNegative = std::max(maxNegative, score);
+            for (uint k = 0; k < numThresholds; k++) {
+                if (score < thresholds[k]) continue;
+                if (match) {
+                    truePositives[k]++;
+                    typeHits[files[i].type][k]++;
+                } else {
+                    falsePositives[k]++;
+                }
+            }
+        }
+    }
+
+    printf("threshold  precision  recall");
+    for (int type = 0; type < VARIANT_TYPES; type++) printf("  %9s", variantNames[type]);
+    printf("\n");
+    for (uint k = 0; k < numThresholds; k++) {
+        uint reported = truePositives[k] + falsePositives[k];
+        printf("%9.2f  %9.4f  %6.4f", thresholds[k],
+            reported ? truePositives[k] / (double)reported : 1.0, truePositives[k] / (double)positives);
+        for (int type = 0; type < VARIANT_TYPES; type++)
+            printf("  %9.4f", typeHits[type][k] / (double)numSongs);
+        printf("\n");
+    }
+    printf("\nmean score of matches:");
+    for (int type = 0; type < VARIANT_TYPES; type++)
+        printf(" %s %.4f", variantNames[type], typeScore[type] / numSongs);
+    printf("\nhighest score of a non-match: %.4f\n", maxNegative);
+}
+
+int main(int argc, char** argv) {
+    int numSongs = argc > 1 ? atoi(argv[1]) : 20;
+    int seconds = argc > 2 ? atoi(argv[2]) : 30;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    bool fixedPoint = argc > 4 && strcmp(argv[4], "fixed") == 0;
+    if (numSongs < 2 || seconds < 10 || (argc > 4 && !fixedPoint && strcmp(argv[4], "float") != 0)) {
+        fprintf(stderr, "Usage: %s [songs (>= 2)] [seconds (>= 10)] [seed] [float|fixed]\n", argv[0]);
+        exit(-1);
+    }
+
+    Random rnd(seed);
+    vector<bench_file_t> files;
+    for (int s = 0; s < numSongs; s++) {
+        bench_file_t original;
+        original.song = s;
+        original.type = -1;
+        original.pcm = synthesize_song(rnd, seconds);
+        uint originalIndex = files.size();
+        files.push_back(original);
+        for (int type = 0; type < VARIANT_TYPES; type++) {
+            bench_file_t variant;
+            variant.song = s;
+            variant.type = type;
+            variant.pcm = make_variant(files[originalIndex].pcm, type, rnd);
+            files.push_back(variant);
+        }
+    }
+
+    // both pipelines get the same 16-bit samples, like from a decoder
+    if (fixedPoint) {
+        for (uint i = 0; i < files.size(); i++) {
+            vector<float>& pcm = files[i].pcm;
+            files[i].fixedPcm.resize(pcm.size());
+            for (uint j = 0; j < pcm.size(); j++) {
+                float sample = std::max(-32768.0f, std::min(32767.0f, rintf(pcm[j] * 32768.0f)));
+                files[i].fixedPcm[j] = (short)sample;
+                pcm[j] = sample / 32768.0f;
+            }
+        }
+    }
+
+    // throughput, the synthesis isn't part of it
+    double audioSeconds = 0;
+    unsigned long long numCodes = 0;
+    double t = now();
+    for (uint i = 0; i < files.size(); i++) {
+        Codegen codegen(files[i].pcm.data(), files[i].pcm.size(), 0);
+        files[i].codes = decode_codes(codegen.getCodeString());
+        numCodes += codegen.getNumCodes();
+        audioSeconds += files[i].pcm.size() / (double)SAMPLE_RATE;
+    }
+    t = now() - t;
+
+    printf("corpus: %d songs of %ds, %d variants each, seed %llu\n",
+        numSongs, seconds, VARIANT_TYPES, (unsigned long long)seed);
+    printf("codegen: %u files (%.0fs of audio) in %.3fs\n", (uint)files.size(), audioSeconds, t);
+    printf("  %.2f files/s, %.0f codes/s, %.1fx realtime\n\n", files.size() / t, numCodes / t, audioSeconds / t);
+
+    report_matches(files, numSongs, false, false);
+    if (!fixedPoint)
+        return 0;
+
+    numCodes = 0;
+    t = now();
+    for (uint i = 0; i < files.size(); i++) {
+        Codegen codegen(files[i].fixedPcm.data(), files[i].fixedPcm.size(), 0);
+        files[i].fixedCodes = decode_codes(codegen.getCodeString());
+        numCodes += codegen.getNumCodes();
+    }
+    t = now() - t;
+
+    printf("\nfixed point codegen: %u files (%.0fs of audio) in %.3fs\n", (uint)files.size(), audioSeconds, t);
+    printf("  %.2f files/s, %.0f codes/s, %.1fx realtime\n\n", files.size() / t, numCodes / t, audioSeconds / t);
+    report_matches(files, numSongs, true, true);
+
+    printf("\nfixed point variants against floating point originals:\n");
+    report_matches(files, numSongs, true, false);
+
+    // the score of a file's fixed point codes against its floating point ones
+    double agreement = 0;
+    float lowest = 1;
+    for (uint i = 0; i < files.size(); i++) {
+        float score = echoprint_compare(files[i].fixedCodes, files[i].codes);
+        agreement += score;
+        lowest = std::min(lowest, score);
+    }
+    printf("\nagreement with the floating point codes: mean %.4f, lowest %.4f\n", agreement / files.size(), lowest);
+    return 0;
+}
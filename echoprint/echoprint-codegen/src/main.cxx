@@ -16,34 +16,78 @@
 
 #include "AudioStreamInput.h"
 #include "Codegen.h"
+#include "FingerprintCache.h"
+#include "SimilarityJoin.h"
+#ifndef _WIN32
+    #include "DirectoryScanner.h"
+#endif
+#include "Pipeline.h"
+#include "Trace.h"
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <string>
-#define MAX_FILES 200000
+#include <sstream>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
 // The response from the codegen. Contains all the fields necessary
 // to create a json string.
 typedef struct {
-    char *error;
-    char *filename;
+    const char *error;
+    char *filename;         // owned by the response
     int start_offset;
     int duration;
     int tag;
     double t1;
     double t2;
     int numSamples;
+    AudioQuality quality;
     Codegen* codegen;
 } codegen_response_t;
 
-// Struct to pass to the worker threads
+// A file on its way through the codegen: decode_file either answers it right away (from the cache or with
+// an error), or hands over the decoded audio, which fingerprint_decoded turns into the response.
 typedef struct {
-    char *filename;
-    int start_offset;
-    int duration;
-    int tag;
-    int done;
     codegen_response_t *response;
-} thread_parm_t;
+    FfmpegStreamInput *audio;
+    CacheKey key;
+} decoded_file_t;
+
+// Settings of the batch pipeline, see codegen_batch
+typedef struct {
+    int decoders;       // files decoded at the same time
+    int workers;        // files fingerprinted at the same time
+    int prefetch;       // files read ahead of the decoders
+    size_t memory;      // bytes of decoded audio waiting for or in the DSP stage
+} pipeline_parm_t;
+
+// The files to process: the one given on the command line, the ones found below a directory (-r), or (-s) one
+// per line on stdin. The list is read as far as the files are needed, so neither memory nor startup depend on
+// its length.
+typedef struct {
+    const char *filename;   // NULL to read stdin
+    bool done;
+    string line;
+    vector<string> *found;  // if not NULL, the files of the directory
+    size_t next;
+} file_list_t;
+
+// A file of the list and its position within it
+typedef struct {
+    int tag;
+    char *filename;
+} listed_file_t;
+
+// Writes the responses as they come, as the elements of a json array or (-n) as newline delimited json, one
+// object per line. Every record is built in the same buffer, which only grows to the longest one.
+typedef struct {
+    bool ndjson;
+    int written;
+    string buffer;
+    vector<bool> coded;     // by tag, whether the file produced codes
+} json_writer_t;
 
 // Thank you http://stackoverflow.com/questions/150355/programmatically-find-the-number-of-cores-on-a-machine
 #ifdef _WIN32
@@ -80,12 +124,9 @@ int getNumCores() {
 }
 
 // deal with quotes etc in json
-std::string escape(const string& value) {
-    std::string s(value);
-    std::string out = "";
-    out.reserve(s.size());
-    for (size_t i = 0; i < s.size(); i++) {
-        char c = s[i];
+void append_escaped(string& out, const char* value) {
+    for (const char* p = value; *p; p++) {
+        char c = *p;
         if ((unsigned char)c < 31)
             continue;
 
@@ -103,151 +144,545 @@ std::string escape(const string& value) {
                 // TODO: do something with unicode?
         }
     }
+}
+
+// the cache may be shared by the threads of a batch
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// runs the fixed point pipeline on the 16-bit samples instead of converting them to floats (see -p)
+#ifdef ECHOPRINT_FIXED_POINT
+static bool fixed_point = true;
+#else
+static bool fixed_point = false;
+#endif
 
-    return out;
+static size_t decoded_size(const decoded_file_t& decoded) {
+    return decoded.response->numSamples * (fixed_point ? sizeof(short) : sizeof(float));
 }
 
-codegen_response_t *codegen_file(char* filename, int start_offset, int duration, int tag) {
-    // Given a filename, perform a codegen on it and get the response
-    // This is called by a thread
+// The decoded audio a file is expected to take before it's decoded: the given duration, unless the length
+// of the file at a typical bitrate (lossy 128 kbps, lossless that of a CD or half of it for flac) is shorter.
+static size_t estimated_size(const char* filename, int start_offset, int duration) {
+    struct stat st;
+    double seconds = duration;
+    if (stat(filename, &st) == 0) {
+        double bitrate = 128000;
+        if (File::ends_with(filename, ".wav") || File::ends_with(filename, ".aif")
+                || File::ends_with(filename, ".aiff") || File::ends_with(filename, ".au"))
+            bitrate = 1411200;
+        else if (File::ends_with(filename, ".flac"))
+            bitrate = 705600;
+        double length = std::max(st.st_size * 8 / bitrate - start_offset, 0.0);
+        if (duration <= 0 || length < duration) seconds = length;
+    }
+    return (size_t)(seconds * Params::AudioStreamInput::SamplingRate) * (fixed_point ? sizeof(short) : sizeof(float));
+}
+
+// With a budget the decoded audio is accounted for before it's decoded (by the estimate, corrected once it's
+// known), so decoders wait while the DSP is behind instead of decoding more and only then finding out.
+decoded_file_t decode_file(char* filename, int start_offset, int duration, int tag, FingerprintCache* pCache,
+                           Budget* pMemory) {
+    TraceSpan span("decode", filename);
     double t1 = now();
-    codegen_response_t *response = (codegen_response_t *)malloc(sizeof(codegen_response_t));
+    decoded_file_t decoded;
+    decoded.audio = NULL;
+    decoded.key = 0;
+    codegen_response_t *response = decoded.response = (codegen_response_t *)malloc(sizeof(codegen_response_t));
     response->error = NULL;
     response->codegen = NULL;
+    response->quality = AudioQuality();
+    response->t1 = 0;
+    response->t2 = 0;
+    response->numSamples = 0;
+    response->start_offset = start_offset;
+    response->duration = duration;
+    response->tag = tag;
+    response->filename = filename;
+
+    // unchanged audio (tags don't count) is neither decoded nor fingerprinted again. The payload is only
+    // digested if the file changed since it was last seen, otherwise its key is known from a stat
+    CacheKey fileKey;
+    bool known = false;
+    if (pCache != NULL && FingerprintCache::ComputeFileKey(filename, start_offset, duration, fixed_point, fileKey)) {
+        pthread_mutex_lock(&cache_lock);
+        known = pCache->LookupPayloadKey(fileKey, decoded.key);
+        pthread_mutex_unlock(&cache_lock);
+        if (!known && !FingerprintCache::ComputeKey(filename, start_offset, duration, fixed_point, decoded.key))
+            decoded.key = 0;
+    }
+    if (decoded.key != 0) {
+        string codeString;
+        int numCodes;
+        pthread_mutex_lock(&cache_lock);
+        if (!known) pCache->InsertPayloadKey(fileKey, decoded.key);
+        bool found = pCache->Lookup(decoded.key, codeString, numCodes, response->quality);
+        pthread_mutex_unlock(&cache_lock);
+        if (found) {
+            response->t1 = now() - t1;
+            response->codegen = new Codegen(codeString, numCodes);
+            return decoded;
+        }
+    }
 
-    auto_ptr<FfmpegStreamInput> pAudio(new FfmpegStreamInput());
+    size_t estimate = 0;
+    if (pMemory != NULL) {
+        estimate = estimated_size(filename, start_offset, duration);
+        pMemory->Acquire(estimate);
+    }
+    unique_ptr<FfmpegStreamInput> pAudio(new FfmpegStreamInput());
+    pAudio->SetFixedPoint(fixed_point);
     pAudio->ProcessFile(filename, start_offset, duration);
 
-    if (pAudio.get() == NULL) { // Unable to decode!
-        char* output = (char*) malloc(16384);
-        sprintf(output,"{\"error\":\"could not create decoder\", \"tag\":%d, \"metadata\":{\"filename\":\"%s\"}}",
-            tag,
-            escape(filename).c_str());
-        response->error = output;
-        return response;
+    if (pAudio->getNumSamples() < 1) {
+        if (pMemory != NULL) pMemory->Release(estimate);
+        response->error = "could not decode";
+        return decoded;
     }
+    response->t1 = now() - t1;
+    response->numSamples = pAudio->getNumSamples();
 
-    int numSamples = pAudio->getNumSamples();
+    // the average bitrate is only known if the whole file was decoded
+    response->quality = pAudio->getQuality();
+    uint64_t payloadLength;
+    if (start_offset == 0 && duration == 0 && FingerprintCache::PayloadLength(filename, payloadLength))
+        response->quality.bitrate = (uint)(payloadLength * 8 / pAudio->getDuration() / 1000 + 0.5);
 
-    if (numSamples < 1) {
-        char* output = (char*) malloc(16384);
-        sprintf(output,"{\"error\":\"could not decode\", \"tag\":%d, \"metadata\":{\"filename\":\"%s\"}}",
-            tag,
-            escape(filename).c_str());
-        response->error = output;
-        return response;
-    }
-    t1 = now() - t1;
+    if (pMemory != NULL) pMemory->Resize(estimate, decoded_size(decoded));
 
+    decoded.audio = pAudio.release();
+    return decoded;
+}
+
+// runs the DSP on the decoded audio and frees it
+codegen_response_t *fingerprint_decoded(decoded_file_t& decoded, FingerprintCache* pCache) {
+    codegen_response_t *response = decoded.response;
+    TraceSpan span("fingerprint", response->filename);
     double t2 = now();
-    Codegen *pCodegen = new Codegen(pAudio->getSamples(), numSamples, start_offset);
+    Codegen *pCodegen = fixed_point
+        ? new Codegen(decoded.audio->getShortSamples(), response->numSamples, response->start_offset)
+        : new Codegen(decoded.audio->getSamples(), response->numSamples, response->start_offset);
     t2 = now() - t2;
-    
-    response->t1 = t1;
+    delete decoded.audio, decoded.audio = NULL;
+    if (decoded.key != 0) {
+        pthread_mutex_lock(&cache_lock);
+        pCache->Insert(decoded.key, pCodegen->getCodeString(), pCodegen->getNumCodes(), response->quality);
+        pthread_mutex_unlock(&cache_lock);
+    }
+
     response->t2 = t2;
-    response->numSamples = numSamples;
     response->codegen = pCodegen;
-    response->start_offset = start_offset;
-    response->duration = duration;
-    response->tag = tag;
-    response->filename = filename;
-    
     return response;
 }
 
-
-void *threaded_codegen_file(void *parm) {
-    // pthread stub to invoke json_string_for_file
-    thread_parm_t *p = (thread_parm_t *)parm;
-    codegen_response_t *response = codegen_file(p->filename, p->start_offset, p->duration, p->tag);
-    p->response = response;
-    // mark when we're done so the controlling thread can move on.
-    p->done = 1;
-    return NULL;
-}
-
-void print_json_to_screen(char* output, int count, int done) {
-    // Print a json block depending on how many there are and where we are.
-    if(done==1 && count>1) {
-        printf("[\n%s,\n", output);
-    } else if(done==1 && count == 1) {
-        printf("[\n%s\n]\n", output);
-    } else if(done == count) {
-        printf("%s\n]\n", output);
-    } else {
-        printf("%s,\n", output);
-    }
+codegen_response_t *codegen_file(char* filename, int start_offset, int duration, int tag, FingerprintCache* pCache) {
+    // Given a filename, perform a codegen on it and get the response
+    decoded_file_t decoded = decode_file(filename, start_offset, duration, tag, pCache, NULL);
+    return decoded.audio != NULL ? fingerprint_decoded(decoded, pCache) : decoded.response;
 }
 
-char *make_json_string(codegen_response_t* response) {
-    
+// appends the json of the response to out
+void make_json_string(codegen_response_t* response, string& out) {
+    char fields[512];
     if (response->error != NULL) {
-        return response->error;
+        snprintf(fields, sizeof(fields), "{\"error\":\"%s\", \"tag\":%d, \"metadata\":{\"filename\":\"",
+            response->error, response->tag);
+        out += fields;
+        append_escaped(out, response->filename);
+        out += "\"}}";
+        return;
     }
 
-    // preamble + codelen
-    char* output = (char*) malloc(sizeof(char)*(16384 + strlen(response->codegen->getCodeString().c_str()) ));
-
-    sprintf(output,"{\"metadata\":{\"filename\":\"%s\", \"samples_decoded\":%d, \"given_duration\":%d,"
-                    " \"start_offset\":%d, \"version\":%2.2f, \"codegen_time\":%2.6f, \"decode_time\":%2.6f}, \"code_count\":%d,"
-                    " \"code\":\"%s\", \"tag\":%d}",
-        escape(response->filename).c_str(),
+    out += "{\"metadata\":{\"filename\":\"";
+    append_escaped(out, response->filename);
+    snprintf(fields, sizeof(fields), "\", \"samples_decoded\":%d, \"given_duration\":%d,"
+                    " \"start_offset\":%d, \"version\":%2.2f, \"codegen_time\":%2.6f, \"decode_time\":%2.6f},"
+                    " \"quality\":{\"sample_rate\":%u, \"bitrate\":%u, \"bandwidth\":%u, \"clipped_samples\":%u},"
+                    " \"code_count\":%d, \"code\":\"",
         response->numSamples,
         response->duration,
         response->start_offset,
         response->codegen->getVersion(),
         response->t2,
         response->t1,
-        response->codegen->getNumCodes(),
-        response->codegen->getCodeString().c_str(),
-        response->tag
+        response->quality.sampleRate,
+        response->quality.bitrate,
+        response->quality.bandwidth,
+        response->quality.clippedSamples,
+        response->codegen->getNumCodes()
     );
-    return output;
+    out += fields;
+    out += response->codegen->getCodeString();
+    snprintf(fields, sizeof(fields), "\", \"tag\":%d}", response->tag);
+    out += fields;
+}
+
+void print_response(json_writer_t& writer, codegen_response_t* response) {
+    string& out = writer.buffer;
+    out.clear();
+    if (!writer.ndjson)
+        out += writer.written == 0 ? "[\n" : ",\n";
+    make_json_string(response, out);
+    if (writer.ndjson)
+        out += '\n';
+    fwrite(out.data(), 1, out.size(), stdout);
+    // whoever reads line by line gets each record as soon as it's done
+    if (writer.ndjson)
+        fflush(stdout);
+    writer.written++;
+    if ((int)writer.coded.size() <= response->tag)
+        writer.coded.resize(response->tag + 1);
+    writer.coded[response->tag] = response->error == NULL;
+
+    if (response->codegen) {
+        delete response->codegen;
+    }
+    free(response->filename);
+    free(response);
+}
+
+void finish_output(json_writer_t& writer) {
+    if (!writer.ndjson)
+        printf(writer.written > 0 ? "\n]\n" : "[]\n");
+}
+
+// the next file of the list (to be freed), or NULL at its end
+char *next_file(file_list_t& list) {
+    if (list.found != NULL) {
+        if (list.next == list.found->size()) return NULL;
+        return strdup((*list.found)[list.next++].c_str());
+    }
+    if (list.filename != NULL) {
+        if (list.done) return NULL;
+        list.done = true;
+        return strdup(list.filename);
+    }
+    while (getline(cin, list.line)) {
+        if (list.line.size() > 2)
+            return strdup(list.line.c_str());
+    }
+    return NULL;
+}
+
+// State shared by the stages of a batch:
+//   prefetch  reads the list and hints the kernel to read the next files, at most parm.prefetch ahead of the decoders
+//   decode    parm.decoders threads run ffmpeg (or answer from the cache)
+//   DSP       parm.workers threads compute the codes, at most parm.memory bytes of decoded audio are in flight
+//   output    the main thread prints the responses in the order of the files
+// so reading, decoding and the DSP of different files overlap, instead of every file going through all of them
+// before the next one starts. At most window files are between being read from the list and being printed, which
+// bounds the memory of a batch however long the list is.
+struct batch_t {
+    batch_t(file_list_t& files, int start_offset, int duration, FingerprintCache* cache, const pipeline_parm_t& parm) :
+        files(files), start_offset(start_offset), duration(duration), cache(cache), parm(parm),
+        window(parm.prefetch + 4 * (parm.decoders + parm.workers)),
+        prefetched(parm.prefetch), decoded(2 * parm.workers), done(window), memory(parm.memory), inFlight(window),
+        activeDecoders(parm.decoders), activeWorkers(parm.workers) {}
+
+    file_list_t& files;
+    int start_offset;
+    int duration;
+    FingerprintCache* cache;
+    pipeline_parm_t parm;
+    int window;
+    BoundedQueue<listed_file_t> prefetched;
+    BoundedQueue<decoded_file_t> decoded;
+    BoundedQueue<codegen_response_t*> done;
+    Budget memory;
+    Budget inFlight;
+    int activeDecoders;
+    int activeWorkers;
+};
+
+void *prefetch_files(void *parm) {
+    batch_t *batch = (batch_t *)parm;
+    Trace::SetThreadName("prefetch");
+    listed_file_t file;
+    for (file.tag = 0; (file.filename = next_file(batch->files)) != NULL; file.tag++) {
+        // waits here while the output is behind, instead of reading more of the list
+        batch->inFlight.Acquire(1);
+#ifdef POSIX_FADV_WILLNEED
+        int fd = open(file.filename, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+#endif
+        batch->prefetched.Push(file);
+    }
+    batch->prefetched.Close();
+    return NULL;
+}
+
+void *decode_files(void *parm) {
+    batch_t *batch = (batch_t *)parm;
+    Trace::SetThreadName("decoder");
+    listed_file_t file;
+    while (batch->prefetched.Pop(file)) {
+        // waits in there while the DSP is behind, instead of decoding more
+        decoded_file_t decoded = decode_file(file.filename, batch->start_offset, batch->duration, file.tag,
+                                             batch->cache, &batch->memory);
+        if (decoded.audio == NULL) {
+            batch->done.Push(decoded.response);
+            continue;
+        }
+        batch->decoded.Push(decoded);
+    }
+    if (__sync_sub_and_fetch(&batch->activeDecoders, 1) == 0)
+        batch->decoded.Close();
+    return NULL;
+}
+
+void *fingerprint_files(void *parm) {
+    batch_t *batch = (batch_t *)parm;
+    Trace::SetThreadName("DSP");
+    decoded_file_t decoded;
+    while (batch->decoded.Pop(decoded)) {
+        size_t size = decoded_size(decoded);
+        codegen_response_t *response = fingerprint_decoded(decoded, batch->cache);
+        batch->memory.Release(size);
+        batch->done.Push(response);
+    }
+    // the decoders are all done once the decoded queue is closed
+    if (__sync_sub_and_fetch(&batch->activeWorkers, 1) == 0)
+        batch->done.Close();
+    return NULL;
+}
+
+void codegen_batch(file_list_t& files, int start_offset, int duration, FingerprintCache* pCache,
+                   const pipeline_parm_t& parm, json_writer_t& writer) {
+    batch_t batch(files, start_offset, duration, pCache, parm);
+    vector<pthread_t> threads(1 + parm.decoders + parm.workers);
+    pthread_create(&threads[0], NULL, prefetch_files, &batch);
+    for (int t = 0; t < parm.decoders; t++)
+        pthread_create(&threads[1 + t], NULL, decode_files, &batch);
+    for (int t = 0; t < parm.workers; t++)
+        pthread_create(&threads[1 + parm.decoders + t], NULL, fingerprint_files, &batch);
+
+    // responses arrive in the order they're done, they're printed in the order of the files. Only the files
+    // within the window can be pending, so each has its own slot.
+    vector<codegen_response_t*> pending(batch.window, (codegen_response_t*)NULL);
+    codegen_response_t *response;
+    int printed = 0;
+    while (batch.done.Pop(response)) {
+        pending[response->tag % batch.window] = response;
+        for (int slot = printed % batch.window; pending[slot] != NULL; slot = printed % batch.window) {
+            print_response(writer, pending[slot]);
+            pending[slot] = NULL;
+            printed++;
+            batch.inFlight.Release(1);
+        }
+    }
+
+    for (size_t t = 0; t < threads.size(); t++)
+        pthread_join(threads[t], NULL);
+}
+
+#ifndef _WIN32
+// directories read at the same time, mostly waiting for the disk or the file server
+#define SCAN_THREADS 16
+
+// -r: the audio files below the directory, biggest first. With a manifest (-u) the ones it has seen unchanged
+// are left out, without opening them.
+vector<string> scan_directory(const char* directory, ScanManifest* pManifest, vector<ScannedFile>& scanned) {
+    double t = now();
+    DirectoryScanner scanner(SCAN_THREADS);
+    scanner.Scan(directory);
+    scanned = scanner.getFiles();
+
+    vector<string> found;
+    bool known = pManifest != NULL && pManifest->Load();
+    for (size_t i = 0; i < scanned.size(); i++) {
+        if (!known || !pManifest->Unchanged(scanned[i]))
+            found.push_back(scanned[i].path);
+    }
+    fprintf(stderr, "Found %u audio files in %u directories in %.2fs, %u new or changed\n",
+        (uint)scanned.size(), scanner.getNumDirectories(), now() - t, (uint)found.size());
+    return found;
+}
+#endif
+
+// Reads one fingerprint per line from stdin (decoded codes, separated by commas or spaces)
+// and prints all clusters of duplicates as a json array of arrays of line numbers (starting at 0).
+void list_duplicates(float threshold) {
+    vector<vector<uint> > fingerprints;
+    string line;
+    while (getline(cin, line)) {
+        vector<uint> codes;
+        for (size_t i = 0; i < line.size(); i++) {
+            if (line[i] == ',') line[i] = ' ';
+        }
+        istringstream in(line);
+        uint code;
+        while (in >> code) codes.push_back(code);
+        if (!in.eof()) throw std::runtime_error("Malformed fingerprint on stdin\n");
+        sort(codes.begin(), codes.end());
+        fingerprints.push_back(codes);
+    }
+
+    SimilarityJoin join(fingerprints, threshold);
+    join.Compute(getNumCores());
+    vector<vector<uint> > clusters = join.getClusters();
+
+    printf("[");
+    for (size_t i = 0; i < clusters.size(); i++) {
+        printf(i ? ",\n[" : "\n[");
+        for (size_t j = 0; j < clusters[i].size(); j++)
+            printf(j ? ",%u" : "%u", clusters[i][j]);
+        printf("]");
+    }
+    printf("\n]\n");
 }
 
 int main(int argc, char** argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s [ filename | -s ] [seconds_start] [seconds_duration] [< file_list (if -s is set)]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-c cache_dir] [-j decoders[,workers[,prefetch]]] [-m megabytes] [-n] [-p fixed|float] [-t trace.json] [-u manifest] [-z level] [ filename | -s | -r directory ] [seconds_start] [seconds_duration] [< file_list (if -s is set)]\n", argv[0]);
+        fprintf(stderr, "       %s -d threshold < fingerprint_list\n", argv[0]);
         exit(-1);
     }
 
     try {
-        string files[MAX_FILES];
-        char *filename = argv[1];
-        int count = 0;
+        unique_ptr<FingerprintCache> pCache;
+        pipeline_parm_t parm;
+        parm.decoders = parm.workers = getNumCores();
+        parm.prefetch = 0;
+        parm.memory = 256;
+        json_writer_t writer;
+        writer.ndjson = false;
+        writer.written = 0;
+        const char *manifest = NULL;
+        while (argc > 1 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-m") == 0
+                            || strcmp(argv[1], "-n") == 0 || strcmp(argv[1], "-u") == 0
+                            || strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-p") == 0
+                            || strcmp(argv[1], "-z") == 0)) {
+            if (strcmp(argv[1], "-n") == 0) {
+                // -n prints newline delimited json, one object per line, instead of a json array
+                writer.ndjson = true;
+                argv += 1;
+                argc -= 1;
+                continue;
+            }
+            if (argc < 4) throw std::runtime_error("No files given.\n");
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            // these builds have no pipeline, see below
+            if (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-m") == 0)
+                fprintf(stderr, "%s is ignored, this build goes through the files one after another\n", argv[1]);
+#endif
+            if (strcmp(argv[1], "-c") == 0) {
+                // -c keeps the generated codes in the given directory, keyed by the audio payload
+                pCache.reset(new FingerprintCache(argv[2]));
+                if (!pCache->IsOpen()) {
+                    fprintf(stderr, "Could not open cache %s, continuing without\n", argv[2]);
+                    pCache.reset();
+                }
+            } else if (strcmp(argv[1], "-t") == 0) {
+                // -t records a timeline of the run, written as Chrome trace-event JSON at exit
+                Trace::Enable(argv[2]);
+                Trace::SetThreadName("main");
+            } else if (strcmp(argv[1], "-p") == 0) {
+                // -p picks the pipeline, fixed point on 16-bit samples or floating point
+                if (strcmp(argv[2], "fixed") != 0 && strcmp(argv[2], "float") != 0)
+                    throw std::runtime_error("-p takes fixed or float\n");
+                fixed_point = strcmp(argv[2], "fixed") == 0;
+            } else if (strcmp(argv[1], "-z") == 0) {
+                // -z sets the zlib level of the code strings, 1 is the fastest
+                char *end;
+                long level = strtol(argv[2], &end, 10);
+                if (*end != '\0' || level < 0 || level > 9) throw std::runtime_error("-z takes a level from 0 to 9\n");
+                Codegen::setCompressionLevel((int)level);
+            } else if (strcmp(argv[1], "-u") == 0) {
+                // -u remembers the files found by -r, so the next run only hands on the new and changed ones
+                manifest = argv[2];
+            } else if (strcmp(argv[1], "-j") == 0) {
+                // -j sets how many files are decoded, fingerprinted and read ahead at the same time (-s only)
+                if (sscanf(argv[2], "%d,%d,%d", &parm.decoders, &parm.workers, &parm.prefetch) < 1
+                        || parm.decoders < 1 || parm.workers < 1 || parm.prefetch < 0)
+                    throw std::runtime_error("-j takes decoders[,workers[,prefetch]]\n");
+            } else {
+                // -m limits the decoded audio waiting for the DSP (-s only)
+                int megabytes = atoi(argv[2]);
+                if (megabytes < 1) throw std::runtime_error("-m takes megabytes\n");
+                parm.memory = megabytes;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        if (argc < 2) throw std::runtime_error("No files given.\n");
+        if (parm.prefetch == 0) parm.prefetch = 2 * parm.decoders;
+        parm.memory <<= 20;
+
+        // -d lists the duplicates within fingerprints given on stdin instead of generating codes
+        if (strcmp(argv[1], "-d") == 0) {
+            float threshold = argc > 2 ? atof(argv[2]) : 0;
+            if (threshold <= 0 || threshold > 1) throw std::runtime_error("Threshold has to be within (0, 1]\n");
+            list_duplicates(threshold);
+            return 0;
+        }
+
+        // If you give it -s, it means to read in a list of files from stdin.
+        file_list_t files;
+        files.filename = strcmp(argv[1], "-s") == 0 ? NULL : argv[1];
+        files.done = false;
+        files.found = NULL;
+        files.next = 0;
+
+        // -r walks the directory instead, handing on the audio files below it
+        const char *directory = NULL;
+        if (strcmp(argv[1], "-r") == 0) {
+            if (argc < 3) throw std::runtime_error("-r takes a directory\n");
+            directory = argv[2];
+            argv++;
+            argc--;
+        } else if (manifest != NULL) {
+            throw std::runtime_error("-u only works along with -r\n");
+        }
+#ifdef _WIN32
+        if (directory != NULL) throw std::runtime_error("-r isn't supported on Windows\n");
+#else
+        unique_ptr<ScanManifest> pManifest;
+        vector<ScannedFile> scanned;
+        vector<string> found;
+        if (directory != NULL) {
+            if (manifest != NULL) pManifest.reset(new ScanManifest(manifest));
+            found = scan_directory(directory, pManifest.get(), scanned);
+            files.filename = NULL;
+            files.found = &found;
+        }
+#endif
         int start_offset = 0;
         int duration = 0;
-        int already = 0;
         if (argc > 2) start_offset = atoi(argv[2]);
         if (argc > 3) duration = atoi(argv[3]);
-        if (argc > 4) already = atoi(argv[4]);
-        // If you give it -s, it means to read in a list of files from stdin.
-        if (strcmp(filename, "-s") == 0) {
-            while(cin) {
-                if (count < MAX_FILES) {
-                    string temp_str;
-                    getline(cin, temp_str);
-                    if (temp_str.size() > 2)
-                        files[count++] = temp_str;
-                } else {
-                    throw std::runtime_error("Too many files on stdin to process\n");
-                }
-            }
-        } else files[count++] = filename;
 
-        if(count == 0) throw std::runtime_error("No files given.\n");
-
-        // Threading doesn't work in windows yet.
-        for(int i=0;i<count;i++) {
-            codegen_response_t* response = codegen_file((char*)files[i].c_str(), start_offset, duration, i);
-            char *output = make_json_string(response);
-            print_json_to_screen(output, count, i+1);
-            if (response->codegen) {
-                delete response->codegen;
+        // Threading doesn't work in windows yet, and the emscripten build has to run ffmpeg from the main thread.
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+        char *filename;
+        for (int i = 0; (filename = next_file(files)) != NULL; i++)
+            print_response(writer, codegen_file(filename, start_offset, duration, i, pCache.get()));
+#else
+        if (files.filename != NULL)
+            print_response(writer, codegen_file(next_file(files), start_offset, duration, 0, pCache.get()));
+        else
+            codegen_batch(files, start_offset, duration, pCache.get(), parm, writer);
+#endif
+        // nothing new below a directory is fine
+        if (writer.written == 0 && directory == NULL) throw std::runtime_error("No files given.\n");
+        finish_output(writer);
+#ifndef _WIN32
+        // only once every file went through, an interrupted run hands on the same files again. Files which
+        // didn't produce codes are left out, so the next run tries them again.
+        if (pManifest.get() != NULL) {
+            vector<ScannedFile> coded;
+            // the files handed on are in the order they were scanned, their tags are their positions in found
+            for (size_t i = 0, tag = 0; i < scanned.size(); i++) {
+                bool handedOn = tag < found.size() && found[tag] == scanned[i].path;
+                if (!handedOn || (tag < writer.coded.size() && writer.coded[tag]))
+                    coded.push_back(scanned[i]);
+                if (handedOn) tag++;
             }
-            free(response);
-            free(output);
+            if (!pManifest->Save(coded))
+                fprintf(stderr, "Could not write manifest %s\n", manifest);
         }
+#endif
         return 0;
     }
     catch(std::runtime_error& ex) {
@@ -0,0 +1,7 @@
+// What this build of the module can do, so a host can tell without running it: appended to codegen.js
+// (see Dockerfile), it is a property of the factory. Modules built before it have none of these.
+// Whenever something changes how the module is driven, it gets a name here.
+//   cache         -c cache_dir
+//   trace         -t trace.json
+//   input_buffer  Module["input_buffer"], the contents of the file fed to ffmpeg through stdin
+EchoPrint["features"] = ["cache", "trace", "input_buffer"];
@@ -0,0 +1,218 @@
+//
+//  echoprint match-server
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "MatchIndex.h"
+
+using std::string;
+using std::vector;
+
+static size_t index_file_size(uint32_t nfingerprints, uint64_t npostings) {
+    return sizeof(IndexFileHeader)
+        + sizeof(uint64_t) * (INDEX_CODES + 1)
+        + (sizeof(int64_t) + sizeof(uint32_t)) * (size_t)nfingerprints
+        + sizeof(uint32_t) * npostings;
+}
+
+// parses a single line of the dump, "id\t{code,code,...}"
+static bool parse_dump_line(char* line, int64_t& id, vector<uint32_t>& codes) {
+    char* p = line;
+    char* end;
+    codes.clear();
+
+    id = strtoll(p, &end, 10);
+    if (end == p || *end != '\t') return false;
+    p = end + 1;
+    if (*p++ != '{') return false;
+    while (*p && *p != '}') {
+        long code = strtol(p, &end, 10);
+        if (end == p) return false;
+        codes.push_back((uint32_t)code);
+        p = end;
+        if (*p == ',') p++;
+    }
+    return *p == '}';
+}
+
+bool BuildIndexFile(const char* dumpFilename, const char* indexFilename, string& error) {
+    FILE* in = fopen(dumpFilename, "r");
+    if (!in) {
+        error = string("could not open ") + dumpFilename;
+        return false;
+    }
+
+    vector<int64_t> ids;
+    vector<uint32_t> sizes;
+    vector<uint32_t> codes;
+    vector<uint32_t> lineCodes;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t len;
+    uint64_t lineNo = 0;
+
+    while ((len = getline(&line, &lineCapacity, in)) > 0) {
+        int64_t id;
+        lineNo++;
+        if (line[len - 1] == '\n') line[--len] = 0;
+        if (len == 0) continue;
+        if (!parse_dump_line(line, id, lineCodes)) {
+            char message[128];
+            snprintf(message, sizeof(message), "malformed line %llu in dump", (unsigned long long)lineNo);
+            error = message;
+            free(line);
+            fclose(in);
+            return false;
+        }
+        ids.push_back(id);
+        sizes.push_back(lineCodes.size());
+        codes.insert(codes.end(), lineCodes.begin(), lineCodes.end());
+    }
+    free(line);
+    fclose(in);
+
+    // counting sort: count the postings of every code, then prefix sum to get the offsets
+    vector<uint64_t> offsets(INDEX_CODES + 1, 0);
+    for (size_t i = 0; i < codes.size(); i++) {
+        if (codes[i] < INDEX_CODES) offsets[codes[i] + 1]++;
+    }
+    for (uint32_t i = 0; i < INDEX_CODES; i++) offsets[i + 1] += offsets[i];
+
+    // fingerprints are visited in slot order, so every posting list ends up sorted
+    vector<uint32_t> postings(offsets[INDEX_CODES]);
+    vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t fp = 0, i = 0; fp < ids.size(); fp++) {
+        for (uint32_t k = 0; k < sizes[fp]; k++, i++) {
+            if (codes[i] < INDEX_CODES) postings[cursor[codes[i]]++] = fp;
+        }
+    }
+
+    IndexFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.nfingerprints = ids.size();
+    header.npostings = postings.size();
+
+    // write to a temporary file first, so a running server never sees a half written index
+    string tmpFilename = string(indexFilename) + ".tmp";
+    FILE* out = fopen(tmpFilename.c_str(), "wb");
+    if (!out) {
+        error = "could not create " + tmpFilename;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), out) == offsets.size()
+        && fwrite(ids.data(), sizeof(int64_t), ids.size(), out) == ids.size()
+        && fwrite(sizes.data(), sizeof(uint32_t), sizes.size(), out) == sizes.size()
+        && fwrite(postings.data(), sizeof(uint32_t), postings.size(), out) == postings.size();
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmpFilename.c_str(), indexFilename) != 0) {
+        unlink(tmpFilename.c_str());
+        error = string("could not write ") + indexFilename;
+        return false;
+    }
+    return true;
+}
+
+MatchIndex::MatchIndex() : _pMapping(NULL), _MappingSize(0), _pHeader(NULL),
+    _pOffsets(NULL), _pIds(NULL), _pSizes(NULL), _pPostings(NULL) { }
+
+MatchIndex::~MatchIndex() {
+    if (_pMapping != NULL)
+        munmap(_pMapping, _MappingSize);
+}
+
+bool MatchIndex::Open(const char* filename, string& error) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        error = string("could not open ") + filename;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexFileHeader)) {
+        close(fd);
+        error = string("not an index file: ") + filename;
+        return false;
+    }
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        error = string("could not map ") + filename;
+        return false;
+    }
+
+    const IndexFileHeader* header = (const IndexFileHeader*)mapping;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+            || index_file_size(header->nfingerprints, header->npostings) != (size_t)st.st_size) {
+        munmap(mapping, st.st_size);
+        error = string("not an index file: ") + filename;
+        return false;
+    }
+    // the offsets are needed for every single lookup, the rest is paged in on demand
+    madvise(mapping, sizeof(IndexFileHeader) + sizeof(uint64_t) * (INDEX_CODES + 1), MADV_WILLNEED);
+
+    _pMapping = mapping;
+    _MappingSize = st.st_size;
+    _pHeader = header;
+    _pOffsets = (const uint64_t*)(header + 1);
+    _pIds = (const int64_t*)(_pOffsets + INDEX_CODES + 1);
+    _pSizes = (const uint32_t*)(_pIds + header->nfingerprints);
+    _pPostings = _pSizes + header->nfingerprints;
+    return true;
+}
+
+void MatchIndex::Lookup(const vector<uint32_t>& query, uint32_t k, LookupState& state, vector<Match>& out) const {
+    out.clear();
+    if (state.counts.size() < _pHeader->nfingerprints)
+        state.counts.assign(_pHeader->nfingerprints, 0);
+    state.touched.clear();
+
+    // walk over the runs of equal codes in the query
+    for (size_t i = 0; i < query.size();) {
+        uint32_t code = query[i];
+        int run = 1;
+        while (i + run < query.size() && query[i + run] == code) run++;
+        i += run;
+        if (code >= INDEX_CODES) continue;
+
+        // the postings of a fingerprint are adjacent, count them and cap at the multiplicity of the query
+        uint64_t end = _pOffsets[code + 1];
+        for (uint64_t p = _pOffsets[code]; p < end;) {
+            uint32_t slot = _pPostings[p];
+            int n = 0;
+            while (p < end && _pPostings[p] == slot) { n++; p++; }
+            if (state.counts[slot] == 0)
+                state.touched.push_back(slot);
+            state.counts[slot] += std::min(n, run);
+        }
+    }
+
+    vector<std::pair<float, uint32_t> > scored;
+    scored.reserve(state.touched.size());
+    for (size_t i = 0; i < state.touched.size(); i++) {
+        uint32_t slot = state.touched[i];
+        scored.push_back(std::make_pair(jaccard_score(state.counts[slot], query.size(), _pSizes[slot]), slot));
+        state.counts[slot] = 0;
+    }
+
+    // best score first, lower id first on ties (the dump isn't necessarily sorted by id)
+    size_t n = std::min((size_t)k, scored.size());
+    const int64_t* ids = _pIds;
+    std::partial_sort(scored.begin(), scored.begin() + n, scored.end(),
+        [ids](const std::pair<float, uint32_t>& l, const std::pair<float, uint32_t>& r) {
+            return l.first != r.first ? l.first > r.first : ids[l.second] < ids[r.second];
+        });
+    for (size_t i = 0; i < n; i++) {
+        Match m = {_pIds[scored[i].second], scored[i].first};
+        out.push_back(m);
+    }
+}
@@ -0,0 +1,72 @@
+//
+//  echoprint match-server
+//
+
+
+#ifndef MATCHINDEX_H
+#define MATCHINDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// codegen emits 20 bit codes (HASH_BITMASK), anything outside is not indexed (but still counted)
+#define INDEX_CODES (1 << 20)
+#define INDEX_MAGIC "EPMATCH1"
+
+// On-disk layout of an index file. Everything is stored in host byte order and
+// 8 byte aligned, so the file can be used in place after mapping it:
+//   IndexFileHeader
+//   uint64_t offsets[INDEX_CODES + 1]  postings of code c are postings[offsets[c]..offsets[c + 1]]
+//   int64_t  ids[nfingerprints]        fingerprint.id for every slot
+//   uint32_t sizes[nfingerprints]      number of codes (including duplicates) for every slot
+//   uint32_t postings[npostings]       fingerprint slots, ascending within a code
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t nfingerprints;
+    uint32_t reserved;
+    uint64_t npostings;
+};
+
+struct Match {
+    int64_t id;
+    float score;
+};
+
+// Scores exactly like echoprint_compare (pg_echoprint) does:
+// jaccard = num / (left + right - num) where a code present m times in the query
+// and n times in a fingerprint matches min(m, n) times.
+inline float jaccard_score(int num, int left_elemc, int right_elemc) {
+    return num / (float)(left_elemc + right_elemc - num);
+}
+
+// Builds an index file from a dump of the fingerprint table (COPY text format: "id\t{code,code,...}").
+bool BuildIndexFile(const char* dumpFilename, const char* indexFilename, std::string& error);
+
+// A read-only, memory mapped index file. Lookups are thread safe as long as
+// every thread uses its own LookupState.
+class MatchIndex {
+public:
+    struct LookupState {
+        std::vector<int32_t> counts;
+        std::vector<uint32_t> touched;
+    };
+
+    MatchIndex();
+    ~MatchIndex();
+    bool Open(const char* filename, std::string& error);
+    uint32_t getNumFingerprints() const { return _pHeader->nfingerprints; }
+    uint64_t getNumPostings() const { return _pHeader->npostings; }
+    // the query has to be sorted ascending
+    void Lookup(const std::vector<uint32_t>& query, uint32_t k, LookupState& state, std::vector<Match>& out) const;
+private:
+    void* _pMapping;
+    size_t _MappingSize;
+    const IndexFileHeader* _pHeader;
+    const uint64_t* _pOffsets;
+    const int64_t* _pIds;
+    const uint32_t* _pSizes;
+    const uint32_t* _pPostings;
+};
+
+#endif
@@ -0,0 +1,25 @@
+//
+//  echoprint match-server
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "MatchIndex.h"
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s dump_file index_file\n", argv[0]);
+        fprintf(stderr, "  where dump_file is created by: \\copy fingerprint(id, hash) TO 'dump_file'\n");
+        exit(-1);
+    }
+
+    std::string error;
+    if (!BuildIndexFile(argv[1], argv[2], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    return 0;
+}
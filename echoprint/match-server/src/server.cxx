@@ -0,0 +1,300 @@
+//
+//  echoprint match-server
+//
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "MatchIndex.h"
+
+using std::string;
+using std::vector;
+
+#define MAX_K 1000
+#define DEFAULT_K 15
+// longest request line (a whole song is a few hundred KB of codes), a client sending a longer one is dropped
+#define MAX_REQUEST_LINE (4 << 20)
+#define MAX_EVENTS 64
+
+// A client connection, only ever touched with the server locked. Its requests are answered one after
+// another, so the answers come in the order of the requests.
+typedef struct {
+    int fd;
+    string input;       // received, not yet handed to a worker
+    string output;      // answers not written yet
+    bool busy;          // a request of it is queued or being looked up
+    bool eof;           // the client sent everything, the connection is closed once it's all answered
+    bool closed;        // freed by the worker if it's busy, by the event loop otherwise
+} connection_t;
+
+typedef struct {
+    connection_t* connection;
+    string line;
+} request_t;
+
+// The event loop (main thread) reads from all connections and queues every complete request line,
+// the workers look them up and write the answers. No thread waits for a client.
+typedef struct {
+    const MatchIndex* index;
+    int epollFd;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    std::deque<request_t> requests;
+} server_t;
+
+// Parses a request line "<k> <code>,<code>,..." (k is optional).
+static bool parse_request(const string& line, uint32_t& k, vector<uint32_t>& query) {
+    const char* p = line.c_str();
+    char* end;
+    query.clear();
+    k = DEFAULT_K;
+
+    const char* space = strchr(p, ' ');
+    if (space) {
+        long val = strtol(p, &end, 10);
+        if (end != space || val < 1) return false;
+        k = std::min(val, (long)MAX_K);
+        p = space + 1;
+    }
+    while (*p) {
+        long code = strtol(p, &end, 10);
+        if (end == p) return false;
+        query.push_back((uint32_t)code);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return false;
+    }
+    // echoprint_compare expects sorted input, be forgiving here
+    std::sort(query.begin(), query.end());
+    return true;
+}
+
+// Answers a request line by one "<id> <score>" line per match, followed by an empty line.
+static void answer(string& line, const MatchIndex* index, MatchIndex::LookupState& state, string& response) {
+    vector<uint32_t> query;
+    vector<Match> matches;
+    uint32_t k;
+    if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+
+    if (!parse_request(line, k, query)) {
+        response += "ERROR malformed request\n\n";
+        return;
+    }
+    index->Lookup(query, k, state, matches);
+    for (size_t i = 0; i < matches.size(); i++) {
+        char out[64];
+        int n = snprintf(out, sizeof(out), "%lld %.6f\n", (long long)matches[i].id, matches[i].score);
+        response.append(out, n);
+    }
+    response += "\n";
+}
+
+// writes as much of the pending answers as the socket takes, false if the client is gone
+static bool flush(connection_t* c) {
+    while (!c->output.empty()) {
+        ssize_t written = write(c->fd, c->output.data(), c->output.size());
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (written <= 0) return false;
+        c->output.erase(0, written);
+    }
+    return true;
+}
+
+// Queues the next request of a connection unless the last one is still being answered, and updates what the
+// connection waits for: no more reading while a full request line waits, nor while the client doesn't read the
+// answers. Returns false if the connection is done or misbehaves and has to be closed.
+static bool dispatch(server_t* server, connection_t* c) {
+    size_t nl = c->input.find('\n');
+    if (!c->busy && nl != string::npos && c->output.size() < MAX_REQUEST_LINE) {
+        request_t request = {c, c->input.substr(0, nl)};
+        c->input.erase(0, nl + 1);
+        c->busy = true;
+        server->requests.push_back(request);
+        pthread_cond_signal(&server->available);
+        nl = c->input.find('\n');
+    }
+    if (nl == string::npos && c->input.size() > MAX_REQUEST_LINE) return false;
+    // anything behind the last newline is ignored
+    if (c->eof && !c->busy && nl == string::npos && c->output.empty()) return false;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = (!c->eof && c->input.size() <= MAX_REQUEST_LINE ? EPOLLIN : 0) | (c->output.empty() ? 0 : EPOLLOUT);
+    event.data.ptr = c;
+    return epoll_ctl(server->epollFd, EPOLL_CTL_MOD, c->fd, &event) == 0;
+}
+
+// only called by the event loop, so there are no events of a connection left once it's closed
+static void close_connection(server_t* server, connection_t* c) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = true;
+    if (!c->busy) delete c;
+}
+
+static void handle_events(server_t* server, connection_t* c, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(server, c);
+        return;
+    }
+    if (events & EPOLLIN) {
+        char buf[65536];
+        ssize_t len = read(c->fd, buf, sizeof(buf));
+        if (len > 0) {
+            c->input.append(buf, len);
+        } else if (len == 0) {
+            c->eof = true;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_connection(server, c);
+            return;
+        }
+    }
+    if (((events & EPOLLOUT) && !flush(c)) || !dispatch(server, c))
+        close_connection(server, c);
+}
+
+// accepts all pending connections, false if accepting failed for good
+static bool accept_connections(server_t* server, int listenFd) {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            return false;
+        }
+        connection_t* c = new connection_t();
+        c->fd = fd;
+        c->busy = c->eof = c->closed = false;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            delete c;
+        }
+    }
+}
+
+void *worker_main(void *parm) {
+    server_t *server = (server_t *)parm;
+    MatchIndex::LookupState state;
+    string response;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->requests.empty())
+            pthread_cond_wait(&server->available, &server->lock);
+        request_t request = server->requests.front();
+        server->requests.pop_front();
+        pthread_mutex_unlock(&server->lock);
+
+        response.clear();
+        answer(request.line, server->index, state, response);
+
+        pthread_mutex_lock(&server->lock);
+        connection_t* c = request.connection;
+        c->busy = false;
+        if (c->closed) {
+            delete c;
+        } else {
+            c->output += response;
+            // the event loop closes it once it sees the hangup
+            if (!flush(c) || !dispatch(server, c))
+                shutdown(c->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s index_file socket_path [threads]\n", argv[0]);
+        exit(-1);
+    }
+
+    int numThreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) numThreads = 1;
+
+    MatchIndex index;
+    string error;
+    if (!index.Open(argv[1], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    fprintf(stderr, "loaded %u fingerprints with %llu codes\n",
+        index.getNumFingerprints(), (unsigned long long)index.getNumPostings());
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[2]);
+    unlink(argv[2]);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 128) != 0) {
+        fprintf(stderr, "could not listen on %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    server_t server;
+    server.index = &index;
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (server.epollFd < 0 || fcntl(listenFd, F_SETFL, O_NONBLOCK) != 0
+            || epoll_ctl(server.epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0) {
+        fprintf(stderr, "could not poll %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.available, NULL);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker_main, &server);
+        pthread_detach(thread);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(server.epollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return 1;
+        }
+        pthread_mutex_lock(&server.lock);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (!accept_connections(&server, listenFd)) return 1;
+            } else {
+                handle_events(&server, (connection_t*)events[i].data.ptr, events[i].events);
+            }
+        }
+        pthread_mutex_unlock(&server.lock);
+    }
+}
@@ -4,3 +4,25 @@ CREATE FUNCTION echoprint_compare(integer[], integer[])
 RETURNS float4
 AS 'MODULE_PATHNAME'
 LANGUAGE C IMMUTABLE STRICT COST 1000;
+
+CREATE FUNCTION echoprint_rerank(bigint[], bigint[])
+RETURNS float4
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 5000;
+
+-- stable across versions, indexes on it never have to be rebuilt
+CREATE FUNCTION echoprint_digest(integer[])
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE STRICT COST 100;
+
+-- only available if pg_echoprint is loaded through shared_preload_libraries
+CREATE FUNCTION echoprint_index_lookup(integer[], integer DEFAULT 15, OUT id bigint, OUT score float4)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION echoprint_index_invalidate()
+RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
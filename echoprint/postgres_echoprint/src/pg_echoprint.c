@@ -7,8 +7,12 @@
 PG_MODULE_MAGIC;
 
 PGDLLEXPORT Datum echoprint_compare(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum echoprint_rerank(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum echoprint_digest(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(echoprint_compare);
+PG_FUNCTION_INFO_V1(echoprint_rerank);
+PG_FUNCTION_INFO_V1(echoprint_digest);
 
 // 2 little macros borrowed from postgres contrib/_intarray module
 #define ARRNELEMS(x)  ArrayGetNItems(ARR_NDIM(x), ARR_DIMS(x))
@@ -67,3 +71,204 @@ Datum echoprint_compare(PG_FUNCTION_ARGS)
 	float jaccard_score = num / (float)(left_elemc + right_elemc - num);
 	PG_RETURN_FLOAT4(jaccard_score);
 }
+
+// a timed code packs the 20-bit code into the upper and the quantized time offset
+// (as emitted by codegen, 1 unit ~ 23.2ms) into the lower 32 bits of an int64,
+// so sorting the array sorts it by code first and by time second
+#define TIMED_CODE(x)   ((uint32_t)((uint64_t)(x) >> 32))
+#define TIMED_OFFSET(x) ((int32_t)((uint64_t)(x) & 0xffffffff))
+
+// only pair the first few occurrences of a code in the query,
+// otherwise very common codes would dominate the histogram (and the runtime)
+#define RERANK_MAX_RUN 4
+// width of the histogram bin in offset units (~46ms)
+#define RERANK_TOLERANCE 2
+
+// a matching pair of codes, by the difference of their offsets
+typedef struct
+{
+	int32_t diff;
+	uint32_t code;
+} rerank_pair;
+
+static int cmp_rerank_pair(const void *a, const void *b)
+{
+	int32_t l = ((const rerank_pair *)a)->diff, r = ((const rerank_pair *)b)->diff;
+	return (l > r) - (l < r);
+}
+
+// number of distinct codes of a timed fingerprint (sorted by code)
+static int count_codes(const int64_t *codes, int elemc)
+{
+	int i, num = 0;
+	for (i = 0; i < elemc; i++) {
+		if (i == 0 || TIMED_CODE(codes[i]) != TIMED_CODE(codes[i - 1]))
+			num++;
+	}
+	return num;
+}
+
+// Second stage of a lookup: echoprint_compare only counts the codes both fingerprints share,
+// regardless of *when* they occur. Like the original echoprint server we build a histogram
+// of the time differences of all matching codes. A real match has most of its
+// differences in a single bin (the offset between both recordings), while random
+// collisions are spread out. The score only counts the (distinct) codes within the biggest bin,
+// a code which occurs several times at that offset still counts once. Normalized like
+// echoprint_compare, it is the share of the codes both fingerprints have in common at the same
+// time, so it is on the same scale and never higher than echoprint_compare of the same pair.
+//
+// This is considerably more expensive than echoprint_compare and is therefore only
+// meant to be applied to the top candidates of the coarse lookup.
+Datum echoprint_rerank(PG_FUNCTION_ARGS)
+{
+	int left_elemc, right_elemc, left_codes, right_codes;
+	int i = 0, j = 0, npairs = 0, maxpairs, distinct = 0, best = 0;
+	uint32_t mask, slot;
+	int64_t *left, *right;
+	rerank_pair *pairs;
+	uint32_t *keys;
+	int *counts;
+
+	ArrayType *left_arr = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *right_arr = PG_GETARG_ARRAYTYPE_P(1);
+
+	CHECKARRVALID(left_arr);
+	CHECKARRVALID(right_arr);
+
+	left_elemc = ARRNELEMS(left_arr);
+	right_elemc = ARRNELEMS(right_arr);
+
+	if (left_elemc == 0 || right_elemc == 0)
+		PG_RETURN_FLOAT4(0);
+
+	left = (int64_t *)ARR_DATA_PTR(left_arr);
+	right = (int64_t *)ARR_DATA_PTR(right_arr);
+
+	// every element of right is paired with at most RERANK_MAX_RUN elements of left
+	maxpairs = right_elemc * RERANK_MAX_RUN;
+	pairs = (rerank_pair *)palloc(sizeof(rerank_pair) * maxpairs);
+
+	// both are assumed to be sorted (asc), so we merge over runs of equal codes
+	while (i < left_elemc && j < right_elemc) {
+		uint32_t lcode = TIMED_CODE(left[i]);
+		uint32_t rcode = TIMED_CODE(right[j]);
+		if (lcode == rcode) {
+			int lend = i, rend = j, k, l;
+			while (lend < left_elemc && TIMED_CODE(left[lend]) == lcode) lend++;
+			while (rend < right_elemc && TIMED_CODE(right[rend]) == rcode) rend++;
+
+			for (k = j; k < rend; k++) {
+				for (l = i; l < lend && l < i + RERANK_MAX_RUN; l++) {
+					pairs[npairs].diff = TIMED_OFFSET(right[k]) - TIMED_OFFSET(left[l]);
+					pairs[npairs].code = lcode;
+					npairs++;
+				}
+			}
+			i = lend;
+			j = rend;
+		} else if (lcode < rcode) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	// find the bin with the most distinct codes by sliding a window of RERANK_TOLERANCE over the
+	// sorted differences, the codes within the window are counted in a small open addressing table
+	qsort(pairs, npairs, sizeof(rerank_pair), cmp_rerank_pair);
+	for (mask = 1; mask < 2 * (uint32_t)npairs; mask <<= 1);
+	keys = (uint32_t *)palloc(sizeof(uint32_t) * mask);
+	counts = (int *)palloc0(sizeof(int) * mask);
+	// codes are 20 bits, so this never is one
+	memset(keys, 0xff, sizeof(uint32_t) * mask);
+	mask--;
+
+	for (i = 0, j = 0; j < npairs; j++) {
+		for (slot = pairs[j].code & mask; keys[slot] != pairs[j].code && keys[slot] != 0xffffffff; slot = (slot + 1) & mask);
+		keys[slot] = pairs[j].code;
+		if (counts[slot]++ == 0) distinct++;
+
+		while (pairs[j].diff - pairs[i].diff > RERANK_TOLERANCE) {
+			for (slot = pairs[i].code & mask; keys[slot] != pairs[i].code; slot = (slot + 1) & mask);
+			if (--counts[slot] == 0) distinct--;
+			i++;
+		}
+		if (distinct > best) best = distinct;
+	}
+	pfree(pairs);
+	pfree(keys);
+	pfree(counts);
+
+	left_codes = count_codes(left, left_elemc);
+	right_codes = count_codes(right, right_elemc);
+	float rerank_score = best / (float)(left_codes + right_codes - best);
+	PG_RETURN_FLOAT4(rerank_score);
+}
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// finalizer of MurmurHash3, every bit of the input affects every bit of the output
+static uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t l = *(const uint32_t *)a, r = *(const uint32_t *)b;
+	return (l > r) - (l < r);
+}
+
+// 64-bit digest of the set of codes of a fingerprint, regardless of their order and of duplicates,
+// so equal sets have equal digests. Meant for a B-tree (expression) index, which turns finding
+// an identical fingerprint into a single index probe instead of comparing arrays across the table,
+// and as the key of caches of repeated queries. The digest is stored in indexes, so it must stay
+// the same across versions and platforms: the codes are mixed one by one (like MurmurHash3 does
+// with 64-bit blocks) as 32-bit numbers, independent of the byte order.
+// Different sets collide with a probability of about 2^-64 per pair, an exact match
+// still has to compare the arrays themselves.
+Datum echoprint_digest(PG_FUNCTION_ARGS)
+{
+	int elemc, i, unique = 0;
+	uint32_t *codes, *sorted;
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+
+	ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
+
+	CHECKARRVALID(arr);
+
+	elemc = ARRNELEMS(arr);
+	codes = (uint32_t *)ARR_DATA_PTR(arr);
+
+	// fingerprints are sorted (asc) already, only sort a copy if this one isn't
+	sorted = codes;
+	for (i = 1; i < elemc; i++) {
+		if (codes[i - 1] > codes[i]) {
+			sorted = (uint32_t *)palloc(sizeof(uint32_t) * elemc);
+			memcpy(sorted, codes, sizeof(uint32_t) * elemc);
+			qsort(sorted, elemc, sizeof(uint32_t), cmp_uint32);
+			break;
+		}
+	}
+
+	for (i = 0; i < elemc; i++) {
+		uint64_t k;
+		if (i > 0 && sorted[i] == sorted[i - 1]) continue;
+		k = sorted[i];
+		k *= 0x87c37b91114253d5ULL;
+		k = ROTL64(k, 31);
+		k *= 0x4cf5ad432745937fULL;
+		h ^= k;
+		h = ROTL64(h, 27) * 5 + 0x52dce729;
+		unique++;
+	}
+	if (sorted != codes) pfree(sorted);
+
+	h ^= (uint64_t)unique;
+	PG_RETURN_INT64((int64_t)fmix64(h));
+}
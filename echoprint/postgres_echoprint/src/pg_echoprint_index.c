@@ -0,0 +1,1065 @@
+#include <stdint.h>
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+// An in-memory inverted index (code -> fingerprints) of the fingerprint table.
+//
+// A background worker scans the fingerprint table and builds the index into a dynamic shared memory
+// segment (the base), which every backend maps (once) to score candidates without touching a single heap page.
+// Changes are merged in incrementally: a row level trigger (see echoprint_index_invalidate) collects the ids of the
+// changed fingerprints, which are handed to the worker once the transaction commits. The worker reads just those rows
+// and publishes a second, small segment (the delta) next to the base: the fingerprints added or changed since the base
+// was built, and which slots of the base are gone. Once the delta gets too big, both are merged into a new base,
+// straight from the segments. The table is only scanned again (at most once per pg_echoprint.index_naptime seconds)
+// at startup, after TRUNCATE, when a transaction changed too many rows or for a statement level trigger.
+// Lookups running against old segments keep them alive until they are done with them.
+//
+// This requires pg_echoprint to be loaded through shared_preload_libraries.
+
+PGDLLEXPORT Datum echoprint_index_lookup(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum echoprint_index_invalidate(PG_FUNCTION_ARGS);
+PGDLLEXPORT void echoprint_index_main(Datum main_arg);
+void _PG_init(void);
+
+PG_FUNCTION_INFO_V1(echoprint_index_lookup);
+PG_FUNCTION_INFO_V1(echoprint_index_invalidate);
+
+#define ARRNELEMS(x)  ArrayGetNItems(ARR_NDIM(x), ARR_DIMS(x))
+
+// codegen emits 20 bit codes (HASH_BITMASK), anything outside is not indexed (but still counted)
+#define INDEX_CODES (1 << 20)
+// how many fingerprints are fetched from the cursor at once while building
+#define INDEX_FETCH_SIZE 10000
+// changed fingerprints waiting for the worker, a transaction changing more rows has the index rebuilt instead
+#define INDEX_MAX_CHANGED 65536
+// the delta is merged into the base once it has more than 1/INDEX_MERGE_DIVISOR of its postings (or dead slots),
+// but never before it has INDEX_MERGE_MIN_POSTINGS
+#define INDEX_MERGE_DIVISOR 8
+#define INDEX_MERGE_MIN_POSTINGS (1 << 20)
+
+// the state every backend shares, lives in the main shared memory
+typedef struct {
+	LWLock *lock;
+	// the currently published base and delta segment (or DSM_HANDLE_INVALID)
+	dsm_handle handle;
+	dsm_handle delta_handle;
+	// protects everything below, which is handed from committing transactions to the worker
+	LWLock *delta_lock;
+	// the whole table has to be read again
+	bool rebuild;
+	// ids of the fingerprints changed by committed transactions the worker hasn't merged yet
+	int32 nchanged;
+	int64 changed[INDEX_MAX_CHANGED];
+	// the latch of the worker, so committing transactions can wake it up
+	Latch *latch;
+} EchoprintIndexShared;
+
+// header of an index segment, followed by
+//   uint32 offsets[INDEX_CODES + 2]: postings of code c are postings[offsets[c]..offsets[c + 1]]
+//   int64  ids[nfingerprints]:       fingerprint.id for every slot, ascending
+//   int32  sizes[nfingerprints]:     number of codes for every slot
+//   uint32 postings[npostings]:      fingerprint slots, ascending within a code
+//   uint8  dead[(nbase + 7) / 8]:    delta only, bitmap of the slots of the base which were deleted or changed since
+typedef struct {
+	int32 nfingerprints;
+	uint32 npostings;
+	// fingerprints of the base the delta belongs to, 0 for a base
+	int32 nbase;
+	int32 ndead;
+} EchoprintIndexHeader;
+
+#define INDEX_OFFSETS(hdr) ((uint32 *)((char *)(hdr) + MAXALIGN(sizeof(EchoprintIndexHeader))))
+#define INDEX_IDS(hdr)     ((int64 *)(INDEX_OFFSETS(hdr) + INDEX_CODES + 2))
+#define INDEX_SIZES(hdr)   ((int32 *)(INDEX_IDS(hdr) + (hdr)->nfingerprints))
+#define INDEX_POSTINGS(hdr) ((uint32 *)(INDEX_SIZES(hdr) + (hdr)->nfingerprints))
+#define INDEX_DEAD(hdr)    ((uint8 *)(INDEX_POSTINGS(hdr) + (hdr)->npostings))
+#define INDEX_IS_DEAD(dead, slot) (((dead)[(slot) >> 3] >> ((slot) & 7)) & 1)
+
+static Size index_segment_size(int32 nfingerprints, uint32 npostings, int32 nbase)
+{
+	// offsets are padded by one element, so ids stay 8 byte aligned
+	return MAXALIGN(sizeof(EchoprintIndexHeader))
+		+ sizeof(uint32) * (INDEX_CODES + 2)
+		+ (sizeof(int64) + sizeof(int32)) * (Size)nfingerprints
+		+ sizeof(uint32) * (Size)npostings
+		+ ((Size)nbase + 7) / 8;
+}
+
+static EchoprintIndexShared *index_shared = NULL;
+
+static char *index_database = NULL;
+static int index_naptime = 10;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+// collected by the trigger (in TopTransactionContext), handed to the worker only once the transaction commits
+static int64 *changed_ids = NULL;
+static int32 nchanged_ids = 0;
+static int32 changed_ids_capacity = 0;
+static bool rebuild_at_commit = false;
+static bool xact_callback_registered = false;
+
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
+
+static void echoprint_index_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void echoprint_index_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void echoprint_index_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+	RequestAddinShmemSpace(MAXALIGN(sizeof(EchoprintIndexShared)));
+	RequestNamedLWLockTranche("pg_echoprint", 2);
+}
+
+static void echoprint_index_shmem_startup(void)
+{
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	index_shared = ShmemInitStruct("pg_echoprint index", sizeof(EchoprintIndexShared), &found);
+	if (!found) {
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_echoprint");
+		index_shared->lock = &locks[0].lock;
+		index_shared->delta_lock = &locks[1].lock;
+		index_shared->handle = DSM_HANDLE_INVALID;
+		index_shared->delta_handle = DSM_HANDLE_INVALID;
+		// the worker builds on startup
+		index_shared->rebuild = true;
+		index_shared->nchanged = 0;
+		index_shared->latch = NULL;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+void _PG_init(void)
+{
+	BackgroundWorker worker;
+
+	// without shared memory there's nothing to set up, echoprint_compare & co still work
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomStringVariable("pg_echoprint.index_database",
+		"Database containing the fingerprint table to index.",
+		NULL, &index_database, "kotori", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+	DefineCustomIntVariable("pg_echoprint.index_naptime",
+		"Minimum number of seconds between two full rebuilds of the fingerprint index.",
+		"Changes to single rows are merged into the index right away.",
+		&index_naptime, 10, 1, INT_MAX / 1000, PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = echoprint_index_request;
+#else
+	echoprint_index_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = echoprint_index_shmem_startup;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_echoprint");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "echoprint_index_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_echoprint index");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_echoprint index");
+#endif
+	RegisterBackgroundWorker(&worker);
+}
+
+// Creates a segment for the given fingerprints (ascending ids, their codes one after another).
+// A delta (nbase > 0) starts without dead slots.
+static dsm_segment *echoprint_index_create(int32 nfingerprints, const int64 *ids, const int32 *sizes,
+	const int32 *codes, uint64 ncodes, int32 nbase)
+{
+	EchoprintIndexHeader *hdr;
+	uint32 *offsets, *postings, *cursor;
+	uint64 i, npostings = 0;
+	int32 fp;
+	dsm_segment *seg;
+
+	for (i = 0; i < ncodes; i++) {
+		if ((uint32)codes[i] < INDEX_CODES) npostings++;
+	}
+	if (npostings > PG_UINT32_MAX)
+		elog(ERROR, "pg_echoprint: too many codes to index (" UINT64_FORMAT ")", npostings);
+
+	seg = dsm_create(index_segment_size(nfingerprints, npostings, nbase), 0);
+	hdr = (EchoprintIndexHeader *)dsm_segment_address(seg);
+	hdr->nfingerprints = nfingerprints;
+	hdr->npostings = npostings;
+	hdr->nbase = nbase;
+	hdr->ndead = 0;
+	offsets = INDEX_OFFSETS(hdr);
+	postings = INDEX_POSTINGS(hdr);
+	memcpy(INDEX_IDS(hdr), ids, sizeof(int64) * nfingerprints);
+	memcpy(INDEX_SIZES(hdr), sizes, sizeof(int32) * nfingerprints);
+	memset(INDEX_DEAD(hdr), 0, ((Size)nbase + 7) / 8);
+
+	// counting sort: count the postings of every code first, then prefix sum to get the offsets
+	memset(offsets, 0, sizeof(uint32) * (INDEX_CODES + 2));
+	for (i = 0; i < ncodes; i++) {
+		if ((uint32)codes[i] < INDEX_CODES) offsets[codes[i] + 1]++;
+	}
+	for (i = 0; i < INDEX_CODES; i++) offsets[i + 1] += offsets[i];
+
+	// fingerprints are visited in slot order, so every posting list ends up sorted
+	cursor = palloc(sizeof(uint32) * INDEX_CODES);
+	memcpy(cursor, offsets, sizeof(uint32) * INDEX_CODES);
+	for (fp = 0, i = 0; fp < nfingerprints; fp++) {
+		int32 k;
+		for (k = 0; k < sizes[fp]; k++, i++) {
+			if ((uint32)codes[i] < INDEX_CODES) postings[cursor[codes[i]]++] = fp;
+		}
+	}
+	pfree(cursor);
+	return seg;
+}
+
+// Scans the whole fingerprint table and builds a new base segment from it.
+// Returns NULL if the table doesn't exist (yet).
+static dsm_segment *echoprint_index_build(void)
+{
+	MemoryContext build_ctx, batch_ctx, old_ctx;
+	int32 nfingerprints = 0, capacity = 1024;
+	uint64 ncodes = 0, codes_capacity = 1024 * 1024;
+	int64 *ids;
+	int32 *sizes;
+	int32 *codes;
+	Portal portal;
+	SPIPlanPtr plan;
+	bool exists, isnull;
+	dsm_segment *seg = NULL;
+
+	// everything collected from the table has to survive SPI_finish
+	build_ctx = AllocSetContextCreate(TopMemoryContext, "pg_echoprint index build", ALLOCSET_DEFAULT_SIZES);
+	old_ctx = MemoryContextSwitchTo(build_ctx);
+	ids = palloc(sizeof(int64) * capacity);
+	sizes = palloc(sizeof(int32) * capacity);
+	codes = MemoryContextAllocHuge(build_ctx, sizeof(int32) * codes_capacity);
+	MemoryContextSwitchTo(old_ctx);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "building echoprint index");
+
+	SPI_execute("SELECT to_regclass('fingerprint') IS NOT NULL", true, 1);
+	exists = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+	if (exists) {
+		// detoasted arrays are only needed until they are copied, so throw them away after every batch
+		batch_ctx = AllocSetContextCreate(CurrentMemoryContext, "pg_echoprint index batch", ALLOCSET_DEFAULT_SIZES);
+		plan = SPI_prepare("SELECT id, hash FROM fingerprint ORDER BY id", 0, NULL);
+		portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+		for (;;) {
+			uint64 row;
+			SPI_cursor_fetch(portal, true, INDEX_FETCH_SIZE);
+			if (SPI_processed == 0)
+				break;
+
+			old_ctx = MemoryContextSwitchTo(batch_ctx);
+			for (row = 0; row < SPI_processed; row++) {
+				HeapTuple tuple = SPI_tuptable->vals[row];
+				TupleDesc tupdesc = SPI_tuptable->tupdesc;
+				Datum id = SPI_getbinval(tuple, tupdesc, 1, &isnull);
+				ArrayType *arr = DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+				int nelems = ARRNELEMS(arr);
+
+				if (ARR_HASNULL(arr) && array_contains_nulls(arr))
+					continue;
+
+				if (nfingerprints == capacity) {
+					capacity *= 2;
+					ids = repalloc(ids, sizeof(int64) * capacity);
+					sizes = repalloc(sizes, sizeof(int32) * capacity);
+				}
+				if (ncodes + nelems > codes_capacity) {
+					while (ncodes + nelems > codes_capacity) codes_capacity *= 2;
+					codes = repalloc_huge(codes, sizeof(int32) * codes_capacity);
+				}
+				ids[nfingerprints] = DatumGetInt64(id);
+				sizes[nfingerprints] = nelems;
+				memcpy(codes + ncodes, ARR_DATA_PTR(arr), sizeof(int32) * nelems);
+				ncodes += nelems;
+				nfingerprints++;
+			}
+			MemoryContextSwitchTo(old_ctx);
+			MemoryContextReset(batch_ctx);
+			SPI_freetuptable(SPI_tuptable);
+			CHECK_FOR_INTERRUPTS();
+		}
+		SPI_cursor_close(portal);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	if (exists) {
+		old_ctx = MemoryContextSwitchTo(build_ctx);
+		seg = echoprint_index_create(nfingerprints, ids, sizes, codes, ncodes, 0);
+		MemoryContextSwitchTo(old_ctx);
+		elog(LOG, "pg_echoprint: indexed %d fingerprints with %u codes", nfingerprints,
+			((EchoprintIndexHeader *)dsm_segment_address(seg))->npostings);
+	}
+
+	MemoryContextDelete(build_ctx);
+	return seg;
+}
+
+// a fingerprint added or changed since the base was built, kept by the worker until the next merge
+typedef struct {
+	int64 id;
+	int32 nelems;
+	int32 *codes;
+} DeltaEntry;
+
+// what the worker has published, and what it knows about the changes since the base was built
+static dsm_segment *base_segment = NULL;
+static dsm_segment *delta_segment = NULL;
+static MemoryContext delta_ctx = NULL;
+static HTAB *delta_entries = NULL;
+static uint64 delta_ncodes = 0;
+static uint8 *base_dead = NULL;
+static int32 base_ndead = 0;
+// scratch memory of merges, reset after every one
+static MemoryContext merge_ctx = NULL;
+
+// forgets all changes, for a new base with nbase fingerprints
+static void echoprint_index_reset_delta(int32 nbase)
+{
+	HASHCTL ctl;
+
+	if (delta_ctx)
+		MemoryContextReset(delta_ctx);
+	else
+		delta_ctx = AllocSetContextCreate(TopMemoryContext, "pg_echoprint index delta", ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int64);
+	ctl.entrysize = sizeof(DeltaEntry);
+	ctl.hcxt = delta_ctx;
+	delta_entries = hash_create("pg_echoprint index delta", 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	delta_ncodes = 0;
+	base_dead = MemoryContextAllocZero(delta_ctx, ((Size)nbase + 7) / 8 + 1);
+	base_ndead = 0;
+}
+
+// Makes the given segments the published ones, delta may be NULL. The worker keeps both mapped,
+// backends still using the old ones keep them alive until they detach.
+static void echoprint_index_publish(dsm_segment *base, dsm_segment *delta)
+{
+	dsm_handle old_handle = DSM_HANDLE_INVALID, old_delta_handle = DSM_HANDLE_INVALID;
+
+	// keep the segments around after we detach and make them visible to everyone
+	if (base != base_segment)
+		dsm_pin_segment(base);
+	if (delta)
+		dsm_pin_segment(delta);
+	LWLockAcquire(index_shared->lock, LW_EXCLUSIVE);
+	old_handle = index_shared->handle;
+	old_delta_handle = index_shared->delta_handle;
+	index_shared->handle = dsm_segment_handle(base);
+	index_shared->delta_handle = delta ? dsm_segment_handle(delta) : DSM_HANDLE_INVALID;
+	LWLockRelease(index_shared->lock);
+
+	// the handles might be left over by a previous incarnation of the worker, which had them pinned
+	if (base != base_segment) {
+		if (old_handle != DSM_HANDLE_INVALID)
+			dsm_unpin_segment(old_handle);
+		if (base_segment)
+			dsm_detach(base_segment);
+		base_segment = base;
+	}
+	if (old_delta_handle != DSM_HANDLE_INVALID)
+		dsm_unpin_segment(old_delta_handle);
+	if (delta_segment)
+		dsm_detach(delta_segment);
+	delta_segment = delta;
+}
+
+// slot of the given id in a base, -1 if it isn't there
+static int32 echoprint_index_find_slot(EchoprintIndexHeader *hdr, int64 id)
+{
+	int64 *ids = INDEX_IDS(hdr);
+	int32 lo = 0, hi = hdr->nfingerprints;
+
+	while (lo < hi) {
+		int32 mid = lo + (hi - lo) / 2;
+		if (ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < hdr->nfingerprints && ids[lo] == id ? lo : -1;
+}
+
+// Reads the current rows of the changed fingerprints into the delta, whatever the index had of them before is dropped.
+// Returns false if the table is gone.
+static bool echoprint_index_read_changes(const int64 *changed, int32 nchanged)
+{
+	EchoprintIndexHeader *base = (EchoprintIndexHeader *)dsm_segment_address(base_segment);
+	Oid argtypes[1] = {INT8OID};
+	Datum args[1];
+	Datum *elems;
+	bool exists, isnull;
+	uint64 row;
+	int32 i;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "merging changes into echoprint index");
+
+	SPI_execute("SELECT to_regclass('fingerprint') IS NOT NULL", true, 1);
+	exists = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+	if (exists) {
+		for (i = 0; i < nchanged; i++) {
+			int32 slot = echoprint_index_find_slot(base, changed[i]);
+			DeltaEntry *entry;
+
+			if (slot >= 0 && !INDEX_IS_DEAD(base_dead, slot)) {
+				base_dead[slot >> 3] |= 1 << (slot & 7);
+				base_ndead++;
+			}
+			entry = (DeltaEntry *)hash_search(delta_entries, &changed[i], HASH_FIND, NULL);
+			if (entry) {
+				delta_ncodes -= entry->nelems;
+				pfree(entry->codes);
+				hash_search(delta_entries, &changed[i], HASH_REMOVE, NULL);
+			}
+		}
+
+		// the arrays only live until SPI_finish, the codes are copied into the delta
+		elems = palloc(sizeof(Datum) * nchanged);
+		for (i = 0; i < nchanged; i++) elems[i] = Int64GetDatum(changed[i]);
+		args[0] = PointerGetDatum(construct_array(elems, nchanged, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+		SPI_execute_with_args("SELECT id, hash FROM fingerprint WHERE id = ANY($1)", 1, argtypes, args, NULL, true, 0);
+
+		for (row = 0; row < SPI_processed; row++) {
+			HeapTuple tuple = SPI_tuptable->vals[row];
+			TupleDesc tupdesc = SPI_tuptable->tupdesc;
+			int64 id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+			ArrayType *arr = DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+			int nelems = ARRNELEMS(arr);
+			DeltaEntry *entry;
+
+			if (ARR_HASNULL(arr) && array_contains_nulls(arr))
+				continue;
+
+			entry = (DeltaEntry *)hash_search(delta_entries, &id, HASH_ENTER, NULL);
+			entry->nelems = nelems;
+			entry->codes = MemoryContextAlloc(delta_ctx, sizeof(int32) * Max(nelems, 1));
+			memcpy(entry->codes, ARR_DATA_PTR(arr), sizeof(int32) * nelems);
+			delta_ncodes += nelems;
+		}
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+	return exists;
+}
+
+static int cmp_delta_entry(const void *a, const void *b)
+{
+	int64 l = (*(DeltaEntry *const *)a)->id, r = (*(DeltaEntry *const *)b)->id;
+	return (l > r) - (l < r);
+}
+
+// Builds a delta segment of the changes the worker knows about, NULL if there are none.
+static dsm_segment *echoprint_index_build_delta(void)
+{
+	EchoprintIndexHeader *base = (EchoprintIndexHeader *)dsm_segment_address(base_segment), *hdr;
+	int32 n = (int32)hash_get_num_entries(delta_entries), i;
+	DeltaEntry **entries, *entry;
+	HASH_SEQ_STATUS status;
+	int64 *ids;
+	int32 *sizes, *codes;
+	uint64 ncodes = 0;
+	dsm_segment *seg;
+	MemoryContext old_ctx;
+
+	if (n == 0 && base_ndead == 0)
+		return NULL;
+
+	old_ctx = MemoryContextSwitchTo(merge_ctx);
+	entries = palloc(sizeof(DeltaEntry *) * Max(n, 1));
+	i = 0;
+	hash_seq_init(&status, delta_entries);
+	while ((entry = (DeltaEntry *)hash_seq_search(&status)) != NULL) entries[i++] = entry;
+	// slots in the order of the ids, like in the base
+	qsort(entries, n, sizeof(DeltaEntry *), cmp_delta_entry);
+
+	ids = palloc(sizeof(int64) * Max(n, 1));
+	sizes = palloc(sizeof(int32) * Max(n, 1));
+	codes = MemoryContextAllocHuge(merge_ctx, sizeof(int32) * Max(delta_ncodes, 1));
+	for (i = 0; i < n; i++) {
+		ids[i] = entries[i]->id;
+		sizes[i] = entries[i]->nelems;
+		memcpy(codes + ncodes, entries[i]->codes, sizeof(int32) * entries[i]->nelems);
+		ncodes += entries[i]->nelems;
+	}
+
+	seg = echoprint_index_create(n, ids, sizes, codes, ncodes, base->nfingerprints);
+	hdr = (EchoprintIndexHeader *)dsm_segment_address(seg);
+	hdr->ndead = base_ndead;
+	memcpy(INDEX_DEAD(hdr), base_dead, ((Size)base->nfingerprints + 7) / 8);
+
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(merge_ctx);
+	return seg;
+}
+
+// Merges a base and its delta into a new base, without reading the table: slots are numbered again
+// in the order of the ids (dead slots of the base are dropped), which keeps both posting lists of a code
+// ascending, so the new one is just their merge.
+static dsm_segment *echoprint_index_merge(EchoprintIndexHeader *base, EchoprintIndexHeader *delta)
+{
+	uint32 *base_offsets = INDEX_OFFSETS(base), *delta_offsets = INDEX_OFFSETS(delta);
+	uint32 *base_postings = INDEX_POSTINGS(base), *delta_postings = INDEX_POSTINGS(delta);
+	int64 *base_ids = INDEX_IDS(base), *delta_ids = INDEX_IDS(delta);
+	uint8 *dead = INDEX_DEAD(delta);
+	int32 *base_slots, *delta_slots;
+	int32 nfingerprints = 0, i = 0, j = 0;
+	uint64 npostings = delta->npostings, p, out = 0;
+	uint32 c, *offsets, *postings;
+	EchoprintIndexHeader *hdr;
+	dsm_segment *seg;
+	MemoryContext old_ctx = MemoryContextSwitchTo(merge_ctx);
+
+	// new slot of every slot of the base (-1 if it is dead) and of the delta
+	base_slots = MemoryContextAllocHuge(merge_ctx, sizeof(int32) * Max(base->nfingerprints, 1));
+	delta_slots = MemoryContextAllocHuge(merge_ctx, sizeof(int32) * Max(delta->nfingerprints, 1));
+	while (i < base->nfingerprints || j < delta->nfingerprints) {
+		if (i < base->nfingerprints && INDEX_IS_DEAD(dead, i))
+			base_slots[i++] = -1;
+		else if (i < base->nfingerprints && (j == delta->nfingerprints || base_ids[i] < delta_ids[j]))
+			base_slots[i++] = nfingerprints++;
+		else
+			delta_slots[j++] = nfingerprints++;
+	}
+	for (p = 0; p < base->npostings; p++) {
+		if (base_slots[base_postings[p]] >= 0) npostings++;
+	}
+	if (npostings > PG_UINT32_MAX)
+		elog(ERROR, "pg_echoprint: too many codes to index (" UINT64_FORMAT ")", npostings);
+
+	seg = dsm_create(index_segment_size(nfingerprints, npostings, 0), 0);
+	hdr = (EchoprintIndexHeader *)dsm_segment_address(seg);
+	hdr->nfingerprints = nfingerprints;
+	hdr->npostings = npostings;
+	hdr->nbase = 0;
+	hdr->ndead = 0;
+	for (i = 0; i < base->nfingerprints; i++) {
+		if (base_slots[i] < 0)
+			continue;
+		INDEX_IDS(hdr)[base_slots[i]] = base_ids[i];
+		INDEX_SIZES(hdr)[base_slots[i]] = INDEX_SIZES(base)[i];
+	}
+	for (j = 0; j < delta->nfingerprints; j++) {
+		INDEX_IDS(hdr)[delta_slots[j]] = delta_ids[j];
+		INDEX_SIZES(hdr)[delta_slots[j]] = INDEX_SIZES(delta)[j];
+	}
+
+	offsets = INDEX_OFFSETS(hdr);
+	postings = INDEX_POSTINGS(hdr);
+	offsets[0] = 0;
+	for (c = 0; c < INDEX_CODES; c++) {
+		uint32 b = base_offsets[c], b_end = base_offsets[c + 1];
+		uint32 d = delta_offsets[c], d_end = delta_offsets[c + 1];
+		for (;;) {
+			while (b < b_end && base_slots[base_postings[b]] < 0) b++;
+			if (b < b_end && (d == d_end || base_slots[base_postings[b]] < delta_slots[delta_postings[d]]))
+				postings[out++] = base_slots[base_postings[b++]];
+			else if (d < d_end)
+				postings[out++] = delta_slots[delta_postings[d++]];
+			else
+				break;
+		}
+		offsets[c + 1] = out;
+	}
+	offsets[INDEX_CODES + 1] = 0;
+
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(merge_ctx);
+	return seg;
+}
+
+// Merges the changed fingerprints into the index and publishes it. Returns false if the table is gone.
+static bool echoprint_index_apply(const int64 *changed, int32 nchanged)
+{
+	EchoprintIndexHeader *base, *hdr;
+	dsm_segment *delta, *merged;
+
+	if (!echoprint_index_read_changes(changed, nchanged))
+		return false;
+
+	base = (EchoprintIndexHeader *)dsm_segment_address(base_segment);
+	delta = echoprint_index_build_delta();
+	if (!delta) {
+		echoprint_index_publish(base_segment, NULL);
+		return true;
+	}
+
+	// lookups go through both segments, a big delta costs them about as much as a bigger base
+	hdr = (EchoprintIndexHeader *)dsm_segment_address(delta);
+	if (hdr->npostings < Max(base->npostings / INDEX_MERGE_DIVISOR, INDEX_MERGE_MIN_POSTINGS)
+			&& hdr->ndead <= base->nfingerprints / INDEX_MERGE_DIVISOR) {
+		echoprint_index_publish(base_segment, delta);
+		return true;
+	}
+
+	merged = echoprint_index_merge(base, hdr);
+	// never pinned, so this is the end of it
+	dsm_detach(delta);
+	hdr = (EchoprintIndexHeader *)dsm_segment_address(merged);
+	echoprint_index_reset_delta(hdr->nfingerprints);
+	echoprint_index_publish(merged, NULL);
+	elog(LOG, "pg_echoprint: merged changes into the index, %d fingerprints with %u codes",
+		hdr->nfingerprints, hdr->npostings);
+	return true;
+}
+
+void echoprint_index_main(Datum main_arg)
+{
+	TimestampTz last_build = 0;
+	int64 *changed;
+
+	pqsignal(SIGTERM, echoprint_index_sigterm);
+	pqsignal(SIGHUP, echoprint_index_sighup);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnection(index_database, NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection(index_database, NULL);
+#endif
+
+	merge_ctx = AllocSetContextCreate(TopMemoryContext, "pg_echoprint index merge", ALLOCSET_DEFAULT_SIZES);
+	changed = MemoryContextAlloc(TopMemoryContext, sizeof(int64) * INDEX_MAX_CHANGED);
+
+	// what a previous incarnation of the worker had merged is gone with it, start over from the table
+	LWLockAcquire(index_shared->delta_lock, LW_EXCLUSIVE);
+	index_shared->rebuild = true;
+	index_shared->latch = MyLatch;
+	LWLockRelease(index_shared->delta_lock);
+
+	while (!got_sigterm) {
+		long wait_ms = index_naptime * 1000L;
+		TimestampTz now = GetCurrentTimestamp();
+		int32 nchanged = 0;
+		bool rebuild;
+		int rc;
+
+		if (got_sighup) {
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		LWLockAcquire(index_shared->delta_lock, LW_EXCLUSIVE);
+		// without a base there is nothing to merge the changes into
+		rebuild = index_shared->rebuild || (index_shared->nchanged > 0 && !base_segment);
+		if (rebuild && last_build != 0 && !TimestampDifferenceExceeds(last_build, now, index_naptime * 1000)) {
+			// don't rebuild more than once per naptime, bulk loads would keep us busy otherwise.
+			// Changes coming in meanwhile stay where they are, the rebuild covers them.
+			wait_ms = Max(index_naptime * 1000L - (long)((now - last_build) / 1000), 1);
+			rebuild = false;
+		} else {
+			// taken before the rebuild or the read takes its snapshot: every commit handed over so far
+			// is visible to it, a commit after is handed over again
+			if (!rebuild) {
+				nchanged = index_shared->nchanged;
+				memcpy(changed, index_shared->changed, sizeof(int64) * nchanged);
+			}
+			index_shared->rebuild = false;
+			index_shared->nchanged = 0;
+		}
+		LWLockRelease(index_shared->delta_lock);
+
+		if (rebuild) {
+			dsm_segment *seg = echoprint_index_build();
+			last_build = now;
+			if (seg) {
+				echoprint_index_reset_delta(((EchoprintIndexHeader *)dsm_segment_address(seg))->nfingerprints);
+				echoprint_index_publish(seg, NULL);
+			}
+			continue;
+		}
+		if (nchanged > 0) {
+			if (!echoprint_index_apply(changed, nchanged)) {
+				LWLockAcquire(index_shared->delta_lock, LW_EXCLUSIVE);
+				index_shared->rebuild = true;
+				LWLockRelease(index_shared->delta_lock);
+			}
+			continue;
+		}
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, wait_ms, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	LWLockAcquire(index_shared->delta_lock, LW_EXCLUSIVE);
+	index_shared->latch = NULL;
+	LWLockRelease(index_shared->delta_lock);
+	proc_exit(0);
+}
+
+// the segments this backend currently has mapped
+static dsm_segment *mapped_segment = NULL;
+static dsm_handle mapped_handle = DSM_HANDLE_INVALID;
+static dsm_segment *mapped_delta = NULL;
+static dsm_handle mapped_delta_handle = DSM_HANDLE_INVALID;
+// per-slot match counters, reused across lookups (only touched slots are reset)
+static int32 *match_counts = NULL;
+static int32 match_counts_size = 0;
+
+// maps the segment with the given handle in place of the one mapped before (if it's another one),
+// returns false if it is gone already
+static bool echoprint_index_map(dsm_handle handle, dsm_segment **segment, dsm_handle *mapped)
+{
+	if (handle == *mapped)
+		return true;
+
+	if (*segment)
+		dsm_detach(*segment);
+	*mapped = DSM_HANDLE_INVALID;
+	*segment = NULL;
+	if (handle == DSM_HANDLE_INVALID)
+		return true;
+	*segment = dsm_attach(handle);
+	if (!*segment)
+		return false;
+	dsm_pin_mapping(*segment);
+	*mapped = handle;
+	return true;
+}
+
+// returns the published base, and its delta (or NULL) in *delta
+static EchoprintIndexHeader *echoprint_index_attach(EchoprintIndexHeader **delta)
+{
+	int attempt;
+
+	if (!index_shared)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_echoprint must be loaded via shared_preload_libraries to use the index")));
+
+	for (attempt = 0; attempt < 3; attempt++) {
+		dsm_handle handle, delta_handle;
+
+		LWLockAcquire(index_shared->lock, LW_SHARED);
+		handle = index_shared->handle;
+		delta_handle = index_shared->delta_handle;
+		LWLockRelease(index_shared->lock);
+
+		if (handle == DSM_HANDLE_INVALID)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("the echoprint index has not been built yet")));
+
+		// the worker might have swapped the segments in the meantime, just retry
+		if (!echoprint_index_map(handle, &mapped_segment, &mapped_handle)
+				|| !echoprint_index_map(delta_handle, &mapped_delta, &mapped_delta_handle))
+			continue;
+		*delta = mapped_delta ? (EchoprintIndexHeader *)dsm_segment_address(mapped_delta) : NULL;
+		return (EchoprintIndexHeader *)dsm_segment_address(mapped_segment);
+	}
+	ereport(ERROR, (errmsg("could not attach to the echoprint index")));
+	return NULL;
+}
+
+// Counts the codes the query shares with every fingerprint of a segment, into match_counts[first_slot + slot].
+// Returns the new number of touched slots.
+static int echoprint_index_count(EchoprintIndexHeader *hdr, int32 first_slot, const int32 *query, int query_elemc,
+	int32 *touched, int ntouched)
+{
+	uint32 *offsets = INDEX_OFFSETS(hdr), *postings = INDEX_POSTINGS(hdr);
+	int i;
+
+	// walk over the runs of equal codes in the query
+	for (i = 0; i < query_elemc;) {
+		uint32 code = (uint32)query[i];
+		int run = 1;
+		uint32 p, end;
+
+		while (i + run < query_elemc && query[i + run] == query[i]) run++;
+		i += run;
+		if (code >= INDEX_CODES)
+			continue;
+
+		// the postings of a fingerprint are adjacent, count them and cap at the multiplicity of the query
+		end = offsets[code + 1];
+		for (p = offsets[code]; p < end;) {
+			uint32 posting = postings[p];
+			int32 slot = first_slot + posting;
+			int n = 0;
+			while (p < end && postings[p] == posting) { n++; p++; }
+			if (match_counts[slot] == 0)
+				touched[ntouched++] = slot;
+			match_counts[slot] += Min(n, run);
+		}
+	}
+	return ntouched;
+}
+
+typedef struct {
+	int64 id;
+	float4 score;
+} IndexMatch;
+
+static int cmp_index_match(const void *a, const void *b)
+{
+	const IndexMatch *l = (const IndexMatch *)a, *r = (const IndexMatch *)b;
+	if (l->score != r->score) return l->score < r->score ? 1 : -1;
+	return (l->id > r->id) - (l->id < r->id);
+}
+
+// Returns the k fingerprints with the highest score for the given (sorted) query.
+// The score is exactly what echoprint_compare would compute, including duplicate codes:
+// a code present m times in the query and n times in a fingerprint matches min(m, n) times.
+Datum echoprint_index_lookup(PG_FUNCTION_ARGS)
+{
+	ArrayType *query_arr = PG_GETARG_ARRAYTYPE_P(0);
+	int32 k = PG_GETARG_INT32(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	EchoprintIndexHeader *hdr, *delta;
+	uint8 *dead = NULL;
+	int32 *touched;
+	int32 *query;
+	int32 nslots;
+	int64 npostings;
+	int query_elemc, ntouched = 0, nmatches = 0, i;
+	IndexMatch *matches;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext old_ctx;
+
+	if (ARR_HASNULL(query_arr) && array_contains_nulls(query_arr))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("array must not contain nulls")));
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	// slots of the delta follow the ones of the base
+	hdr = echoprint_index_attach(&delta);
+	nslots = hdr->nfingerprints + (delta ? delta->nfingerprints : 0);
+	npostings = (int64)hdr->npostings + (delta ? delta->npostings : 0);
+	if (delta)
+		dead = INDEX_DEAD(delta);
+
+	if (match_counts_size < nslots) {
+		if (match_counts)
+			pfree(match_counts);
+		match_counts = MemoryContextAllocHuge(TopMemoryContext, sizeof(int32) * nslots);
+		memset(match_counts, 0, sizeof(int32) * nslots);
+		match_counts_size = nslots;
+	}
+
+	query_elemc = ARRNELEMS(query_arr);
+	query = (int32 *)ARR_DATA_PTR(query_arr);
+	touched = palloc(sizeof(int32) * Min((int64)nslots, npostings + 1));
+	ntouched = echoprint_index_count(hdr, 0, query, query_elemc, touched, ntouched);
+	if (delta)
+		ntouched = echoprint_index_count(delta, hdr->nfingerprints, query, query_elemc, touched, ntouched);
+
+	matches = palloc(sizeof(IndexMatch) * Max(ntouched, 1));
+	for (i = 0; i < ntouched; i++) {
+		int32 slot = touched[i];
+		int num = match_counts[slot];
+		int32 size;
+
+		match_counts[slot] = 0;
+		if (slot < hdr->nfingerprints) {
+			// deleted or changed since, the delta has what is left of it
+			if (dead && INDEX_IS_DEAD(dead, slot))
+				continue;
+			matches[nmatches].id = INDEX_IDS(hdr)[slot];
+			size = INDEX_SIZES(hdr)[slot];
+		} else {
+			matches[nmatches].id = INDEX_IDS(delta)[slot - hdr->nfingerprints];
+			size = INDEX_SIZES(delta)[slot - hdr->nfingerprints];
+		}
+		matches[nmatches].score = num / (float)(query_elemc + size - num);
+		nmatches++;
+	}
+	qsort(matches, nmatches, sizeof(IndexMatch), cmp_index_match);
+
+	old_ctx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(old_ctx);
+
+	for (i = 0; i < nmatches && i < k; i++) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+		values[0] = Int64GetDatum(matches[i].id);
+		values[1] = Float4GetDatum(matches[i].score);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(matches);
+	pfree(touched);
+	return (Datum)0;
+}
+
+// Hands the changes to the worker once the modifying transaction has committed. Waking it up right away
+// (from the trigger) could have it read the rows from a snapshot without them and consider itself up to date.
+// COMMIT callbacks run after the transaction became visible to everyone.
+static void echoprint_index_xact_callback(XactEvent event, void *arg)
+{
+	switch (event) {
+	case XACT_EVENT_COMMIT:
+	// the rows are visible only after COMMIT PREPARED (maybe in another backend), this is the last chance though
+	case XACT_EVENT_PREPARE:
+		if ((rebuild_at_commit || nchanged_ids > 0) && index_shared) {
+			LWLockAcquire(index_shared->delta_lock, LW_EXCLUSIVE);
+			// the worker reads the rows again anyways, so a full list just means it reads all of them
+			if (rebuild_at_commit || index_shared->nchanged + nchanged_ids > INDEX_MAX_CHANGED) {
+				index_shared->rebuild = true;
+			} else {
+				memcpy(index_shared->changed + index_shared->nchanged, changed_ids, sizeof(int64) * nchanged_ids);
+				index_shared->nchanged += nchanged_ids;
+			}
+			if (index_shared->latch)
+				SetLatch(index_shared->latch);
+			LWLockRelease(index_shared->delta_lock);
+		}
+		// fall through
+	case XACT_EVENT_ABORT:
+		// the ids live in TopTransactionContext, which goes away with the transaction
+		changed_ids = NULL;
+		nchanged_ids = 0;
+		changed_ids_capacity = 0;
+		rebuild_at_commit = false;
+		break;
+	default:
+		break;
+	}
+}
+
+static void echoprint_index_record(HeapTuple tuple, TupleDesc tupdesc, int attnum)
+{
+	Datum id;
+	bool isnull;
+
+	if (!tuple || rebuild_at_commit)
+		return;
+	id = heap_getattr(tuple, attnum, tupdesc, &isnull);
+	if (isnull)
+		return;
+
+	if (nchanged_ids == changed_ids_capacity) {
+		if (changed_ids_capacity == INDEX_MAX_CHANGED) {
+			rebuild_at_commit = true;
+			return;
+		}
+		changed_ids_capacity = changed_ids_capacity ? Min(changed_ids_capacity * 2, INDEX_MAX_CHANGED) : 64;
+		changed_ids = changed_ids
+			? repalloc(changed_ids, sizeof(int64) * changed_ids_capacity)
+			: MemoryContextAlloc(TopTransactionContext, sizeof(int64) * changed_ids_capacity);
+	}
+	changed_ids[nchanged_ids++] = DatumGetInt64(id);
+}
+
+// Trigger on the fingerprint table. Fired for every row, it collects the ids of the changed fingerprints, which
+// are merged into the index once the transaction commits. Fired for a statement (TRUNCATE, bulk loads)
+// the index is rebuilt from the whole table instead.
+Datum echoprint_index_invalidate(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *)fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "echoprint_index_invalidate: not called by trigger manager");
+
+	if (index_shared) {
+		if (!xact_callback_registered) {
+			RegisterXactCallback(echoprint_index_xact_callback, NULL);
+			xact_callback_registered = true;
+		}
+
+		if (TRIGGER_FIRED_FOR_ROW(trigdata->tg_event)) {
+			TupleDesc tupdesc = RelationGetDescr(trigdata->tg_relation);
+			int attnum = SPI_fnumber(tupdesc, "id");
+
+			if (attnum <= 0) {
+				rebuild_at_commit = true;
+			} else {
+				// an UPDATE might even change the id, the old one is gone then
+				echoprint_index_record(trigdata->tg_trigtuple, tupdesc, attnum);
+				if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+					echoprint_index_record(trigdata->tg_newtuple, tupdesc, attnum);
+			}
+		} else {
+			rebuild_at_commit = true;
+		}
+	}
+	return PointerGetDatum(NULL);
+}
@@ -0,0 +1,7 @@
+// What this build of the module can do, so a host can tell without running it: appended to taglib.js
+// (see Dockerfile), it is a property of the factory. Modules built before it have none of these.
+// Whenever something changes how the module is driven, it gets a name here.
+//   io_read          Module["io_read"], parts of the file are read on demand instead of io_buffer
+//   read_tags_batch  _read_tags_batch, the tags of many files with one instance
+//   write_tags_file  _write_tags_file, writing the tags of many files with one instance
+TagLib["features"] = ["io_read", "read_tags_batch", "write_tags_file"];
@@ -8,15 +8,211 @@
 
 #include <tiostream.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
 using namespace std;
 using namespace TagLib;
 
-/* This is a wrapper for an external nodejs input stream that directly uses a given input buffer
- * (passed as Module.io_buffer)
+/* Where the original bytes of a file come from */
+class Source {
+public:
+    virtual ~Source() {}
+    virtual unsigned long length() const = 0;
+    /* returns the bytes at offset, length is reduced to what is available in one go */
+    virtual const char *map(unsigned long offset, unsigned long &length) = 0;
+    /* copies [offset, offset + length) into Module.io_buffer at the given position */
+    virtual void exportRange(unsigned long offset, unsigned long length, unsigned long position) = 0;
+};
+
+/* The whole file given as Module.io_buffer, copied into the wasm heap once */
+class BufferSource : public Source {
+    std::vector<char> data;
+public:
+    BufferSource() {
+        data.resize(EM_ASM_INT(return Module["io_buffer"].length));
+        if (!data.empty())
+            EM_ASM_(HEAPU8.set(Module["io_buffer"], $0), data.data());
+    }
+    unsigned long length() const { return data.size(); }
+    const char *map(unsigned long offset, unsigned long &length) {
+        return data.data() + offset;
+    }
+    void exportRange(unsigned long offset, unsigned long length, unsigned long position) {
+        EM_ASM_(Module["io_buffer"].set(HEAPU8.subarray($0, $0 + $1), $2), data.data() + offset, length, position);
+    }
+};
+
+/* A file of Module.io_length bytes which is read on demand through Module.io_read(position, length)
+ * (returning a Buffer, like a pread). Tags sit at the head and the tail of a file, so reading them
+ * only touches a few pages, no matter how big the file is. Recently used pages are kept around.
+ * Files of a batch (see read_tags_batch) use Module.batch_length(file)/Module.batch_read(file, position, length).
+ */
+#define PAGE_SIZE 65536
+#define PAGE_CACHE_SIZE 16
+
+class PagedSource : public Source {
+    struct Page {
+        long index = -1;
+        unsigned long length = 0;
+        unsigned long lastUse = 0;
+        std::vector<char> data;
+    };
+
+    int file;
+    unsigned long size;
+    unsigned long uses = 0;
+    Page pages[PAGE_CACHE_SIZE];
+
+    Page &fetch(long index) {
+        Page *victim = &pages[0];
+        for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
+            if (pages[i].index == index) {
+                pages[i].lastUse = ++uses;
+                return pages[i];
+            }
+            if (pages[i].lastUse < victim->lastUse)
+                victim = &pages[i];
+        }
+        victim->data.resize(PAGE_SIZE);
+        victim->index = index;
+        victim->lastUse = ++uses;
+        victim->length = EM_ASM_INT({
+            var buf = $3 < 0 ? Module["io_read"]($1, $2) : Module["batch_read"]($3, $1, $2);
+            HEAPU8.set(buf, $0);
+            return buf.length;
+        }, victim->data.data(), (double)index * PAGE_SIZE, PAGE_SIZE, file);
+        return *victim;
+    }
+
+public:
+    PagedSource(int file = -1) : file(file) {
+        size = EM_ASM_DOUBLE(return $0 < 0 ? Module["io_length"] : Module["batch_length"]($0), file);
+    }
+    unsigned long length() const { return size; }
+    const char *map(unsigned long offset, unsigned long &length) {
+        Page &page = fetch(offset / PAGE_SIZE);
+        unsigned long skip = offset % PAGE_SIZE;
+        /* a short page other than the last one means the file shrunk in the meantime */
+        length = skip < page.length ? std::min(length, page.length - skip) : 0;
+        return page.data.data() + skip;
+    }
+    void exportRange(unsigned long offset, unsigned long length, unsigned long position) {
+        EM_ASM_(Module["io_buffer"].set($3 < 0 ? Module["io_read"]($0, $1) : Module["batch_read"]($3, $0, $1), $2),
+            (double)offset, length, position, file);
+    }
+};
+
+static uint32_t syncsafe(const ByteVector &v, int at) {
+    return ((v[at] & 0x7f) << 21) | ((v[at + 1] & 0x7f) << 14) | ((v[at + 2] & 0x7f) << 7) | (v[at + 3] & 0x7f);
+}
+
+/* An in-memory stream over the file given by a Source.
+ * Once fetched, the bytes live in the wasm heap, so reads, seeks etc. don't cross into JS
+ * (TagLib does lots of small reads while scanning frames).
+ * Modifications never touch the original bytes, they are recorded in a piece table instead: the file is
+ * a sequence of pieces, each referring to a range of either the original bytes or the bytes added
+ * by writes/inserts. An edit only splits and replaces pieces, so saving a tag which touches several
+ * regions (e.g. grows the ID3v2 tag and rewrites the ID3v1 tag) doesn't copy the file again and again.
+ * If the file was modified, exportChanges() hands it back to JS, see there.
  */
-class JsIOStream : public TagLib::IOStream {
+/* unchanged bytes between two differing ones which are rather written again than starting another patch */
+#define PATCH_GAP 64
+
+class HeapIOStream : public TagLib::IOStream {
+    struct Piece {
+        bool added;             // refers to added instead of original
+        unsigned long offset;   // within original/added
+        unsigned long length;
+    };
+
+    std::unique_ptr<Source> original;
+    std::vector<char> added;
+    std::vector<Piece> pieces;
+    std::vector<unsigned long> starts;  // file position of every piece
+    unsigned long size = 0;
     long pos = 0;
+    bool modified = false;
+
+    /* appends [skip, skip + length) of the given piece */
+    void appendPiece(ByteVector &out, const Piece &piece, unsigned long skip, unsigned long length) {
+        if (piece.added) {
+            out.append(ByteVector(added.data() + piece.offset + skip, length));
+            return;
+        }
+        while (length > 0) {
+            unsigned long chunk = length;
+            const char *data = original->map(piece.offset + skip, chunk);
+            if (chunk == 0)
+                break;
+            out.append(ByteVector(data, chunk));
+            skip += chunk;
+            length -= chunk;
+        }
+    }
+
+    void updateStarts() {
+        starts.resize(pieces.size());
+        size = 0;
+        for (size_t i = 0; i < pieces.size(); i++) {
+            starts[i] = size;
+            size += pieces[i].length;
+        }
+    }
+
+    /* makes sure a piece starts at the given position (<= size), returns its index */
+    size_t split(unsigned long at) {
+        size_t i = std::upper_bound(starts.begin(), starts.end(), at) - starts.begin();
+        if (i == 0 || at == size)
+            return i == 0 ? 0 : pieces.size();
+        i--;
+        if (starts[i] == at)
+            return i;
+        Piece tail = pieces[i];
+        unsigned long headLength = at - starts[i];
+        pieces[i].length = headLength;
+        tail.offset += headLength;
+        tail.length -= headLength;
+        pieces.insert(pieces.begin() + i + 1, tail);
+        starts.insert(starts.begin() + i + 1, at);
+        return i + 1;
+    }
+
+    /* replaces [start, start + length) with the given bytes, everything after moves accordingly */
+    void replace(unsigned long start, unsigned long length, const char *data, unsigned long dataLength) {
+        if (start > size) {
+            /* writing behind the end fills the gap with zeros */
+            std::vector<char> gap(start - size, 0);
+            replace(size, 0, gap.data(), gap.size());
+        }
+        length = std::min(length, size - start);
+        size_t first = split(start);
+        size_t last = split(start + length);
+        pieces.erase(pieces.begin() + first, pieces.begin() + last);
+        if (dataLength > 0) {
+            Piece piece = {true, (unsigned long)added.size(), dataLength};
+            added.insert(added.end(), data, data + dataLength);
+            pieces.insert(pieces.begin() + first, piece);
+        }
+        updateStarts();
+        modified = true;
+    }
+
 public:
+    HeapIOStream(Source *source) : original(source) {
+        if (original->length() > 0) {
+            Piece piece = {false, 0, original->length()};
+            pieces.push_back(piece);
+        }
+        updateStarts();
+    }
+
     FileName name() const {
         /* TODO, this might be used for recognition, so pass it in properly e.g. through Module["io_filename"] */
         return ".mp3";
@@ -25,58 +221,46 @@ public:
     bool isOpen() const { return true; }
 
     ByteVector readBlock(unsigned long length) {
-        ByteVector ret = ByteVector(length, 0);
-        length = EM_ASM_INT({
-            var buf = Module["io_buffer"];
-            var len = Math.min($1, buf.length - $2);
-            HEAPU8.set(buf.subarray($2, $2 + len), $0);
-            return len;
-        }, ret.data(), length, this->pos);
-        ret.setData(ret.data(), length);
-        this->pos += length;
+        if (pos < 0 || (unsigned long)pos >= size)
+            return ByteVector();
+        length = std::min(length, size - pos);
+
+        size_t i = std::upper_bound(starts.begin(), starts.end(), (unsigned long)pos) - starts.begin() - 1;
+        unsigned long skip = pos - starts[i];
+        ByteVector ret;
+        for (unsigned long done = 0, chunk; done < length; done += chunk, i++, skip = 0) {
+            chunk = std::min(length - done, pieces[i].length - skip);
+            appendPiece(ret, pieces[i], skip, chunk);
+        }
+        pos += length;
         return ret;
     }
 
-    void writeBlock(const ByteVector &data) {
-        EM_ASM_(({
-            var buf = Module["io_buffer"];
-            var bufs = [
-                buf.slice(0, $2),
-                new Buffer(HEAPU8.subarray($0, $0 + $1)),
-                buf.slice($2 + $1),
-            ];
-            Module["io_buffer"] = Buffer.concat(bufs);
-            return bufs[1].length;
-        }), data.data(), data.size(), this->pos);
-        this->pos += data.size();
+    void writeBlock(const ByteVector &block) {
+        replace(pos, block.size(), block.data(), block.size());
+        pos += block.size();
     }
 
     void removeBlock(unsigned long start = 0, unsigned long length = 0) {
-        EM_ASM_({
-            var buf = Module["io_buffer"];
-            Module["io_buffer"] = Buffer.concat([buf.slice(0, $0), buf.slice($0 + $1)]);
-        }, start, length);
-        this->pos = this->length();
+        if (start < size)
+            replace(start, length, NULL, 0);
+        pos = size;
     }
 
-    void insert(const ByteVector &data, unsigned long start = 0, unsigned long replace = 0) {
-        EM_ASM_({
-            var buf = Module["io_buffer"];
-            Module["io_buffer"] = Buffer.concat([
-                buf.slice(0, $2),                           // the fragment before
-                new Buffer(HEAPU8.subarray($0, $0 + $1)),   // the newly inserted data
-                buf.slice($2 + $3)                          // the remaining data after the replace
-            ]);
-        }, data.data(), data.size(), start, replace);
-        this->pos = start + data.size();
+    void insert(const ByteVector &block, unsigned long start = 0, unsigned long replaceLength = 0) {
+        replace(start, replaceLength, block.data(), block.size());
+        pos = start + block.size();
     }
 
     long length() {
-        return EM_ASM_INT(return Module["io_buffer"].length);
+        return size;
     }
 
     void truncate(long length) {
-        EM_ASM_(Module["io_buffer"].slice(0, $1), length);
+        if ((unsigned long)length < size)
+            replace(length, size - length, NULL, 0);
+        else if ((unsigned long)length > size)
+            replace(length, 0, NULL, 0);
     }
 
     long tell() const { return pos; }
@@ -92,6 +276,128 @@ public:
             throw std::invalid_argument("position: not supported seek point");
         }
     }
+
+    /* true if every original byte is still where it was, so the changes can be written in place */
+    bool inPlace() const {
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (!pieces[i].added && starts[i] != pieces[i].offset)
+                return false;
+        }
+        return true;
+    }
+
+    /* grows the padding of the ID3v2 tag at the start of the file by the given number of bytes */
+    void reservePadding(unsigned long padding) {
+        seek(0);
+        ByteVector header = readBlock(10);
+        /* a tag with a footer must not have padding */
+        if (padding == 0 || header.size() < 10 || header[0] != 'I' || header[1] != 'D' || header[2] != '3' ||
+                (header[5] & 0x10))
+            return;
+        unsigned long tagSize = syncsafe(header, 6);
+        if (tagSize + padding >= (1 << 28))
+            return;
+        std::vector<char> zeros(padding, 0);
+        replace(10 + tagSize, 0, zeros.data(), padding);
+        tagSize += padding;
+        char encoded[4] = {(char)((tagSize >> 21) & 0x7f), (char)((tagSize >> 14) & 0x7f),
+                           (char)((tagSize >> 7) & 0x7f), (char)(tagSize & 0x7f)};
+        replace(6, 4, encoded, 4);
+    }
+
+    /* Hands the modifications back to JS. If the original bytes didn't move (e.g. the new tag fit into the old
+     * one and its padding) only the bytes which actually differ are handed back, as
+     * Module.io_patches = {length, ranges: [{position, data}]}, to be written in place.
+     * Otherwise the whole file is assembled in a single pass and handed back as Module.io_buffer.
+     */
+    void exportChanges() {
+        if (!modified)
+            return;
+        if (inPlace())
+            exportPatches();
+        else
+            exportBuffer();
+    }
+
+private:
+    void exportPatch(unsigned long position, const char *data, unsigned long length) {
+        EM_ASM_(Module["io_patches"]["ranges"].push({position: $0, data: new Buffer(HEAPU8.subarray($1, $1 + $2))}),
+            (double)position, data, length);
+    }
+
+    void exportPatches() {
+        EM_ASM_((Module["io_patches"] = {length: $0, ranges: []}), (double)size);
+        /* TagLib renders the whole tag even if a single frame changed, compare against what's there */
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (!pieces[i].added)
+                continue;
+            const char *data = added.data() + pieces[i].offset;
+            unsigned long start = starts[i], end = start + pieces[i].length;
+            long first = -1, last = 0;
+            for (unsigned long p = start; p < end;) {
+                unsigned long chunk = end - p;
+                const char *old = NULL;
+                if (p < original->length()) {
+                    chunk = std::min(end, original->length()) - p;
+                    old = original->map(p, chunk);
+                }
+                if (chunk == 0) {
+                    old = NULL;
+                    chunk = end - p;
+                }
+                for (unsigned long k = 0; k < chunk; k++, p++) {
+                    if (old && data[p - start] == old[k])
+                        continue;
+                    if (first >= 0 && p - last > PATCH_GAP) {
+                        exportPatch(first, data + (first - start), last - first);
+                        first = -1;
+                    }
+                    if (first < 0)
+                        first = p;
+                    last = p + 1;
+                }
+            }
+            if (first >= 0)
+                exportPatch(first, data + (first - start), last - first);
+        }
+    }
+
+    /* assembles the (modified) file in a single pass and hands it back to JS as Module.io_buffer */
+    void exportBuffer() {
+        EM_ASM_((Module["io_buffer"] = Buffer.allocUnsafe($0)), size);
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (pieces[i].added) {
+                EM_ASM_(Module["io_buffer"].set(HEAPU8.subarray($0, $0 + $1), $2),
+                    added.data() + pieces[i].offset, pieces[i].length, starts[i]);
+            } else {
+                original->exportRange(pieces[i].offset, pieces[i].length, starts[i]);
+            }
+        }
+    }
+};
+
+/* Spans of the reads and writes for the timeline of the host (see tool/src/main/trace.ts). They're only taken if
+ * the host sets Module.trace_now() and Module.trace_span(name, file, start), which it calls as they end, file being
+ * the index of a batch or -1. Without those a span costs a test of a flag.
+ */
+static bool tracing() {
+    static int enabled = -1;
+    if (enabled < 0)
+        enabled = EM_ASM_INT(return !!(Module["trace_now"] && Module["trace_span"]));
+    return enabled;
+}
+
+class TraceSpan {
+    const char *name;
+    int file;
+    double start;
+public:
+    TraceSpan(const char *name, int file) : name(name), file(file),
+        start(tracing() ? EM_ASM_DOUBLE(return Module["trace_now"]()) : -1) {}
+    ~TraceSpan() {
+        if (start >= 0)
+            EM_ASM_(Module["trace_span"](Pointer_stringify($0), $1, $2), name, file, start);
+    }
 };
 
 /* WriteXY: Fetch a given <type> value from JS and serialize it to the given input buffer */
@@ -130,11 +436,251 @@ public:
 #define READ_TAG_INT(attr, cb) EM_ASM_((Module["tags"]attr = Module["tags"]attr || $0), cb);
 #define READ_TAG_STRING(attr, cb) EM_ASM_((Module["tags"][attr] = Pointer_stringify($0) || Module["tags"][attr] || null), cb);
 
+/* Batch reading of tags, for many files per module instance and without marshalling every single field.
+ * The host provides Module.batch_length(file) and Module.batch_read(file, position, length) for the files
+ * 0..count-1 and calls _read_tags_batch(count). It returns a flat buffer of _tags_batch_size() bytes
+ * (valid until the next call) of little endian uint32s:
+ *   count, stringsOffset
+ *   count records of BATCH_RECORD_WORDS: valid, year, track, then offset and length of every BatchField
+ *   the UTF-8 bytes of all strings, offsets are relative to stringsOffset
+ */
+enum BatchField { BATCH_TITLE, BATCH_ARTIST, BATCH_ALBUM, BATCH_COMMENT, BATCH_GENRE, BATCH_FIELDS };
+#define BATCH_RECORD_WORDS (3 + 2 * BATCH_FIELDS)
+
+static std::vector<char> batchResult;
+
+extern "C" {
+
+EMSCRIPTEN_KEEPALIVE const char *read_tags_batch(int count) {
+    std::vector<uint32_t> records(2 + count * BATCH_RECORD_WORDS, 0);
+    std::string strings;
+    records[0] = count;
+
+    for (int i = 0; i < count; i++) {
+        TraceSpan span("taglib read", i);
+        uint32_t *record = &records[2 + i * BATCH_RECORD_WORDS];
+        HeapIOStream stream(new PagedSource(i));
+        /* the audio properties aren't needed, which saves looking for the first frame */
+        TagLib::FileRef f(&stream, false);
+        TagLib::Tag *tag = f.tag();
+        if (!tag)
+            continue;
+
+        record[0] = 1;
+        record[1] = tag->year();
+        record[2] = tag->track();
+        TagLib::String values[BATCH_FIELDS] = {tag->title(), tag->artist(), tag->album(), tag->comment(), tag->genre()};
+        for (int j = 0; j < BATCH_FIELDS; j++) {
+            std::string utf8 = values[j].to8Bit(true);
+            record[3 + 2 * j] = strings.size();
+            record[4 + 2 * j] = utf8.size();
+            strings += utf8;
+        }
+    }
+
+    records[1] = records.size() * sizeof(uint32_t);
+    batchResult.resize(records[1] + strings.size());
+    memcpy(batchResult.data(), records.data(), records[1]);
+    memcpy(batchResult.data() + records[1], strings.data(), strings.size());
+    return batchResult.data();
+}
+
+EMSCRIPTEN_KEEPALIVE int tags_batch_size() {
+    return batchResult.size();
+}
+
+}
+
+/* Attached pictures are described rather than copied to JS: Module.tags.id3v2.attachedPicture holds
+ * {type, mime, descr, size, offset, hash} for every APIC frame, where offset is the position of the image
+ * bytes within the file (-1 if they aren't stored as is, e.g. compressed or unsynchronised) and hash
+ * identifies the image. The bytes are only copied (as data) for the pictures listed in Module.picture_data.
+ */
+static std::string pictureHash(const ByteVector &picture) {
+    /* 64 bit FNV-1a, as hex since JS numbers can't hold it */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (auto i = picture.begin(); i != picture.end(); ++i) {
+        h ^= (unsigned char)*i;
+        h *= 0x100000001b3ULL;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+    return hex;
+}
+
+/* Walks the frame headers of the ID3v2 tag at the start of the file and returns where every APIC frame
+ * ends (in file order, like TagLib's frame list), or -1 if its content isn't stored as is.
+ * The image is the last part of the frame, so that's all it takes to locate it.
+ */
+static std::vector<long> pictureFrameEnds(TagLib::IOStream &stream) {
+    std::vector<long> ends;
+    stream.seek(0);
+    ByteVector header = stream.readBlock(10);
+    if (header.size() < 10 || header[0] != 'I' || header[1] != 'D' || header[2] != '3')
+        return ends;
+    int version = header[3];
+    /* v2.2 uses a different frame layout (PIC) */
+    if (version < 3)
+        return ends;
+    bool unsynchronised = header[5] & 0x80;
+    long end = 10 + syncsafe(header, 6);
+    long pos = 10;
+    if (header[5] & 0x40) {
+        stream.seek(pos);
+        ByteVector extended = stream.readBlock(4);
+        if (extended.size() < 4)
+            return ends;
+        pos += version == 4 ? syncsafe(extended, 0) : 4 + extended.toUInt();
+    }
+
+    while (pos + 10 <= end) {
+        stream.seek(pos);
+        ByteVector frame = stream.readBlock(10);
+        /* padding */
+        if (frame.size() < 10 || frame[0] == 0)
+            break;
+        long size = version == 4 ? syncsafe(frame, 4) : frame.mid(4, 4).toUInt();
+        if (frame[0] == 'A' && frame[1] == 'P' && frame[2] == 'I' && frame[3] == 'C') {
+            /* compression, encryption, (v2.4) unsynchronisation and data length indicator change the content */
+            int flags = frame[9] & (version == 4 ? 0x0f : 0xc0);
+            ends.push_back(unsynchronised || flags ? -1 : pos + 10 + size);
+        }
+        pos += 10 + size;
+    }
+    return ends;
+}
+
+/* fetches Module.tags.id3v2.attachedPicture[index][key] (string, number or Buffer), false if it isn't set */
+static bool pictureField(int index, const char *key, std::string &out) {
+    int len = EM_ASM_INT({
+        var value = Module["tags"]["id3v2"]["attachedPicture"][$0][Pointer_stringify($1)];
+        if (value === undefined || value === null) return -1;
+        Module["picture_field"] = Buffer.isBuffer(value) ? value : new Buffer(String(value));
+        return Module["picture_field"].length;
+    }, index, key);
+    if (len < 0)
+        return false;
+    out.resize(len);
+    if (len > 0)
+        EM_ASM_(HEAPU8.set(Module["picture_field"], $0), &out[0]);
+    return true;
+}
+
+/* Makes the APIC frames match Module.tags.id3v2.attachedPicture. Every entry either references an existing
+ * picture by its hash (optionally changing type, mime or descr) or brings a new one as data. Pictures which
+ * aren't referenced are removed, and the same image is never stored twice, so covers can be replaced or
+ * deduplicated without handing any of the existing image bytes back and forth.
+ */
+static void writePictures(TagLib::ID3v2::Tag *tag) {
+    std::vector<TagLib::ID3v2::AttachedPictureFrame *> existing;
+    std::vector<std::string> hashes;
+    auto list = tag->frameList("APIC");
+    for (auto i = list.begin(); i != list.end(); ++i) {
+        if (auto frame = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(*i)) {
+            existing.push_back(frame);
+            hashes.push_back(pictureHash(frame->picture()));
+        }
+    }
+
+    std::vector<bool> keep(existing.size(), false);
+    std::vector<std::string> stored;
+    int count = EM_ASM_INT(return Module["tags"]["id3v2"]["attachedPicture"].length);
+    for (int i = 0; i < count; i++) {
+        std::string data, hash, value;
+        TagLib::ID3v2::AttachedPictureFrame *frame = NULL;
+        if (pictureField(i, "data", data)) {
+            ByteVector picture(data.data(), data.size());
+            hash = pictureHash(picture);
+            if (std::find(stored.begin(), stored.end(), hash) != stored.end())
+                continue;
+            frame = new TagLib::ID3v2::AttachedPictureFrame();
+            frame->setPicture(picture);
+            tag->addFrame(frame);
+        } else if (pictureField(i, "hash", hash)) {
+            if (std::find(stored.begin(), stored.end(), hash) != stored.end())
+                continue;
+            size_t j = std::find(hashes.begin(), hashes.end(), hash) - hashes.begin();
+            if (j == existing.size())
+                continue;
+            frame = existing[j];
+            keep[j] = true;
+        } else {
+            continue;
+        }
+        stored.push_back(hash);
+
+        if (pictureField(i, "type", value))
+            frame->setType((TagLib::ID3v2::AttachedPictureFrame::Type)atoi(value.c_str()));
+        if (pictureField(i, "mime", value))
+            frame->setMimeType(TagLib::String(value, TagLib::String::UTF8));
+        if (pictureField(i, "descr", value))
+            frame->setDescription(TagLib::String(value, TagLib::String::UTF8));
+    }
+
+    for (size_t j = 0; j < existing.size(); j++) {
+        if (!keep[j])
+            tag->removeFrame(existing[j]);
+    }
+}
+
+/* sets the tags given as Module.tags and hands back the changes, see HeapIOStream::exportChanges() */
+static void writeTags(TagLib::FileRef &f, HeapIOStream &stream) {
+    WRITE_TAG_STRING("title", f.tag()->setTitle(vec));
+    WRITE_TAG_STRING("artist", f.tag()->setArtist(vec));
+    WRITE_TAG_STRING("album", f.tag()->setAlbum(vec));
+    WRITE_TAG_STRING("comment", f.tag()->setComment(vec));
+    WRITE_TAG_STRING("genre", f.tag()->setGenre(vec));
+    WRITE_TAG_INT("year", f.tag()->setYear(val));
+    WRITE_TAG_INT("track", f.tag()->setTrack(val));
+
+    if (EM_ASM_INT(return !!(Module["tags"]["id3v2"] && Module["tags"]["id3v2"]["attachedPicture"]))) {
+        if (auto file = dynamic_cast<TagLib::MPEG::File *>(f.file()))
+            writePictures(file->ID3v2Tag(true));
+    }
+    f.save();
+    /* the audio has to move anyways, so leave room for the next edits to be done in place */
+    if (!stream.inPlace())
+        stream.reservePadding(EM_ASM_INT(return Module["io_padding"] || 0));
+    stream.exportChanges();
+}
+
+/* Batch writing: computes what writing Module.tags does to the file given through Module.batch_length(file) and
+ * Module.batch_read(file, position, length), handing back the changes just like a write through main, but a
+ * single module instance can be used for many files. Nothing is written to the file. Returns 0 on success.
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int write_tags_file(int file) {
+    TraceSpan span("taglib write", file);
+    HeapIOStream stream(new PagedSource(file));
+    TagLib::FileRef f(&stream, false);
+    if (f.isNull() || !f.tag())
+        return 1;
+    writeTags(f, stream);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    TagLib::FileRef f(new JsIOStream());
+    TraceSpan span(EM_ASM_INT(return !Module["tags"]) ? "taglib read" : "taglib write", -1);
+    /* the host either hands over the whole file or a way to read parts of it */
+    Source *source;
+    if (EM_ASM_INT(return !!Module["io_read"]))
+        source = new PagedSource();
+    else
+        source = new BufferSource();
+    HeapIOStream stream(source);
     int modeRead = EM_ASM_INT(return !Module["tags"]);
 
+    /* Audio properties are only read if asked for, as Module.io_props: "fast" takes the Xing/VBRI header or
+     * estimates from the first frame, "accurate" may scan the whole stream. By default only the tags are read,
+     * which for MPEG files saves looking for frames and thereby reading the audio at all.
+     */
+    int props = EM_ASM_INT({
+        var props = Module["io_props"];
+        return props == "accurate" ? 2 : props == "fast" ? 1 : 0;
+    });
+    TagLib::FileRef f(&stream, modeRead && props > 0,
+                      props == 2 ? TagLib::AudioProperties::Accurate : TagLib::AudioProperties::Fast);
+
     /* transmutes a given input pointer & length into the respective nodejs buffer */
     EM_ASM((Module["Pointer_bufferify"] = function(data, len) { return new Buffer(HEAPU8.subarray(data, data + len)); }));
 
@@ -150,28 +696,44 @@ int main(int argc, char *argv[])
         READ_TAG_INT(["year"], f.tag()->year());
         READ_TAG_INT(["track"], f.tag()->track());
 
+        if (auto properties = f.audioProperties()) {
+            EM_ASM_((Module["tags"]["audio"] = {length: $0, bitrate: $1, sampleRate: $2, channels: $3}),
+                properties->lengthInMilliseconds(), properties->bitrate(), properties->sampleRate(),
+                properties->channels());
+        }
+
         if (auto file = dynamic_cast<TagLib::MPEG::File *>(f.file())) {
             if (auto tag = file->ID3v2Tag()) {
                 EM_ASM((Module["tags"]["id3v2"] = {}));
 
-                auto list = tag->frameList();
+                std::vector<long> ends = pictureFrameEnds(stream);
+                auto list = tag->frameList("APIC");
+                int n = 0;
                 for (auto i = list.begin(); i != list.end(); ++i) {
-                    cout << "FRAME " << (*i)->frameID() << " " << (*i)->toString() << "\n";
-
                     if (auto frame = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(*i)) {
-                        cout << "ATTACHED PICTURE " << frame << "\n";
+                        ByteVector picture = frame->picture();
+                        long end = ends.size() == list.size() ? ends[n] : -1;
                         EM_ASM_(((Module["tags"]["id3v2"]["attachedPicture"] = (Module["tags"]["id3v2"]["attachedPicture"] || [])).push({
                                 type: $0,
                                 mime: Pointer_stringify($1),
                                 descr: Pointer_stringify($2),
-                                data: Module["Pointer_bufferify"]($3, $4),
+                                size: $3,
+                                offset: $4,
+                                hash: Pointer_stringify($5),
                             })),
                             frame->type(),
-                            frame->mimeType().toCString(),
-                            frame->description().toCString(),
-                            frame->picture().data(),
-                            frame->picture().size()
+                            frame->mimeType().toCString(true),
+                            frame->description().toCString(true),
+                            picture.size(),
+                            end < 0 ? -1 : end - (long)picture.size(),
+                            pictureHash(picture).c_str()
                         );
+                        EM_ASM_({
+                            var wanted = Module["picture_data"];
+                            if (wanted && wanted.indexOf($0) >= 0)
+                                Module["tags"]["id3v2"]["attachedPicture"][$0].data = Module["Pointer_bufferify"]($1, $2);
+                        }, n, picture.data(), picture.size());
+                        n++;
                     }
                 }
             }
@@ -179,19 +741,6 @@ int main(int argc, char *argv[])
     }
     // ... or a write, if some tags are given
     else {
-        WRITE_TAG_STRING("title", f.tag()->setTitle(vec));
-        WRITE_TAG_STRING("artist", f.tag()->setArtist(vec));
-        WRITE_TAG_STRING("album", f.tag()->setAlbum(vec));
-        WRITE_TAG_STRING("comment", f.tag()->setComment(vec));
-        WRITE_TAG_STRING("genre", f.tag()->setGenre(vec));
-        WRITE_TAG_INT("year", f.tag()->setYear(val));
-        WRITE_TAG_INT("track", f.tag()->setTrack(val));
-
-        // TODO:
-        EM_ASM({
-            if (Module["tags"]["id3v2"] && Module["tags"]["id3v2"]["attachedPicture"])
-                throw "attachedPicture write not implemented yet";
-        });
-        f.save();
+        writeTags(f, stream);
     }
 }
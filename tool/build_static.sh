@@ -0,0 +1,12 @@
+#!/bin/bash
+set -e
+# Rebuilds the wasm modules in static/ from ../echoprint and ../taglib, needs to be run whenever the contract
+# between those and src/main/codegen.ts changes (see moduleHas there and the features.js of both)
+echo "Building echoprint-codegen..."
+docker build -t kotori_build_helper ../echoprint
+docker run --rm kotori_build_helper cat /echoprint-codegen/src/codegen.js > static/codegen.js
+docker run --rm kotori_build_helper cat /echoprint-codegen/src/codegen.wasm > static/codegen.wasm
+echo "Building taglib..."
+docker build -t taglib_builder ../taglib
+docker run --rm taglib_builder cat taglib.js > static/taglib.js
+docker run --rm taglib_builder cat taglib.wasm > static/taglib.wasm
@@ -4,7 +4,8 @@
 declare var WebAssembly: any;
 declare var __static: any;
 
-import {FileTags} from '../renderer/store/modules/app'
+import {AudioQuality, FileTags} from '../renderer/store/modules/app'
+import * as trace from './trace';
 
 var fs = require("fs");
 var util = require("util");
@@ -33,28 +34,58 @@ export function init(isMain: boolean) {
     return true;
 }
 
-export type FpCallback = (codes: number[] | null, err: any) => void;
+// timedCodes contains every code along with its time offset, packed as (code << 32) | offset and sorted asc
+// this is what the server uses to rerank candidates by the alignment of their codes in time
+export type FpCallback =
+    (codes: number[] | null, err: any, timedCodes?: number[] | null, quality?: AudioQuality | null) => void;
 
 // TODO: kill the electron-webpack guys, this is ugly!!!
 const staticPath = (!__static || __static.indexOf("undefined") == 0) ? process.argv[2] : __static;
 
-export function getFingerprint(filePath: string, cb: FpCallback | null) {
+// The modules in static/ are prebuilt (see build_static.sh) and may be older than their sources, so anything which
+// changes how a module is driven is only used if the module has it. Every module lists what it has in the features
+// of its factory (see ../echoprint/features.js and ../taglib/features.js), modules built before that have none.
+function moduleHas(file: string, feature: string) {
+    var factory = __non_webpack_require__(path.join(staticPath, file));
+    return (factory.features || []).indexOf(feature) >= 0;
+}
+
+// contents, if given, hands out the contents of the file in case the decoder needs them (see ingest)
+export function getFingerprint(filePath: string, cb: FpCallback | null, contents?: () => Buffer) {
     // node workaround since emscripten will try to use fetch else
     WebAssembly.instantiateStreaming = undefined;
 
     var codegen = __non_webpack_require__(path.join(staticPath, "codegen.js"));
     var buffer = "";
 
-    (<any>codegen)({
-        arguments: [filePath],
+    // codes of files whose audio didn't change are taken from the cache (see index.ts),
+    // if the module was built with it
+    var cacheDir = moduleHas("codegen.js", "cache") ? process.env.ECHOPRINT_CACHE : undefined;
+
+    var traceArguments = moduleHas("codegen.js", "trace") ? trace.codegenArguments() : [];
+
+    (<any>codegen)(Object.assign(trace.codegenOptions(), {
+        arguments: (cacheDir ? ["-c", cacheDir] : []).concat(traceArguments, [filePath]),
+        // older modules ignore it and let ffmpeg read the file
+        input_buffer: moduleHas("codegen.js", "input_buffer") ? contents : undefined,
         wasmBinaryFile: path.join(staticPath, "codegen.wasm"),
         onExit: (code: number) => {
             var codes: number[] | null = null;
+            var timedCodes: number[] | null = null;
+            var quality: AudioQuality | null = null;
             if (buffer[0] == "[") {
                 var data = JSON.parse(buffer);
                 if (data.length != 1) {
                     console.warn("Got more than one file back from codegen (", buffer.length, ")");
                 }
+                if (data[0].quality) {
+                    quality = {
+                        sampleRate: data[0].quality.sample_rate,
+                        bitrate: data[0].quality.bitrate,
+                        bandwidth: data[0].quality.bandwidth,
+                        clippedSamples: data[0].quality.clipped_samples,
+                    };
+                }
                 var raw = new Buffer(data[0].code, "base64");
                 var buf = zlib.unzipSync(raw);
 
@@ -62,55 +93,355 @@ export function getFingerprint(filePath: string, cb: FpCallback | null) {
                 // the search part of echoprint server also does
                 // we stick to that for now.
                 codes = [];
-                // we skip the offsets, as spotify doesn't seem to use them anymore
-                // echoprint-codegen generates ASCII-Hex numbers which are zlib compressed
+                timedCodes = [];
+                // echoprint-codegen generates ASCII-Hex numbers which are zlib compressed,
+                // the first half holds the offsets, the second half the respective codes
                 // https://github.com/spotify/echoprint-server/blob/f9e9b157044ff1b838114c395b83c4187cf6b729/echoprint_server/lib.py
                 for (var i = buf.length / 2; i < buf.length; i += 5) {
                     var elem = parseInt(buf.toString("ascii", i, i + 5), 16);
+                    var offset = parseInt(buf.toString("ascii", i - buf.length / 2, i - buf.length / 2 + 5), 16);
                     codes.push(elem);
+                    // 20 bit code + 32 bit offset still fit into the 53 bits a double represents exactly
+                    timedCodes.push(elem * 0x100000000 + offset);
                 }
+                timedCodes.sort(function (a, b) { return a - b; });
                 codes.sort(function (a, b) { return a - b; });
                 codes = codes.filter(function(item, pos, arr) {
                     return pos == 0 || item != arr[pos - 1];
                 });
             }
-            if (cb) cb(codes, null); cb = null;
+            if (cb) cb(codes, null, timedCodes, quality); cb = null;
         },
         print: (output: string) => {
             buffer += output;
         },
         printErr: () => console.log("An error occurred"),
-        // errors land on stderr anyways (due to child_process.execSync handling pretty much all errors than can occur)
-        // so no need to print them again
+        // errors make the decoder exit, and what ffmpeg (run with -v error) wrote to stderr comes along with
+        // the error, so there's no need to print them
         quit: (status: any, err: any) => { if (cb) cb(null, err); cb = null; },
-    });
+    }));
+}
+
+// taglib modules built before paged reads (see taglib/README.md) need to be given the whole file
+function pagedReads() {
+    return moduleHas("taglib.js", "io_read");
+}
+
+// lets taglib read parts of the given file on demand
+function pagedIO(fd: number): any {
+    if (!pagedReads()) return {io_buffer: fs.readFileSync(fd)};
+    return {
+        io_length: fs.fstatSync(fd).size,
+        io_read: (position: number, length: number) => {
+            var chunk = Buffer.allocUnsafe(length);
+            return chunk.slice(0, fs.readSync(fd, chunk, 0, length, position));
+        },
+    };
+}
+
+// lets taglib read parts of a file which is in memory already
+function bufferIO(buffer: Buffer): any {
+    if (!pagedReads()) return {io_buffer: buffer};
+    return {
+        io_length: buffer.length,
+        io_read: (position: number, length: number) => buffer.slice(position, position + length),
+    };
+}
+
+// extra room reserved in the ID3v2 tag whenever a write has to rewrite the whole file anyways,
+// so following edits (which usually grow the tag a little) can be written in place
+const tagPadding = 16 * 1024;
+
+// backups of a file written in place only hold the bytes that were overwritten, see writeChanges
+const rangeBackupSuffix = ".bak.json";
+const fullBackupSuffix = ".bak";
+
+function removeIfExists(filePath: string) {
+    if (fs.existsSync(filePath)) fs.unlinkSync(filePath);
+}
+
+// backs up the bytes the given ranges are about to overwrite (and the length), so restoreBackup can undo an
+// in place write
+export function backupRanges(filePath: string, fd: number, ranges: {position: number, data: Buffer}[]) {
+    var length = fs.fstatSync(fd).size;
+    var backup = {
+        length: length,
+        ranges: ranges.map((range) => {
+            var original = Buffer.alloc(Math.max(0, Math.min(range.data.length, length - range.position)));
+            fs.readSync(fd, original, 0, original.length, range.position);
+            return {position: range.position, data: original.toString("base64")};
+        }),
+    };
+    fs.writeFileSync(filePath + rangeBackupSuffix, JSON.stringify(backup));
+    removeIfExists(filePath + fullBackupSuffix);
 }
 
-export function metaData(filePath: string, tags: FileTags | null, cb: (tags: FileTags | null, err?: any) => void) {
+// backs up a file which is about to be rewritten as a whole
+export function backupFile(filePath: string) {
+    fs.writeFileSync(filePath + fullBackupSuffix, fs.readFileSync(filePath));
+    removeIfExists(filePath + rangeBackupSuffix);
+}
+
+// applies what taglib handed back after a write: either patches, which are written in place after backing up
+// just the bytes they overwrite, or the whole file (the tag outgrew its padding), which is backed up as a whole
+function writeChanges(filePath: string, fd: number, result: any) {
+    if (result.io_patches) {
+        var patches = result.io_patches;
+        var length = fs.fstatSync(fd).size;
+        backupRanges(filePath, fd, patches.ranges);
+        patches.ranges.forEach((range: any) => fs.writeSync(fd, range.data, 0, range.data.length, range.position));
+        if (patches.length < length) fs.ftruncateSync(fd, patches.length);
+    } else if (result.io_buffer) {
+        backupFile(filePath);
+        fs.writeFileSync(filePath, result.io_buffer);
+    }
+}
+
+// undoes the last write of metaData or of a batch retag (see retag.ts), returns false if there is no backup
+export function restoreBackup(filePath: string) {
+    if (fs.existsSync(filePath + rangeBackupSuffix)) {
+        var backup = JSON.parse(fs.readFileSync(filePath + rangeBackupSuffix, "utf8"));
+        var fd = fs.openSync(filePath, "r+");
+        backup.ranges.forEach((range: any) => {
+            var data = new Buffer(range.data, "base64");
+            fs.writeSync(fd, data, 0, data.length, range.position);
+        });
+        fs.ftruncateSync(fd, backup.length);
+        fs.closeSync(fd);
+        fs.unlinkSync(filePath + rangeBackupSuffix);
+    } else if (fs.existsSync(filePath + fullBackupSuffix)) {
+        fs.writeFileSync(filePath, fs.readFileSync(filePath + fullBackupSuffix));
+        fs.unlinkSync(filePath + fullBackupSuffix);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// how much of the audio properties (tags.audio) metaData reads besides the tags: none (the default, enough for
+// listing a library), "fast" (Xing/VBRI header or estimated from the first frame) or "accurate" (may scan the stream)
+export type PropertiesTier = "fast" | "accurate" | null;
+
+// contents, if given, are used for reading instead of the file
+export function metaData(filePath: string, tags: FileTags | null, cb: (tags: FileTags | null, err?: any) => void,
+                         props: PropertiesTier = null, contents: Buffer | null = null) {
     // node workaround since emscripten will try to use fetch else
     WebAssembly.instantiateStreaming = undefined;
 
     var taglib = __non_webpack_require__(path.join(staticPath, "taglib.js"));
-    var buffer = fs.readFileSync(filePath);
 
-    (<any>taglib)({
+    // tags only live at the head and the tail of a file, so only read what's asked for,
+    // writes are usually patched in place as well (see writeChanges)
+    var fd = tags || !contents ? fs.openSync(filePath, tags ? "r+" : "r") : null;
+    var io = fd === null ? bufferIO(contents!) : pagedIO(fd);
+    if (tags) io.io_padding = tagPadding;
+    else if (props) io.io_props = props;
+
+    (<any>taglib)(Object.assign(io, trace.taglibOptions(() => filePath), {
         wasmBinaryFile: path.join(staticPath, "taglib.wasm"),
-        io_buffer: buffer,
         tags: tags,
         onExit: function(code: number) {
-            if (code == 0) {
-                if (tags) {
-                    // create a backup, TODO: make configurable?
-                    fs.writeFileSync(filePath + ".bak", buffer);
-                    fs.writeFileSync(filePath, this.io_buffer);
-                }
-                cb(this.tags, null);
-            } else cb(null, code);
+            try {
+                if (code == 0 && tags) writeChanges(filePath, fd!, this);
+            } catch (e) {
+                code = e;
+            }
+            if (fd !== null) fs.closeSync(fd);
+            if (code == 0) cb(this.tags, null);
+            else cb(null, code);
         },
         print: (output: string) => {
             console.log("metaDataOut: ", output);
         },
         printErr: (e: any) => console.log("metaData/An error occurred: ", e),
         quit: (status: any, err: any) => { console.log("metaData/quit"); }
+    }));
+}
+
+// Fingerprints a file and reads its tags, reading the file only once: if the fingerprint isn't cached the file is
+// read into memory, fed to ffmpeg from there and its tags are parsed from the very same buffer. On a cache hit
+// the audio isn't needed at all, and only the parts holding the tags are read. With modules predating this (see
+// moduleHas) ffmpeg reads the file itself and the tags are read from the file.
+export type IngestCallback = (codes: number[] | null, timedCodes: number[] | null, tags: FileTags | null,
+                              err?: any, quality?: AudioQuality | null) => void;
+
+export function ingest(filePath: string, cb: IngestCallback) {
+    var contents: Buffer | null = null;
+    getFingerprint(filePath, (codes, err, timedCodes, quality) => {
+        if (err) {
+            cb(null, null, null, err);
+            return;
+        }
+        metaData(filePath, null, (tags, err) => cb(codes, timedCodes || null, tags, err, quality),
+                 null, contents);
+    }, () => contents || (contents = fs.readFileSync(filePath)));
+}
+
+// layout of the result of _read_tags_batch, see taglib/wrapper.cpp
+const batchFields = ["title", "artist", "album", "comment", "genre"];
+const batchRecordWords = 3 + 2 * batchFields.length;
+// files read per call, bounds the number of open files
+const batchSize = 256;
+
+function decodeTagsBatch(buf: Buffer): (FileTags | null)[] {
+    var count = buf.readUInt32LE(0);
+    var strings = buf.readUInt32LE(4);
+    var result: (FileTags | null)[] = [];
+    for (var i = 0; i < count; i++) {
+        var at = 8 + i * batchRecordWords * 4;
+        if (!buf.readUInt32LE(at)) {
+            result.push(null);
+            continue;
+        }
+        var tags: any = {year: buf.readUInt32LE(at + 4), track: buf.readUInt32LE(at + 8)};
+        batchFields.forEach((name, j) => {
+            var offset = strings + buf.readUInt32LE(at + 12 + 8 * j);
+            var length = buf.readUInt32LE(at + 16 + 8 * j);
+            tags[name] = length ? buf.toString("utf8", offset, offset + length) : null;
+        });
+        result.push(tags);
+    }
+    return result;
+}
+
+// reads the tags of many files with a single module instance, the result is in the order of filePaths
+// (null for files which couldn't be read)
+export function metaDataBatch(filePaths: string[], cb: (tags: (FileTags | null)[]) => void) {
+    if (!moduleHas("taglib.js", "read_tags_batch")) {
+        // modules built before the batch API read one file per instance
+        var read: (FileTags | null)[] = [];
+        var next = () => {
+            if (read.length == filePaths.length) cb(read);
+            else metaData(filePaths[read.length], null, (tags) => { read.push(tags); next(); });
+        };
+        next();
+        return;
+    }
+
+    // node workaround since emscripten will try to use fetch else
+    WebAssembly.instantiateStreaming = undefined;
+
+    var taglib = __non_webpack_require__(path.join(staticPath, "taglib.js"));
+    var fds: number[] = [];
+    var start = 0;
+
+    (<any>taglib)(Object.assign(trace.taglibOptions((file) => filePaths[start + file]), {
+        wasmBinaryFile: path.join(staticPath, "taglib.wasm"),
+        noInitialRun: true,
+        noExitRuntime: true,
+        batch_length: (file: number) => fds[file] < 0 ? 0 : fs.fstatSync(fds[file]).size,
+        batch_read: (file: number, position: number, length: number) => {
+            var chunk = Buffer.allocUnsafe(length);
+            return chunk.slice(0, fds[file] < 0 ? 0 : fs.readSync(fds[file], chunk, 0, length, position));
+        },
+        onRuntimeInitialized: function() {
+            var result: (FileTags | null)[] = [];
+            for (start = 0; start < filePaths.length; start += batchSize) {
+                fds = filePaths.slice(start, start + batchSize).map((filePath) => {
+                    try { return fs.openSync(filePath, "r"); } catch (e) { return -1; }
+                });
+                var ptr = this._read_tags_batch(fds.length);
+                result = result.concat(decodeTagsBatch(Buffer.from(this.HEAPU8.buffer, ptr, this._tags_batch_size())));
+                fds.forEach((fd) => { if (fd >= 0) fs.closeSync(fd); });
+            }
+            cb(result);
+        },
+        printErr: (e: any) => console.log("metaDataBatch/An error occurred: ", e),
+    }));
+}
+
+// what writing tags to a file changes, see taglib/wrapper.cpp (HeapIOStream::exportChanges)
+export interface TagChange {
+    filePath: string,
+    error?: any,
+    // of the file the changes were computed for
+    length?: number,
+    // to be written in place
+    patches?: {length: number, ranges: {position: number, data: Buffer}[]},
+    // the whole new file
+    buffer?: Buffer,
+}
+
+// modules built before batch writing take one instance per file and always hand back the whole file
+function computeTagChangesPerFile(taglib: any, jobs: {filePath: string, tags: FileTags}[], changes: TagChange[],
+                                  cb: (changes: TagChange[]) => void) {
+    if (changes.length == jobs.length) {
+        cb(changes.filter((change) => change.error || change.buffer));
+        return;
+    }
+    var job = jobs[changes.length];
+    var change: TagChange = {filePath: job.filePath};
+    var next = () => {
+        changes.push(change);
+        computeTagChangesPerFile(taglib, jobs, changes, cb);
+    };
+    try {
+        var original: Buffer = fs.readFileSync(job.filePath);
+    } catch (e) {
+        change.error = e;
+        next();
+        return;
+    }
+    change.length = original.length;
+
+    taglib({
+        wasmBinaryFile: path.join(staticPath, "taglib.wasm"),
+        io_buffer: original,
+        tags: job.tags,
+        onExit: function(code: number) {
+            if (code != 0) change.error = "unsupported file";
+            else if (!original.equals(this.io_buffer)) change.buffer = this.io_buffer;
+            next();
+        },
+        printErr: (e: any) => console.log("computeTagChanges/An error occurred: ", e),
     });
 }
+
+// computes the changes of writing tags to many files with a single module instance, without writing anything
+// (nothing is reported for files which wouldn't change)
+export function computeTagChanges(jobs: {filePath: string, tags: FileTags}[], cb: (changes: TagChange[]) => void) {
+    // node workaround since emscripten will try to use fetch else
+    WebAssembly.instantiateStreaming = undefined;
+
+    var taglib = __non_webpack_require__(path.join(staticPath, "taglib.js"));
+    if (!moduleHas("taglib.js", "write_tags_file")) {
+        computeTagChangesPerFile(taglib, jobs, [], cb);
+        return;
+    }
+    var fd = -1;
+    var current: string | undefined;
+
+    (<any>taglib)(Object.assign(trace.taglibOptions(() => current), {
+        wasmBinaryFile: path.join(staticPath, "taglib.wasm"),
+        noInitialRun: true,
+        noExitRuntime: true,
+        io_padding: tagPadding,
+        batch_length: (file: number) => fs.fstatSync(fd).size,
+        batch_read: (file: number, position: number, length: number) => {
+            var chunk = Buffer.allocUnsafe(length);
+            return chunk.slice(0, fs.readSync(fd, chunk, 0, length, position));
+        },
+        onRuntimeInitialized: function() {
+            var changes: TagChange[] = jobs.map((job) => {
+                var change: TagChange = {filePath: job.filePath};
+                current = job.filePath;
+                try {
+                    fd = fs.openSync(job.filePath, "r");
+                    change.length = fs.fstatSync(fd).size;
+                    this.tags = job.tags;
+                    this.io_patches = this.io_buffer = undefined;
+                    if (this._write_tags_file(0) != 0) change.error = "unsupported file";
+                    change.patches = this.io_patches;
+                    change.buffer = this.io_buffer;
+                } catch (e) {
+                    change.error = e;
+                }
+                if (fd >= 0) fs.closeSync(fd);
+                fd = -1;
+                return change;
+            });
+            cb(changes.filter((change) => change.error || change.patches || change.buffer));
+        },
+        printErr: (e: any) => console.log("computeTagChanges/An error occurred: ", e),
+    }));
+}
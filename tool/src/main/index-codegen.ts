@@ -1,6 +1,7 @@
 // entrypoint for the generated codegen.js
 
 import * as codegen from './codegen';
+import {RetagJob, prepareEntries} from './retag';
 
 if (!codegen.init(false)) {
     console.error("Could not find ffmpeg!");
@@ -14,8 +15,24 @@ function handleError(err: any) {
     }
 }
 
+// compute the changes of a batch of retag jobs (sent by the parent process), see retag.ts
+if (process.argv[3] == "--retag") {
+    process.on('message', (jobs: RetagJob[]) => {
+        codegen.computeTagChanges(jobs, (changes) => {
+            process.send!(prepareEntries(changes));
+            process.exit(0);
+        });
+    });
+// read the tags of a batch of files (sent by the parent process) for listing them
+} else if (process.argv[3] == "--tags") {
+    process.on('message', (filePaths: string[]) => {
+        codegen.metaDataBatch(filePaths, (tags) => {
+            process.send!(tags);
+            process.exit(0);
+        });
+    });
 // write tags to the given file
-if (process.argv[3] == "--write") {
+} else if (process.argv[3] == "--write") {
     // wait until we get the new metadata from the parent process
     process.on('message', (m) => {
         codegen.metaData(process.argv[4], m, (tags, err) => {
@@ -25,12 +42,9 @@ if (process.argv[3] == "--write") {
         });
     });
 } else {
-    codegen.getFingerprint(process.argv[3], (codes, err) => {
+    codegen.ingest(process.argv[3], (codes, timedCodes, tags, err, quality) => {
         handleError(err);
-        codegen.metaData(process.argv[3], null, (tags, err) => {
-            handleError(err);
-            process.send!({ codes, tags });
-            process.exit(0);
-        });
+        process.send!({ codes, timedCodes, tags, quality });
+        process.exit(0);
     });
 }
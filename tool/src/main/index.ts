@@ -1,6 +1,8 @@
 import { app, dialog, BrowserWindow, ipcMain } from 'electron';
 import {FileTags} from '../renderer/store/modules/app'
 import * as codegen from './codegen';
+import * as retag from './retag';
+import {RetagJob} from './retag';
 
 const path = require("path");
 const child_process = require("child_process");
@@ -16,6 +18,11 @@ var winURL: string = process.env.NODE_ENV === 'development'
   ? `http://localhost:9080`
   : `file://${__dirname}/index.html`;
 
+// journal of the current batch retag, see retag.ts
+function retagJournal() {
+  return path.join(app.getPath("userData"), "retag.journal");
+}
+
 // register an asynchronous IPC interface we'll use for communication with renderer
 function registerEventHandler() {
   // TODO: ugly
@@ -23,7 +30,9 @@ function registerEventHandler() {
       val.endsWith(".js")) || path.join(process.resourcesPath, "app.asar", "strip_me"));
 
   ipcMain.on("get-track", (event: any, filePath: string) => {
-      var forked = child_process.fork(path.join(dir, "index-codegen.js"), [__static, filePath]);
+      var forked = child_process.fork(path.join(dir, "index-codegen.js"), [__static, filePath], {
+          env: Object.assign({}, process.env, {ECHOPRINT_CACHE: path.join(app.getPath("userData"), "fingerprints")}),
+      });
       forked.on("message", (msg: any) => {
           // pass the message along to the renderer
           event.sender.send("get-track-result", filePath, msg);
@@ -31,6 +40,16 @@ function registerEventHandler() {
       forked.on("error", (err: any) => console.error("child err ", err));
   });
 
+  // tags of many files at once, so they can be listed before their fingerprints are done
+  ipcMain.on("get-tags-batch", (event: any, filePaths: string[]) => {
+      var forked = child_process.fork(path.join(dir, "index-codegen.js"), [__static, "--tags"]);
+      forked.on("message", (tags: (FileTags | null)[]) => {
+          event.sender.send("get-tags-batch-result", filePaths, tags);
+      });
+      forked.on("error", (err: any) => console.error("child err ", err));
+      forked.send(filePaths);
+  });
+
   ipcMain.on("write-tags", (event: any, filePath: string, meta: FileTags) => {
       var forked = child_process.fork(path.join(dir, "index-codegen.js"), [__static, "--write", filePath]);
       forked.on("message", (msg: any) => {
@@ -39,6 +58,26 @@ function registerEventHandler() {
       forked.on("error", (err: any) => console.error("child err ", err));
       forked.send(meta);
   });
+
+  // undoes the last write to each of the given files, the result maps a file to its error (if any)
+  ipcMain.on("restore-backups", (event: any, filePaths: string[]) => {
+      var errors: {[filePath: string]: any} = {};
+      filePaths.forEach((filePath) => {
+          try {
+              if (!codegen.restoreBackup(filePath)) errors[filePath] = "no backup";
+          } catch (e) {
+              errors[filePath] = String(e);
+          }
+      });
+      event.sender.send("restore-backups-result", errors);
+  });
+
+  ipcMain.on("write-tags-batch", (event: any, jobs: RetagJob[]) => {
+      var spawnWorker = () => child_process.fork(path.join(dir, "index-codegen.js"), [__static, "--retag"]);
+      retag.retag(jobs, retagJournal(), spawnWorker, (results) => {
+          event.sender.send("write-tags-batch-result", results);
+      });
+  });
 }
 
 function createWindow() {
@@ -67,6 +106,8 @@ function createWindow() {
 }
 
 app.on('ready', () => {
+  // finish a batch retag which was interrupted
+  retag.recover(retagJournal());
   createWindow();
 });
 
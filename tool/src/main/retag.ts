@@ -0,0 +1,216 @@
+// Batch retagging: writes tags to many files at once, crash safe through a single journal
+//
+// 1. the changes are computed in parallel by worker processes (index-codegen.js --retag), which don't touch
+//    the files; if a tag doesn't fit in place anymore, the new file is written next to the original
+// 2. the changes of all files are recorded in the journal, which is synced once
+// 3. the changes are applied, files are synced in groups; what they overwrite is backed up first, so the last
+//    write of a file can be undone (see codegen.restoreBackup)
+// 4. the journal is removed
+// Applying an entry is idempotent, so after a crash the journal is simply applied again (see recover).
+
+import {FileTags} from '../renderer/store/modules/app'
+import {TagChange, backupFile, backupRanges} from './codegen'
+
+const fs = require("fs");
+const os = require("os");
+const path = require("path");
+
+// a worker computes at least this many files, so small batches don't spawn a process per file
+const jobsPerWorker = 16;
+// files open at the same time while applying, they are synced together
+const syncGroupSize = 64;
+// complete new files, while they're pending
+const replacementSuffix = ".retag";
+
+export interface RetagJob {
+    filePath: string,
+    tags: FileTags,
+}
+
+export interface RetagEntry {
+    filePath: string,
+    // of the file the changes were computed for
+    length: number,
+    // either changes to be written in place (data is base64)
+    newLength?: number,
+    ranges?: {position: number, data: string}[],
+    // or a complete new file, to be copied over the original
+    replacement?: string,
+}
+
+// filePath -> error (null on success), for every job
+export type RetagResults = {[filePath: string]: any};
+
+function syncDirectory(dir: string) {
+    try {
+        var fd = fs.openSync(dir, "r");
+        fs.fsyncSync(fd);
+        fs.closeSync(fd);
+    } catch (e) {
+        // directories can't be synced on windows
+    }
+}
+
+// turns what computeTagChanges returned into journal entries, done by the workers
+export function prepareEntries(changes: TagChange[]): {entries: RetagEntry[], errors: RetagResults} {
+    var entries: RetagEntry[] = [];
+    var errors: RetagResults = {};
+    changes.forEach((change) => {
+        if (change.error) {
+            errors[change.filePath] = String(change.error);
+            return;
+        }
+        var entry: RetagEntry = {filePath: change.filePath, length: change.length!};
+        try {
+            if (change.patches) {
+                entry.newLength = change.patches.length;
+                entry.ranges = change.patches.ranges.map((range) => {
+                    return {position: range.position, data: range.data.toString("base64")};
+                });
+            } else {
+                entry.replacement = change.filePath + replacementSuffix;
+                var fd = fs.openSync(entry.replacement, "w");
+                fs.writeSync(fd, change.buffer, 0, change.buffer!.length, 0);
+                fs.fsyncSync(fd);
+                fs.closeSync(fd);
+            }
+            entries.push(entry);
+        } catch (e) {
+            errors[change.filePath] = String(e);
+        }
+    });
+    return {entries, errors};
+}
+
+// applies a single entry, returns the fd to be synced (null if there's nothing left to do)
+function applyEntry(entry: RetagEntry, recovering: boolean): number | null {
+    if (entry.replacement) {
+        // the replacement is removed once it has been copied and synced
+        if (!fs.existsSync(entry.replacement)) return null;
+        if (!recovering && fs.statSync(entry.filePath).size != entry.length) {
+            fs.unlinkSync(entry.replacement);
+            throw "file changed in the meantime";
+        }
+        // a recovered entry may have been applied (partly) already, the backup of the first attempt stays
+        if (!recovering) backupFile(entry.filePath);
+        // copied rather than renamed, which keeps permissions, links etc. of the original
+        var data = fs.readFileSync(entry.replacement);
+        var fd = fs.openSync(entry.filePath, "r+");
+        fs.writeSync(fd, data, 0, data.length, 0);
+        fs.ftruncateSync(fd, data.length);
+        return fd;
+    }
+
+    var fd = fs.openSync(entry.filePath, "r+");
+    var size = fs.fstatSync(fd).size;
+    // a recovered entry may have been applied (partly) already
+    if (size != entry.length && !(recovering && size == entry.newLength)) {
+        fs.closeSync(fd);
+        throw "file changed in the meantime";
+    }
+    var ranges = entry.ranges!.map((range) => ({position: range.position, data: new Buffer(range.data, "base64")}));
+    if (!recovering) backupRanges(entry.filePath, fd, ranges);
+    ranges.forEach((range) => fs.writeSync(fd, range.data, 0, range.data.length, range.position));
+    fs.ftruncateSync(fd, entry.newLength);
+    return fd;
+}
+
+function applyEntries(entries: RetagEntry[], recovering: boolean, results: RetagResults) {
+    for (var start = 0; start < entries.length; start += syncGroupSize) {
+        var written: {entry: RetagEntry, fd: number}[] = [];
+        entries.slice(start, start + syncGroupSize).forEach((entry) => {
+            try {
+                var fd = applyEntry(entry, recovering);
+                if (fd !== null) written.push({entry, fd});
+            } catch (e) {
+                results[entry.filePath] = String(e);
+            }
+        });
+        written.forEach(({entry, fd}) => {
+            try {
+                fs.fsyncSync(fd);
+            } catch (e) {
+                results[entry.filePath] = String(e);
+            }
+            fs.closeSync(fd);
+        });
+        // a replacement is only dropped once the file it was copied to is synced
+        written.forEach(({entry}) => {
+            if (entry.replacement && !results[entry.filePath]) fs.unlinkSync(entry.replacement);
+        });
+    }
+}
+
+// completes a batch which was interrupted (e.g. by a crash) after its journal was written
+export function recover(journalPath: string): RetagResults {
+    var results: RetagResults = {};
+    if (!fs.existsSync(journalPath)) return results;
+    var entries: RetagEntry[] = JSON.parse(fs.readFileSync(journalPath, "utf8"));
+    entries.forEach((entry) => results[entry.filePath] = null);
+    applyEntries(entries, true, results);
+    fs.unlinkSync(journalPath);
+    syncDirectory(path.dirname(journalPath));
+    return results;
+}
+
+function writeJournal(journalPath: string, entries: RetagEntry[]) {
+    // written aside and renamed, so there never is a partial journal
+    var tmp = journalPath + ".tmp";
+    var fd = fs.openSync(tmp, "w");
+    fs.writeSync(fd, JSON.stringify(entries));
+    fs.fsyncSync(fd);
+    fs.closeSync(fd);
+    fs.renameSync(tmp, journalPath);
+    syncDirectory(path.dirname(journalPath));
+}
+
+// writes tags to many files, spawnWorker forks index-codegen.js with --retag
+export function retag(jobs: RetagJob[], journalPath: string, spawnWorker: () => any,
+                      cb: (results: RetagResults) => void) {
+    recover(journalPath);
+
+    var results: RetagResults = {};
+    jobs.forEach((job) => results[job.filePath] = null);
+    var workers = Math.min(os.cpus().length, Math.ceil(jobs.length / jobsPerWorker));
+    if (workers == 0) {
+        cb(results);
+        return;
+    }
+
+    var entries: RetagEntry[] = [];
+    var pending = workers;
+    var done = () => {
+        if (--pending > 0) return;
+        try {
+            if (entries.length) {
+                writeJournal(journalPath, entries);
+                applyEntries(entries, false, results);
+                fs.unlinkSync(journalPath);
+            }
+        } catch (e) {
+            // the journal is applied again on the next start (or batch)
+            entries.forEach((entry) => results[entry.filePath] = results[entry.filePath] || String(e));
+        }
+        cb(results);
+    };
+
+    for (var w = 0; w < workers; w++) {
+        let slice = jobs.filter((job, i) => i % workers == w);
+        let finished = false;
+        let forked = spawnWorker();
+        forked.on("message", (msg: {entries: RetagEntry[], errors: RetagResults}) => {
+            if (finished) return;
+            finished = true;
+            entries = entries.concat(msg.entries);
+            Object.assign(results, msg.errors);
+            done();
+        });
+        forked.on("exit", () => {
+            if (finished) return;
+            finished = true;
+            slice.forEach((job) => results[job.filePath] = "computing the tags failed");
+            done();
+        });
+        forked.send(slice);
+    }
+}
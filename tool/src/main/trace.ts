@@ -0,0 +1,56 @@
+// Opt-in timeline of what the codegen and taglib modules do, for finding decode stalls and straggler files.
+// With ECHOPRINT_TRACE=<path> every process writes the spans of its modules as Chrome trace-event JSON to
+// <path>.<pid>.json when it exits, to be opened in chrome://tracing or ui.perfetto.dev.
+
+var fs = require("fs");
+
+const tracePath = process.env.ECHOPRINT_TRACE;
+var events: any[] = [];
+
+function hrNow() {
+    var t = process.hrtime();
+    return t[0] * 1e6 + t[1] / 1e3;
+}
+
+// hrtime has an arbitrary origin, the spans are put on the epoch (in microseconds) like the codegen's own
+const origin = Date.now() * 1000 - hrNow();
+
+export function now() {
+    return origin + hrNow();
+}
+
+function span(name: string, start: number, detail?: string) {
+    events.push({name: name, ph: "X", pid: process.pid, tid: 0, ts: start, dur: now() - start,
+                 args: detail ? {detail: detail} : undefined});
+}
+
+// arguments for a codegen module, which records its spans itself (see echoprint-codegen/src/Trace.h)
+export function codegenArguments(): string[] {
+    return tracePath ? ["-t", tracePath] : [];
+}
+
+// options for a codegen module, it hands over its spans as it exits instead of writing them
+export function codegenOptions() {
+    if (!tracePath) return {};
+    return {trace: (json: string) => { events = events.concat(JSON.parse(json).traceEvents); }};
+}
+
+// options for a taglib module, detail names the file (the index of a batch or -1) a span belongs to
+export function taglibOptions(detail: (file: number) => string | undefined) {
+    if (!tracePath) return {};
+    return {
+        trace_now: now,
+        trace_span: (name: string, file: number, start: number) => span(name, start, detail(file)),
+    };
+}
+
+if (tracePath) {
+    process.on("exit", () => {
+        if (!events.length) return;
+        events.push({name: "thread_name", ph: "M", pid: process.pid, tid: 0, args: {name: "taglib"}});
+        fs.writeFileSync(tracePath + "." + process.pid + ".json", JSON.stringify({
+            traceEvents: events,
+            displayTimeUnit: "ms",
+        }));
+    });
+}
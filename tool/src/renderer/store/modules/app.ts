@@ -15,6 +15,29 @@ export interface FileTags {
     genre: string,
     year: string,
     track: string,
+    // only read if asked for, see codegen.metaData
+    audio?: AudioProperties,
+}
+
+export interface AudioProperties {
+    // in ms
+    length: number,
+    // in kb/s
+    bitrate: number,
+    sampleRate: number,
+    channels: number,
+}
+
+// gathered by codegen while decoding a file for its fingerprint, to rank duplicates by (0 means unknown)
+export interface AudioQuality {
+    // of the decoded stream
+    sampleRate: number,
+    // average over the audio payload, in kb/s
+    bitrate: number,
+    // estimated lowpass cutoff, in Hz
+    bandwidth: number,
+    // full scale samples in runs, within the first minute
+    clippedSamples: number,
 }
 
 export interface File {
@@ -22,7 +45,10 @@ export interface File {
     active: boolean,
     error?: string,
     fp?: number[]
+    // the codes along with their offsets, used by the server to rerank matches
+    timedFp?: number[],
     tags?: FileTags,
+    quality?: AudioQuality,
     // last commited tags
     lastTags?: FileTags,
     tracks?: any[],
@@ -36,6 +62,48 @@ const state: AppState = {
     user: null,
 }
 
+// updates a file after its tags were written
+function tagsWritten(commit: any, file: File, meta: FileTags, error: any) {
+    let lastTags = JSON.parse(JSON.stringify(meta));
+    let changes: any = { error };
+    if (!error) {
+        changes.tags = meta;
+        changes.lastTags = lastTags;
+        if (file.tracks && file.lastTracks) {
+            let lastTracks = [...file.lastTracks!];
+            lastTracks[file.remote!] = JSON.parse(JSON.stringify(file.tracks![file.remote!]));
+            changes.lastTracks = lastTracks;
+        }
+    }
+    commit('UPDATE_FILE', {path: file.path, changes});
+}
+
+// get a fingerprint & meta info from codegen in the background,
+// this goes renderer --> main --> fork and back through 2 layers of IPC
+function fetchTrack(commit: any, state: AppState, path: string) {
+    let cb: any;
+    cb = (event: any, fileName: string, msg: any) => {
+        if (fileName != path) return;
+        ipcRenderer.removeListener("get-track-result", cb);
+        // TODO: handle error
+        let tags = !msg.error && msg.tags ? msg.tags : undefined;
+        // keep what was changed in the meantime, the tags might have been listed already (see addFiles)
+        let file = state.files[path];
+        let edited = file && file.tags && JSON.stringify(file.tags) != JSON.stringify(file.lastTags);
+        let changes = {
+            tags: tags && edited ? Object.assign({}, tags, file.tags) : tags,
+            lastTags: tags ? JSON.parse(JSON.stringify(tags)) : undefined,
+            error: msg.error,
+            fp: !msg.error && msg.codes ? msg.codes : undefined,
+            timedFp: !msg.error && msg.timedCodes ? msg.timedCodes : undefined,
+            quality: !msg.error && msg.quality ? msg.quality : undefined,
+        };
+        commit('UPDATE_FILE', {path, changes});
+    };
+    ipcRenderer.on("get-track-result", cb);
+    ipcRenderer.send("get-track", path);
+}
+
 const mutations = {
     ADD_FILE(state: AppState, file: File) {
         Vue.set(state.files, file.path, file);
@@ -53,27 +121,25 @@ const mutations = {
 }
 
 const actions = {
-    addFile({ commit }: Vuex.Store<AppState>, path:string) {
-        var file: File = {path, active: false, error: undefined, fp: undefined, remote: undefined};
-        // get a fingerprint & meta info from codegen in the background,
-        // this goes renderer --> main --> fork and back through 2 layers of IPC
-        let cb: any;
-        cb = (event: any, fileName: string, msg: any) => {
-            if (fileName != path) return;
-            ipcRenderer.removeListener("get-track-result", cb);
-            // TODO: handle error
-            let tags = !msg.error && msg.tags ? msg.tags : undefined;
-            let changes = {
-                tags,
-                lastTags: tags ? JSON.parse(JSON.stringify(tags)) : undefined,
-                error: msg.error,
-                fp: !msg.error && msg.codes ? msg.codes : undefined,
-            };
-            commit('UPDATE_FILE', {path, changes});
-        };
-        ipcRenderer.on("get-track-result", cb);
-        ipcRenderer.send("get-track", path);
-        commit('ADD_FILE', file);
+    addFiles({ commit, state }: Vuex.Store<AppState>, paths:string[]) {
+        paths = paths.filter((path) => !state.files[path]);
+        if (!paths.length) return;
+        for (let path of paths) {
+            let file: File = {path, active: false, error: undefined, fp: undefined, remote: undefined};
+            commit('ADD_FILE', file);
+            fetchTrack(commit, state, path);
+        }
+        // fingerprinting takes a while, so list the tags of all files right away (a single module reads them all),
+        // the tags read along with the fingerprint replace them later on
+        ipcRenderer.once("get-tags-batch-result", (event: any, filePaths: string[], tags: (FileTags | null)[]) => {
+            filePaths.forEach((path, i) => {
+                let file = state.files[path];
+                if (!file || file.tags || !tags[i]) return;
+                let changes = {tags: tags[i], lastTags: JSON.parse(JSON.stringify(tags[i]))};
+                commit('UPDATE_FILE', {path, changes});
+            });
+        });
+        ipcRenderer.send("get-tags-batch", paths);
     },
     updateFileTags({ commit }: Vuex.Store<AppState>, {file, meta}: {file: File, meta: FileTags}): Promise<void> {
         return new Promise((resolve, reject) => {
@@ -81,24 +147,42 @@ const actions = {
             cb = (event: any, fileName: string, msg: any) => {
                 if (fileName != file.path) return;
                 ipcRenderer.removeListener("write-tags-result", cb);
-                let lastTags = JSON.parse(JSON.stringify(meta));
-                let changes: any = { error: msg.error };
-                if (!msg.error) {
-                    changes.tags = meta;
-                    changes.lastTags = lastTags;
-                    if (file.tracks && file.lastTracks) {
-                        let lastTracks = [...file.lastTracks!];
-                        lastTracks[file.remote!] = JSON.parse(JSON.stringify(file.tracks![file.remote!]));
-                        changes.lastTracks = lastTracks;
-                    }
-                }
-                commit('UPDATE_FILE', {path: file.path, changes});
+                tagsWritten(commit, file, meta, msg.error);
                 if (msg.error) reject(msg.error); else resolve();
             };
             ipcRenderer.on("write-tags-result", cb);
             ipcRenderer.send("write-tags", file.path, meta);
         });
     },
+    // writes the tags of many files at once (journaled, see main/retag.ts), rejects with the first error
+    updateFilesTags({ commit }: Vuex.Store<AppState>, writes: {file: File, meta: FileTags}[]): Promise<void> {
+        return new Promise((resolve, reject) => {
+            ipcRenderer.once("write-tags-batch-result", (event: any, results: {[path: string]: any}) => {
+                let error = null;
+                for (let {file, meta} of writes) {
+                    tagsWritten(commit, file, meta, results[file.path]);
+                    error = error || results[file.path];
+                }
+                if (error) reject(error); else resolve();
+            });
+            ipcRenderer.send("write-tags-batch", writes.map(({file, meta}) => ({filePath: file.path, tags: meta})));
+        });
+    },
+    // undoes the last write of the given files (see main/codegen.ts restoreBackup) and reads them again
+    restoreFiles({ commit, state }: Vuex.Store<AppState>, files: File[]) {
+        ipcRenderer.once("restore-backups-result", (event: any, errors: {[path: string]: any}) => {
+            for (let file of files) {
+                if (errors[file.path]) {
+                    commit('UPDATE_FILE', {path: file.path, changes: {error: errors[file.path]}});
+                    continue;
+                }
+                let changes = {tags: undefined, lastTags: undefined, fp: undefined, timedFp: undefined, error: undefined};
+                commit('UPDATE_FILE', {path: file.path, changes});
+                fetchTrack(commit, state, file.path);
+            }
+        });
+        ipcRenderer.send("restore-backups", files.map((file) => file.path));
+    },
     retainFiles({ commit, state }: Vuex.Store<AppState>, closure: (file:File) => boolean) {
         var newState = Object.assign({}, state.files);
         for (let file of Object.keys(newState).filter((key) => !closure(newState[key]))) {